@@ -0,0 +1,6 @@
+#include "mdf_err.h"
+
+
+mdf_err_t influx_sink_start(void);
+mdf_err_t influx_sink_write(const char *json, size_t len);
+int influx_sink_line(const char *json, size_t len, char *line, size_t line_size);
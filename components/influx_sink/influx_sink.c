@@ -0,0 +1,361 @@
+/*
+ * ESP32 InfluxDB Sink
+ * Copyright (c) 2021, Lorenzo Carnevale <lcarnevale@unime.it>
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+#include "esp_log.h"
+#include "esp_http_client.h"
+
+#include "mdf_err.h"
+#include "mdf_mem.h"
+
+#ifdef CONFIG_INFLUX_SINK_GZIP
+#include "esp32/rom/crc.h"
+#include "esp32/rom/miniz.h"
+#endif
+
+#define JSMN_HEADER
+#include "jsmn.h"
+#include "influx_sink.h"
+
+
+#define INFLUX_SINK_TOKENS 48
+#define INFLUX_SINK_LINE_LEN 512
+#define INFLUX_SINK_BACKOFF_MS 500
+
+/**
+ * @brief Append a token to the line, escaping the characters the line protocol
+ *        reserves for the given position. Returns false when the line is full.
+ */
+static bool line_append(char *line, size_t line_size, size_t *pos, const char *src, int len, const char *escape) {
+    for (int i = 0; i < len; i++) {
+        if (*pos + 2 >= line_size)
+            return false;
+        if (escape && strchr(escape, src[i]))
+            line[(*pos)++] = '\\';
+        line[(*pos)++] = src[i];
+    }
+    line[*pos] = '\0';
+    return true;
+}
+
+static int jsmn_token_eq(const char *json, const jsmntok_t *tok, const char *s) {
+    return tok->type == JSMN_STRING && (int)strlen(s) == tok->end - tok->start &&
+           strncmp(json + tok->start, s, tok->end - tok->start) == 0;
+}
+
+/**
+ * @brief Index of the token following the subtree rooted at index i.
+ */
+static int jsmn_token_skip(const jsmntok_t *tokens, int count, int i) {
+    int pending = 1;
+    for (; i < count && pending > 0; i++) {
+        pending--;
+        if (tokens[i].type == JSMN_OBJECT)
+            pending += tokens[i].size * 2;
+        else if (tokens[i].type == JSMN_ARRAY)
+            pending += tokens[i].size;
+    }
+    return i;
+}
+
+/**
+ * @brief Convert a reading into a line of InfluxDB line protocol.
+ *
+ * The reading is expected in the format produced by the nodes, that is an object
+ * with "measurement", "tags", "fields" and "timestamp". The JSON is only tokenized,
+ * values are copied verbatim. A zero timestamp is left out, so that the server
+ * stamps the point on arrival.
+ *
+ * @return The length of the line, or -1 when the reading is malformed.
+ */
+int influx_sink_line(const char *json, size_t len, char *line, size_t line_size) {
+    jsmn_parser parser;
+    jsmntok_t tokens[INFLUX_SINK_TOKENS];
+    const jsmntok_t *measurement = NULL, *tags = NULL, *fields = NULL, *timestamp = NULL;
+    size_t pos = 0;
+
+    jsmn_init(&parser);
+    int count = jsmn_parse(&parser, json, len, tokens, INFLUX_SINK_TOKENS);
+    if (count < 1 || tokens[0].type != JSMN_OBJECT)
+        return -1;
+
+    for (int i = 1; i + 1 < count; i = jsmn_token_skip(tokens, count, i + 1)) {
+        if (jsmn_token_eq(json, &tokens[i], "measurement"))
+            measurement = &tokens[i + 1];
+        else if (jsmn_token_eq(json, &tokens[i], "tags") && tokens[i + 1].type == JSMN_OBJECT)
+            tags = &tokens[i + 1];
+        else if (jsmn_token_eq(json, &tokens[i], "fields") && tokens[i + 1].type == JSMN_OBJECT)
+            fields = &tokens[i + 1];
+        else if (jsmn_token_eq(json, &tokens[i], "timestamp"))
+            timestamp = &tokens[i + 1];
+    }
+
+    if (!measurement || !fields || fields->size == 0)
+        return -1;
+
+    if (!line_append(line, line_size, &pos, json + measurement->start, measurement->end - measurement->start, ", "))
+        return -1;
+
+    // tags and fields hold flat key/value pairs, which follow their object token
+    for (int k = 0; tags && k < tags->size; k++) {
+        const jsmntok_t *key = tags + 1 + 2 * k, *value = key + 1;
+        if (!line_append(line, line_size, &pos, ",", 1, NULL) ||
+            !line_append(line, line_size, &pos, json + key->start, key->end - key->start, ",= ") ||
+            !line_append(line, line_size, &pos, "=", 1, NULL) ||
+            !line_append(line, line_size, &pos, json + value->start, value->end - value->start, ",= "))
+            return -1;
+    }
+
+    for (int k = 0; k < fields->size; k++) {
+        const jsmntok_t *key = fields + 1 + 2 * k, *value = key + 1;
+        bool quoted = value->type == JSMN_STRING;
+        if (!line_append(line, line_size, &pos, k ? "," : " ", 1, NULL) ||
+            !line_append(line, line_size, &pos, json + key->start, key->end - key->start, ",= ") ||
+            !line_append(line, line_size, &pos, quoted ? "=\"" : "=", quoted ? 2 : 1, NULL) ||
+            !line_append(line, line_size, &pos, json + value->start, value->end - value->start, quoted ? "\"\\" : NULL) ||
+            (quoted && !line_append(line, line_size, &pos, "\"", 1, NULL)))
+            return -1;
+    }
+
+    if (timestamp && timestamp->type == JSMN_PRIMITIVE &&
+        !(timestamp->end - timestamp->start == 1 && json[timestamp->start] == '0')) {
+        if (!line_append(line, line_size, &pos, " ", 1, NULL) ||
+            !line_append(line, line_size, &pos, json + timestamp->start, timestamp->end - timestamp->start, NULL))
+            return -1;
+    }
+
+    return line_append(line, line_size, &pos, "\n", 1, NULL) ? pos : -1;
+}
+
+#ifdef CONFIG_INFLUX_SINK_ENABLE
+
+static const char *TAG = "INFLUX_SINK";
+
+typedef struct {
+    char *data;
+    size_t len;
+    uint16_t points;
+    TickType_t opened;  /* tick of the first point in the batch */
+} influx_batch_t;
+
+static influx_batch_t batch = {0};
+static SemaphoreHandle_t batch_lock = NULL;
+static QueueHandle_t batch_queue = NULL;
+
+static struct {
+    uint32_t points;
+    uint32_t batches;
+    uint32_t retries;
+    uint32_t dropped_points;
+    uint32_t raw_bytes;
+    uint32_t sent_bytes;
+} stats = {0};
+
+#ifdef CONFIG_INFLUX_SINK_GZIP
+static tdefl_compressor *compressor = NULL;
+
+/**
+ * @brief Wrap the raw deflate stream produced by the ROM encoder in a gzip member.
+ *
+ * @return The size of the gzip member, or 0 when it does not fit in out.
+ */
+static size_t gzip_batch(const char *in, size_t in_len, uint8_t *out, size_t out_size) {
+    static const uint8_t header[10] = {0x1f, 0x8b, 0x08, 0, 0, 0, 0, 0, 0, 0xff};
+    if (out_size < sizeof(header) + 8)
+        return 0;
+
+    size_t in_size  = in_len;
+    size_t out_len  = out_size - sizeof(header) - 8;
+    tdefl_init(compressor, NULL, NULL, 128 | TDEFL_GREEDY_PARSING_FLAG);
+    if (tdefl_compress(compressor, in, &in_size, out + sizeof(header), &out_len, TDEFL_FINISH) != TDEFL_STATUS_DONE)
+        return 0;
+
+    memcpy(out, header, sizeof(header));
+    uint32_t trailer[2] = {crc32_le(0, (const uint8_t *)in, in_len), in_len};
+    memcpy(out + sizeof(header) + out_len, trailer, sizeof(trailer));
+    return sizeof(header) + out_len + sizeof(trailer);
+}
+#endif
+
+/**
+ * @brief POST a batch, retrying with exponential backoff on transport errors,
+ *        throttling and server errors. Client errors are not retried.
+ */
+static esp_err_t influx_sink_post(esp_http_client_handle_t client, const char *body, size_t len) {
+    esp_err_t ret = ESP_FAIL;
+    int backoff_ms = INFLUX_SINK_BACKOFF_MS;
+
+    for (int attempt = 0; attempt < CONFIG_INFLUX_SINK_MAX_RETRIES; attempt++) {
+        if (attempt) {
+            stats.retries++;
+            vTaskDelay(pdMS_TO_TICKS(backoff_ms));
+            backoff_ms *= 2;
+        }
+
+        esp_http_client_set_post_field(client, body, len);
+        ret = esp_http_client_perform(client);
+        if (ret != ESP_OK) {
+            ESP_LOGW(TAG, "<%s> write attempt %d", esp_err_to_name(ret), attempt + 1);
+            continue;
+        }
+
+        int status = esp_http_client_get_status_code(client);
+        if (status >= 200 && status < 300)
+            return ESP_OK;
+
+        ESP_LOGW(TAG, "write attempt %d rejected with status %d", attempt + 1, status);
+        ret = ESP_FAIL;
+        if (status != 429 && status < 500)
+            break;
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Write batches as they are closed. The HTTP handle is reused across
+ *        batches, so the connection is kept alive when the server allows it.
+ */
+static void influx_sink_task(void *arg) {
+    influx_batch_t full = {0};
+    esp_http_client_config_t config = {
+        .url        = CONFIG_INFLUX_SINK_URL,
+        .method     = HTTP_METHOD_POST,
+        .timeout_ms = 5000,
+    };
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    MDF_ERROR_GOTO(!client, EXIT, "Initialise HTTP connection");
+    esp_http_client_set_header(client, "Content-Type", "text/plain; charset=utf-8");
+
+#ifdef CONFIG_INFLUX_SINK_GZIP
+    uint8_t *gzip = MDF_MALLOC(CONFIG_INFLUX_SINK_BATCH_BYTES);
+    compressor = MDF_MALLOC(sizeof(tdefl_compressor));
+    MDF_ERROR_GOTO(!gzip || !compressor, EXIT, "Allocate gzip encoder");
+#endif
+
+    for (;;) {
+        if (xQueueReceive(batch_queue, &full, pdMS_TO_TICKS(CONFIG_INFLUX_SINK_FLUSH_MS)) != pdTRUE) {
+            // nothing was closed in time, steal the open batch if it is old enough
+            xSemaphoreTake(batch_lock, portMAX_DELAY);
+            if (batch.points && xTaskGetTickCount() - batch.opened >= pdMS_TO_TICKS(CONFIG_INFLUX_SINK_FLUSH_MS)) {
+                full = batch;
+                memset(&batch, 0, sizeof(batch));
+            }
+            xSemaphoreGive(batch_lock);
+            if (!full.points)
+                continue;
+        }
+
+        const char *body = full.data;
+        size_t len = full.len;
+
+#ifdef CONFIG_INFLUX_SINK_GZIP
+        size_t gzip_len = gzip_batch(full.data, full.len, gzip, CONFIG_INFLUX_SINK_BATCH_BYTES);
+        if (gzip_len) {
+            body = (const char *)gzip;
+            len  = gzip_len;
+            esp_http_client_set_header(client, "Content-Encoding", "gzip");
+        } else {
+            esp_http_client_delete_header(client, "Content-Encoding");
+        }
+#endif
+
+        if (influx_sink_post(client, body, len) == ESP_OK) {
+            stats.batches++;
+            stats.points     += full.points;
+            stats.raw_bytes  += full.len;
+            stats.sent_bytes += len;
+            ESP_LOGD(TAG, "batch written, points: %d, bytes: %d/%d, total points: %d, retries: %d",
+                     full.points, len, full.len, stats.points, stats.retries);
+        } else {
+            stats.dropped_points += full.points;
+            ESP_LOGE(TAG, "batch dropped, points: %d, total dropped: %d", full.points, stats.dropped_points);
+        }
+
+        MDF_FREE(full.data);
+        memset(&full, 0, sizeof(full));
+    }
+
+EXIT:
+    ESP_LOGE(TAG, "InfluxDB sink task is ended");
+    esp_http_client_cleanup(client);
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief Close the open batch and hand it to the writer. Called with the lock held.
+ */
+static void influx_sink_close_batch(void) {
+    if (xQueueSend(batch_queue, &batch, 0) != pdTRUE) {
+        stats.dropped_points += batch.points;
+        ESP_LOGW(TAG, "writer lagging behind, batch of %d points dropped", batch.points);
+        MDF_FREE(batch.data);
+    }
+    memset(&batch, 0, sizeof(batch));
+}
+
+/**
+ * @brief Convert a reading to line protocol and append it to the open batch.
+ */
+mdf_err_t influx_sink_write(const char *json, size_t len) {
+    mdf_err_t ret = MDF_OK;
+    char line[INFLUX_SINK_LINE_LEN];
+    int line_len = influx_sink_line(json, len, line, sizeof(line));
+    MDF_ERROR_CHECK(line_len < 0, MDF_ERR_INVALID_ARG, "Convert reading to line protocol: %.*s", len, json);
+    MDF_ERROR_CHECK(!batch_queue, MDF_ERR_INVALID_STATE, "InfluxDB sink is not started");
+
+    xSemaphoreTake(batch_lock, portMAX_DELAY);
+
+    if (batch.data && batch.len + line_len >= CONFIG_INFLUX_SINK_BATCH_BYTES)
+        influx_sink_close_batch();
+
+    if (!batch.data) {
+        batch.data = MDF_MALLOC(CONFIG_INFLUX_SINK_BATCH_BYTES);
+        batch.opened = xTaskGetTickCount();
+    }
+
+    if (batch.data) {
+        memcpy(batch.data + batch.len, line, line_len);
+        batch.len += line_len;
+        batch.points++;
+    } else {
+        stats.dropped_points++;
+        ret = MDF_ERR_NO_MEM;
+    }
+
+    xSemaphoreGive(batch_lock);
+    return ret;
+}
+
+mdf_err_t influx_sink_start(void) {
+    if (batch_queue)
+        return MDF_OK;
+
+    ESP_LOGI(TAG, "Writing readings to %s", CONFIG_INFLUX_SINK_URL);
+    batch_lock  = xSemaphoreCreateMutex();
+    batch_queue = xQueueCreate(CONFIG_INFLUX_SINK_QUEUE_LEN, sizeof(influx_batch_t));
+    MDF_ERROR_CHECK(!batch_lock || !batch_queue, MDF_ERR_NO_MEM, "Create InfluxDB sink queue");
+
+    xTaskCreate(influx_sink_task, "influx_sink_task", 6*1024, NULL, CONFIG_MDF_TASK_DEFAULT_PRIOTY, NULL);
+    return MDF_OK;
+}
+
+#else
+
+mdf_err_t influx_sink_write(const char *json, size_t len) {
+    return MDF_ERR_NOT_SUPPORTED;
+}
+
+mdf_err_t influx_sink_start(void) {
+    return MDF_ERR_NOT_SUPPORTED;
+}
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "freertos/event_groups.h"
 
+#include "esp_http_client.h"
 #include "mqtt_client.h"
 
 
@@ -11,7 +12,25 @@ typedef struct {
     int url_len;    /* Length of the URL for this endpoint */
 } endpoint;
 
+typedef enum {
+    MQTT_TOPIC_READING = 0,     /* readings forwarded from the nodes */
+    MQTT_TOPIC_NODES,           /* per-node delivery statistics */
+    MQTT_TOPIC_COMMAND_ACK,     /* outcome of the downlink commands */
+    MQTT_TOPIC_TOPOLOGY,        /* mesh tree, as snapshots and diffs */
+    MQTT_TOPIC_MAX,
+} mqtt_topic_t;
 
+typedef void (*mqtt_command_handler_t)(const char *data, int data_len);
+typedef void (*mqtt_ota_handler_t)(const char *url);
+
+
+void mqtt_prepare();
 void mqtt_connect();
 void mqtt_disconnect();
-void mqtt_publish(char *data);
\ No newline at end of file
+int mqtt_publish(const char *data, int len);
+int mqtt_publish_to(mqtt_topic_t topic, const char *data, int len);
+void mqtt_log_stats(void);
+void mqtt_set_command_handler(mqtt_command_handler_t handler);
+void mqtt_set_ota_handler(mqtt_ota_handler_t handler);
+int ota_http_open(esp_http_client_handle_t client, size_t offset, size_t *total_size);
+int ota_http_resume(esp_http_client_handle_t client, size_t offset, size_t *total_size);
\ No newline at end of file
@@ -5,8 +5,11 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <sys/param.h>
 
+#include "esp_idf_version.h"
 #include "esp_log.h"
+#include "freertos/semphr.h"
 
 #include "mdf_err.h"
 #include "mdf_mem.h"
@@ -19,7 +22,11 @@
 
 #define BROKER_URL "mqtt://broker.mqttdashboard.com"
 #define OTA_TOPIC "/unime/fcrlab/ponmetro/smartagriculture/ota/endpoint"
+#define COMMAND_TOPIC "/unime/fcrlab/ponmetro/smartagriculture/command"
+#define COMMAND_ACK_TOPIC "/unime/fcrlab/ponmetro/smartagriculture/command/ack"
 #define READING_TOPIC "/unime/fcrlab/ponmetro/smartagriculture/reading"
+#define NODES_TOPIC "/unime/fcrlab/ponmetro/smartagriculture/nodes"
+#define TOPOLOGY_TOPIC "/unime/fcrlab/ponmetro/smartagriculture/topology"
 static const char *TAG = "MQTT_MANAGER";
 
 bool is_connected = false;
@@ -29,29 +36,108 @@ jsmntok_t tokens[10]; /* We expect no more than 10 JSON tokens */
 
 esp_mqtt_client_handle_t client = {0};
 
+static mqtt_command_handler_t command_handler = NULL;
+static mqtt_ota_handler_t ota_handler = NULL;
+
+/**
+ * @brief Topics the root publishes on, each with its own MQTT 5 topic alias.
+ *
+ * Aliases only live as long as the connection, so they are announced again,
+ * full topic included, after every reconnection.
+ */
+typedef struct {
+    const char *topic;
+    int qos;
+    int retain;
+    uint16_t alias;
+    bool announced;
+} topic_t;
+
+static topic_t topics[MQTT_TOPIC_MAX] = {
+    [MQTT_TOPIC_READING] = {.topic = READING_TOPIC, .qos = 1, .retain = 1, .alias = 1},
+    [MQTT_TOPIC_NODES]   = {.topic = NODES_TOPIC,   .qos = 0, .retain = 1, .alias = 2},
+    [MQTT_TOPIC_COMMAND_ACK] = {.topic = COMMAND_ACK_TOPIC, .qos = 1, .retain = 0, .alias = 3},
+    [MQTT_TOPIC_TOPOLOGY] = {.topic = TOPOLOGY_TOPIC, .qos = 1, .retain = 0, .alias = 4},
+};
+
+/* MQTT 5 comes with the ESP-MQTT of IDF 5, when built with MQTT_PROTOCOL_5 */
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0) && defined(CONFIG_MQTT_PROTOCOL_5)
+#define MQTT_V5
+#define PROTOCOL_IS_V5(ver) ((ver) == MQTT_PROTOCOL_V_5)
+#else
+#define PROTOCOL_IS_V5(ver) false
+#endif
+
+static esp_mqtt_protocol_ver_t protocol_ver = MQTT_PROTOCOL_V_3_1_1;
+static uint16_t alias_maximum = 0;     /* aliases above it are not used on this connection */
+
+/* the client is rebuilt by the MQTT 3.1.1 fallback while the TX stage publishes on it */
+static SemaphoreHandle_t client_lock = NULL;
+static bool fallback_running = false;
+
+static struct {
+    uint32_t messages;
+    uint32_t bytes;     /* PUBLISH packet bytes, computed from the packet layout */
+    uint32_t saved;     /* bytes saved compared with a plain MQTT 3.1.1 PUBLISH */
+} publish_stats = {0};
+
 
 esp_mqtt_client_config_t get_mqtt_client_config() {
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+    esp_mqtt_client_config_t mqtt_cfg = {
+        .broker.address.uri   = BROKER_URL,
+        .session.protocol_ver = protocol_ver,
+    };
+#else
     esp_mqtt_client_config_t mqtt_cfg = {
         .uri = BROKER_URL,
     };
+#endif
 
     return mqtt_cfg;
 }
 
 
 void mqtt_event_handler(void *arg,  esp_event_base_t event_base, int32_t event_id, void *event_data);
-void mqtt_connect() {
-    ESP_LOGD(TAG, "Connecting to MQTT broker: %s\n", BROKER_URL);
+static bool client_started = false;
 
+/**
+ * @brief Create the client ahead of time, so that a node taking over as root
+ *        only has to start it. Safe to call more than once.
+ */
+void mqtt_prepare() {
+    if (client)
+        return;
+
+    client_lock = xSemaphoreCreateMutex();
+#ifdef MQTT_V5
+    protocol_ver = MQTT_PROTOCOL_V_5;
+#endif
     esp_mqtt_client_config_t mqtt_cfg = get_mqtt_client_config();
     client = esp_mqtt_client_init(&mqtt_cfg);
     esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, client);
-    esp_mqtt_client_start(client);
+}
+
+void mqtt_connect() {
+    ESP_LOGD(TAG, "Connecting to MQTT broker: %s\n", BROKER_URL);
+
+    // a client started before, e.g. by a previous root term, only reconnects
+    mqtt_prepare();
+    xSemaphoreTake(client_lock, portMAX_DELAY);
+    if (client_started)
+        esp_mqtt_client_reconnect(client);
+    else
+        esp_mqtt_client_start(client);
+    client_started = true;
+    xSemaphoreGive(client_lock);
 }
 
 void mqtt_disconnect() {
-    if (is_connected)
-        esp_mqtt_client_disconnect(client);
+    if (!is_connected)
+        return;
+    xSemaphoreTake(client_lock, portMAX_DELAY);
+    esp_mqtt_client_disconnect(client);
+    xSemaphoreGive(client_lock);
 }
 
 esp_err_t mqtt_event_handler_cb(esp_mqtt_event_handle_t event);
@@ -63,6 +149,7 @@ void mqtt_event_handler(void *arg,  esp_event_base_t event_base, int32_t event_i
 esp_err_t mqtt_event_connected(esp_mqtt_client_handle_t client);
 esp_err_t mqtt_event_disconnected(esp_mqtt_client_handle_t client);
 esp_err_t mqtt_event_data(char* topic, int topic_len, char* data, int data_len);
+esp_err_t mqtt_event_error(esp_mqtt_event_handle_t event);
 esp_err_t mqtt_event_handler_cb(esp_mqtt_event_handle_t event) {
     switch (event->event_id) {
         case MQTT_EVENT_CONNECTED:
@@ -86,6 +173,7 @@ esp_err_t mqtt_event_handler_cb(esp_mqtt_event_handle_t event) {
             break;
         case MQTT_EVENT_ERROR:
             ESP_LOGE(TAG, "MQTT_EVENT_ERROR");
+            mqtt_event_error(event);
             break;
         default:
             ESP_LOGW(TAG, "Other event id:%d", event->event_id);
@@ -103,6 +191,14 @@ esp_err_t mqtt_event_connected(esp_mqtt_client_handle_t client) {
     char *topic = OTA_TOPIC;
     esp_mqtt_client_subscribe(client, topic, 0);
     ESP_LOGI(TAG, "subscription to %s ... completed", topic);
+    topic = COMMAND_TOPIC;
+    esp_mqtt_client_subscribe(client, topic, 1);
+    ESP_LOGI(TAG, "subscription to %s ... completed", topic);
+
+    for (int i = 0; i < MQTT_TOPIC_MAX; i++)
+        topics[i].announced = false;
+    alias_maximum = PROTOCOL_IS_V5(protocol_ver) ? UINT16_MAX : 0;
+    ESP_LOGI(TAG, "connected with MQTT %s", PROTOCOL_IS_V5(protocol_ver) ? "5" : "3.1.1");
     is_connected = true;
 
     return ESP_OK;
@@ -117,11 +213,55 @@ esp_err_t mqtt_event_disconnected(esp_mqtt_client_handle_t client) {
     char *topic = OTA_TOPIC;
     ESP_LOGD(TAG, "unsubscription from %s ... \r", topic);
     esp_mqtt_client_unsubscribe(client, topic);
+    topic = COMMAND_TOPIC;
+    ESP_LOGD(TAG, "unsubscription from %s ... \r", topic);
+    esp_mqtt_client_unsubscribe(client, topic);
     is_connected = false;
 
     return ESP_OK;
 }
 
+#ifdef MQTT_V5
+/**
+ * @brief Rebuild the client for MQTT 3.1.1. It runs in its own task, since the
+ *        client cannot be destroyed from its event handler, and holds the client
+ *        lock so that no message is published on the client being destroyed.
+ */
+static void mqtt_fallback_task(void *arg) {
+    ESP_LOGW(TAG, "Broker refused MQTT 5, falling back to MQTT 3.1.1");
+    xSemaphoreTake(client_lock, portMAX_DELAY);
+    esp_mqtt_client_stop(client);
+    esp_mqtt_client_destroy(client);
+
+    protocol_ver = MQTT_PROTOCOL_V_3_1_1;
+    esp_mqtt_client_config_t mqtt_cfg = get_mqtt_client_config();
+    client = esp_mqtt_client_init(&mqtt_cfg);
+    esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, client);
+    esp_mqtt_client_start(client);
+    client_started = true;
+    xSemaphoreGive(client_lock);
+
+    fallback_running = false;
+    vTaskDelete(NULL);
+}
+#endif
+
+esp_err_t mqtt_event_error(esp_mqtt_event_handle_t event) {
+#ifdef MQTT_V5
+    // 3.1.1 brokers answer a v5 CONNECT with return code 1, v5 brokers with reason 0x84
+    if (protocol_ver == MQTT_PROTOCOL_V_5 &&
+        event->error_handle->error_type == MQTT_ERROR_TYPE_CONNECTION_REFUSED &&
+        (event->error_handle->connect_return_code == MQTT_CONNECTION_REFUSE_PROTOCOL ||
+         event->error_handle->connect_return_code == MQTT5_UNSUPPORTED_PROTOCOL_VER) &&
+        !__atomic_exchange_n(&fallback_running, true, __ATOMIC_ACQ_REL)) {
+        // the client keeps reconnecting until the fallback stops it, one rebuild is enough
+        if (xTaskCreate(mqtt_fallback_task, "mqtt_fallback_task", 3*1024, NULL, CONFIG_MDF_TASK_DEFAULT_PRIOTY, NULL) != pdPASS)
+            fallback_running = false;
+    }
+#endif
+    return ESP_OK;
+}
+
 void parse_topic(char* data, int data_len);
 esp_err_t mqtt_event_data(char* topic, int topic_len, char* data, int data_len) {
     ESP_LOGI(TAG, "Received data from topic %.*s", topic_len, topic);
@@ -130,13 +270,35 @@ esp_err_t mqtt_event_data(char* topic, int topic_len, char* data, int data_len)
     int r = strcmp(OTA_TOPIC, topic_compare);
     if ( !r )
         parse_topic(data, data_len);
+    else if ( !strcmp(COMMAND_TOPIC, topic_compare) && command_handler )
+        command_handler(data, data_len);
     return ESP_OK;
 }
 
+/**
+ * @brief Set the function called with the messages received on the command topic.
+ *        It runs on the MQTT client task, so it must not block.
+ */
+void mqtt_set_command_handler(mqtt_command_handler_t handler) {
+    command_handler = handler;
+}
+
+/**
+ * @brief Set the function the OTA endpoints are handed to, instead of the
+ *        upgrade through mupgrade. It runs on the MQTT client task, so it must not block.
+ */
+void mqtt_set_ota_handler(mqtt_ota_handler_t handler) {
+    ota_handler = handler;
+}
+
 endpoint get_ota_endpoint(char* data, int data_len);
 static void ota_task( void * pvParameters );
 void parse_topic(char* data, int data_len) {
     endpoint ota_endpoint = get_ota_endpoint(data, data_len);
+    if (ota_handler) {
+        ota_handler(ota_endpoint.url);
+        return;
+    }
     // ESP_LOGI(TAG, "OTA run %.*s", strlen(ota_endpoint.url), ota_endpoint.url);
     char *buffer = MDF_MALLOC(MWIFI_PAYLOAD_LEN);
     size_t size = MWIFI_PAYLOAD_LEN;
@@ -172,6 +334,74 @@ static int jsoneq(const char *json, jsmntok_t *tok, const char *s) {
   return -1;
 }
 
+/**
+ * @brief Open the firmware stream at the given offset, asking for the rest of it
+ *        with a Range request. A server ignoring the range sends it all again.
+ *
+ * @return the offset the stream starts at, -1 on failure
+ */
+int ota_http_open(esp_http_client_handle_t client, size_t offset, size_t *total_size) {
+    char range[32] = {0};
+
+    if (offset) {
+        snprintf(range, sizeof(range), "bytes=%d-", offset);
+        esp_http_client_set_header(client, "Range", range);
+    } else {
+        esp_http_client_delete_header(client, "Range");
+    }
+
+    esp_err_t ret = esp_http_client_open(client, 0);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "<%s> Open HTTP connection", esp_err_to_name(ret));
+        return -1;
+    }
+
+    int length = esp_http_client_fetch_headers(client);
+    int status = esp_http_client_get_status_code(client);
+    if (length > 0 && status == 206 && offset) {
+        *total_size = offset + length;
+        return offset;
+    } else if (length > 0 && status == 200) {
+        *total_size = length;
+        return 0;
+    }
+
+    ESP_LOGW(TAG, "Unexpected HTTP response, status: %d, length: %d", status, length);
+    esp_http_client_close(client);
+    return -1;
+}
+
+/**
+ * @brief Reopen a dropped firmware stream at the given offset, with up to
+ *        CONFIG_OTA_RESUME_RETRIES attempts and an exponential backoff.
+ *
+ * @param total_size size of the firmware, checked against the server when not
+ *        0, set to the size the server gives on success
+ *
+ * @return the offset the stream restarts at, -1 when every attempt failed or
+ *         the firmware changed size, i.e. on the server
+ */
+int ota_http_resume(esp_http_client_handle_t client, size_t offset, size_t *total_size) {
+    size_t resumed_size = 0;
+
+    for (int attempt = 0; attempt < CONFIG_OTA_RESUME_RETRIES; attempt++) {
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_OTA_RESUME_BACKOFF_MS << MIN(attempt, 6)));
+        esp_http_client_close(client);
+
+        int start = ota_http_open(client, offset, &resumed_size);
+        if (start >= 0 && *total_size && resumed_size != *total_size) {
+            ESP_LOGW(TAG, "Firmware changed size on the server: %d, was: %d", resumed_size, *total_size);
+            return -1;
+        } else if (start >= 0) {
+            *total_size = resumed_size;
+            return start;
+        }
+        ESP_LOGW(TAG, "Resume the download at %d bytes, attempt %d/%d failed", offset, attempt + 1, CONFIG_OTA_RESUME_RETRIES);
+    }
+
+    return -1;
+}
+
 static void ota_task( void *parameter ) {
     char *ota_endpoint;
     ota_endpoint = (char *) parameter;
@@ -181,6 +411,8 @@ static void ota_task( void *parameter ) {
     uint8_t *data       = MDF_MALLOC(MWIFI_PAYLOAD_LEN);
     char name[32]       = {0x0};
     size_t total_size   = 0;
+    size_t redownloaded = 0;
+    int resumes         = 0;
     // int start_time      = 0;
     mupgrade_result_t upgrade_result = {0};
     mwifi_data_type_t data_type = {.communicate = MWIFI_COMMUNICATE_MULTICAST};
@@ -248,21 +480,42 @@ static void ota_task( void *parameter ) {
     /**
      * @brief 3. Read firmware from the server and write it to the flash of the root node
      */
-    for (ssize_t size = 0, recv_size = 0; recv_size < total_size; recv_size += size) {
+    for (ssize_t size = 0, recv_size = 0, skip = 0, stalled = 0; recv_size < total_size; recv_size += size) {
         size = esp_http_client_read(client, (char *)data, MWIFI_PAYLOAD_LEN);
-        MDF_ERROR_GOTO(size < 0, EXIT, "<%s> Read data from http stream", mdf_err_to_name(ret));
-
-        if (size > 0) {
-            /* @brief  Write firmware to flash */
-            ret = mupgrade_firmware_download(data, size);
-            MDF_ERROR_GOTO(ret != MDF_OK, EXIT, "<%s> Write firmware to flash, size: %d, data: %.*s",
-                           mdf_err_to_name(ret), size, size, data);
-        } else {
-            MDF_LOGW("<%s> esp_http_client_read", mdf_err_to_name(ret));
-            goto EXIT;
+
+        if (size <= 0) {
+            /* @brief  The stream dropped, resume it where it stopped */
+            MDF_ERROR_GOTO(++stalled > CONFIG_OTA_RESUME_RETRIES, EXIT, "HTTP stream dropped at %d/%d bytes, give up",
+                           recv_size, total_size);
+            MDF_LOGW("HTTP stream dropped at %d/%d bytes, resume it", recv_size, total_size);
+            ssize_t start = ota_http_resume(client, recv_size, &total_size);
+            MDF_ERROR_GOTO(start < 0, EXIT, "Resume the HTTP stream");
+            resumes++;
+            skip = recv_size - start;
+            redownloaded += skip;
+            size = 0;
+            continue;
+        }
+        stalled = 0;
+
+        if (skip) {
+            /* @brief  A server ignoring the range sends what was written again */
+            ssize_t skipped = MIN(size, skip);
+            memmove(data, data + skipped, size - skipped);
+            skip -= skipped;
+            size -= skipped;
+            if (!size)
+                continue;
         }
+
+        /* @brief  Write firmware to flash */
+        ret = mupgrade_firmware_download(data, size);
+        MDF_ERROR_GOTO(ret != MDF_OK, EXIT, "<%s> Write firmware to flash, size: %d, data: %.*s",
+                       mdf_err_to_name(ret), size, size, data);
     }
 
+    MDF_LOGI("Firmware downloaded, size: %d bytes, resumes: %d, re-downloaded: %d bytes", total_size, resumes, redownloaded);
+
     // MDF_LOGI("The service download firmware is complete, Spend time: %ds", (xTaskGetTickCount() - start_time) * portTICK_RATE_MS / 1000);
 
     /**
@@ -289,32 +542,119 @@ static void ota_task( void *parameter ) {
 
 EXIT:
     MDF_FREE(data);
+    MDF_FREE(ota_endpoint);
     mupgrade_result_free(&upgrade_result);
     esp_http_client_close(client);
     esp_http_client_cleanup(client);
     vTaskDelete(NULL);
 }
 
-void mqtt_publish_task(void* parameters);
-void mqtt_publish(char *data) {
-    ESP_LOGD(TAG, "Publishing MQTT message ...");
-    char* pc_name = "mqtt_publish_task";
-    xTaskCreate(mqtt_publish_task, pc_name, 4*1024, (void*) data, CONFIG_MDF_TASK_DEFAULT_PRIOTY, NULL);
+static int varint_len(int value) {
+    int len = 1;
+    while (value >= 128) {
+        value /= 128;
+        len++;
+    }
+    return len;
 }
 
-void mqtt_publish_task(void *parameters) {
-    char *data;
-    data = (char *) parameters;
+/**
+ * @brief Size on the wire of a PUBLISH packet with the given topic and properties.
+ */
+static int publish_packet_len(int topic_len, int properties_len, int data_len, int qos) {
+    int remaining = 2 + topic_len + (qos ? 2 : 0) + data_len;
+    if (properties_len >= 0)
+        remaining += varint_len(properties_len) + properties_len;
+    return 1 + varint_len(remaining) + remaining;
+}
 
-    int len = strlen(data);
-    int qos = 1;
-    int retain = 1;
-    char *topic = READING_TOPIC;
-    esp_mqtt_client_publish(client, topic, data, len, qos, retain);
+/**
+ * @brief Publish on one of the root topics, replacing it with its alias once the
+ *        broker has seen it and setting the message expiry, when the connection
+ *        is MQTT 5. Safe to call from any task, but meant for the MQTT TX stage
+ *        of the root pipeline, which serializes the publishing.
+ *
+ * @return The message id on success, -1 otherwise.
+ */
+int mqtt_publish_to(mqtt_topic_t id, const char *data, int len) {
+    topic_t *entry = &topics[id];
+    const char *wire_topic = entry->topic;
+    int properties_len = -1;
+
+    if (!client_lock)
+        return -1;
+    xSemaphoreTake(client_lock, portMAX_DELAY);
+
+#ifdef MQTT_V5
+    esp_mqtt5_publish_property_config_t property = {
+        .message_expiry_interval = CONFIG_MQTT_MESSAGE_EXPIRY_S,
+    };
 
-    vTaskDelete(NULL);
+    if (protocol_ver == MQTT_PROTOCOL_V_5) {
+        properties_len = 5;  // message expiry interval
+        if (entry->alias <= alias_maximum) {
+            property.topic_alias = entry->alias;
+            properties_len += 3;
+            if (entry->announced)
+                wire_topic = "";
+        }
+        esp_mqtt5_client_set_publish_property(client, &property);
+    }
+#endif
+
+    int msg_id = esp_mqtt_client_publish(client, wire_topic, data, len, entry->qos, entry->retain);
+
+#ifdef MQTT_V5
+    if (msg_id < 0 && property.topic_alias && is_connected) {
+        property.topic_alias = 0;
+        properties_len = 5;
+        wire_topic = entry->topic;
+        esp_mqtt5_client_set_publish_property(client, &property);
+        msg_id = esp_mqtt_client_publish(client, wire_topic, data, len, entry->qos, entry->retain);
+
+        // ESP-MQTT keeps the CONNACK to itself and refuses the aliases above its
+        // Topic Alias Maximum before sending: only those stop being used
+        if (msg_id >= 0) {
+            alias_maximum = entry->alias - 1;
+            ESP_LOGW(TAG, "topic alias %d above the broker maximum, publishing the full topic", entry->alias);
+        }
+    } else if (msg_id >= 0 && property.topic_alias) {
+        entry->announced = true;
+    }
+#endif
+
+    xSemaphoreGive(client_lock);
+
+    if (msg_id >= 0) {
+        int sent = publish_packet_len(strlen(wire_topic), properties_len, len, entry->qos);
+        publish_stats.messages++;
+        publish_stats.bytes += sent;
+        publish_stats.saved += publish_packet_len(strlen(entry->topic), -1, len, entry->qos) - sent;
+    }
+
+    return msg_id;
+}
+
+/**
+ * @brief Publish a reading synchronously from the caller's task.
+ *
+ * @return The message id on success, -1 otherwise.
+ */
+int mqtt_publish(const char *data, int len) {
+    ESP_LOGD(TAG, "Publishing MQTT message ...");
+    return mqtt_publish_to(MQTT_TOPIC_READING, data, len);
 }
 
+/**
+ * @brief Log how many bytes the published messages take on the wire, and how
+ *        many topic aliases save compared with plain MQTT 3.1.1 publishing.
+ *        Both are computed from the packet layout, not read back from the broker.
+ */
+void mqtt_log_stats(void) {
+    ESP_LOGI(TAG, "MQTT %s, published: %d, bytes: %d, saved: %d (%d per message, computed)",
+             PROTOCOL_IS_V5(protocol_ver) ? "5" : "3.1.1", publish_stats.messages, publish_stats.bytes,
+             (int)publish_stats.saved, publish_stats.messages ? (int)publish_stats.saved / (int)publish_stats.messages : 0);
+}
 
 int topic_is(char* topic, char* topic_target) {
     int r = strcmp(topic, topic_target);
@@ -0,0 +1,260 @@
+/*
+ * ESP32 Mesh Network
+ * Copyright 2021, FCRLab at University of Messina (Messina, Italy)
+ *
+ * @maintainer: Lorenzo Carnevale <lcarnevale@unime.it>
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "mwifi.h"
+
+/**
+ * @brief In-network aggregation of the telemetry.
+ *
+ * Nodes deeper than the second layer send their frames to their parent rather
+ * than to the root. Every node with children collects the frames of its subtree
+ * together with its own into one MQTT_AGGREGATE packet, which goes upstream when
+ * it is full or CONFIG_AGGREGATE_MAX_DELAY_MS after its first frame, so each hop
+ * adds at most that delay. The root unpacks it into the original frames.
+ *
+ * An MQTT_AGGREGATE packet is a sequence of aggregate_entry_t, each followed by
+ * the frame it describes.
+ */
+typedef struct {
+    uint8_t src_addr[MWIFI_ADDR_LEN];
+    uint8_t type;
+    uint16_t size;
+} __attribute__((packed)) aggregate_entry_t;
+
+typedef void (*aggregate_frame_cb_t)(const uint8_t *src_addr, const mwifi_data_type_t *data_type,
+                                     const char *data, size_t size);
+
+typedef struct {
+    uint8_t data[MWIFI_PAYLOAD_LEN];
+    size_t len;
+    uint16_t frames;
+    TickType_t opened;  /* tick of the first frame */
+} aggregate_batch_t;
+
+static aggregate_batch_t aggregate_batches[2] = {0};
+static aggregate_batch_t *aggregate_open = &aggregate_batches[0];
+static SemaphoreHandle_t aggregate_lock = NULL;       /* protects the open batch */
+static SemaphoreHandle_t aggregate_send_lock = NULL;  /* protects the batch being sent */
+
+static uint32_t sampling_period_ms(void);   /* powermanager.h */
+
+
+/**
+ * @brief Mesh address of the parent, derived from its soft-AP BSSID which is the
+ *        station MAC address plus one in the last byte.
+ */
+static mdf_err_t aggregate_parent_addr(uint8_t *addr) {
+    mesh_addr_t bssid = {0};
+    mdf_err_t ret = esp_mesh_get_parent_bssid(&bssid);
+    MDF_ERROR_CHECK(ret != MDF_OK, ret, "<%s> esp_mesh_get_parent_bssid", mdf_err_to_name(ret));
+
+    memcpy(addr, bssid.addr, MWIFI_ADDR_LEN);
+    // minus one, borrowing from the bytes before as the BSSID may end in 0x00
+    for (int i = MWIFI_ADDR_LEN - 1; i >= 0 && addr[i]-- == 0; i--)
+        ;
+    return MDF_OK;
+}
+
+/**
+ * @brief Whether the frames of this node and of its subtree are aggregated here.
+ */
+static bool aggregate_is_aggregator(void) {
+#ifndef CONFIG_AGGREGATE_ENABLE
+    return false;
+#endif
+    return esp_mesh_get_layer() > MESH_ROOT_LAYER && esp_mesh_get_routing_table_size() > 1;
+}
+
+/**
+ * @brief Send a packet upstream: to the parent from the third layer down, so that
+ *        it gets aggregated there, straight to the root otherwise.
+ */
+static mdf_err_t aggregate_write_upstream(const mwifi_data_type_t *data_type, const void *data, size_t size) {
+#ifdef CONFIG_AGGREGATE_ENABLE
+    uint8_t parent_addr[MWIFI_ADDR_LEN] = {0};
+
+    if (esp_mesh_get_layer() > MESH_ROOT_LAYER + 1 && aggregate_parent_addr(parent_addr) == MDF_OK)
+        return congestion_write(parent_addr, data_type, data, size);
+#endif
+
+    return congestion_write(NULL, data_type, data, size);
+}
+
+/**
+ * @brief Close the open batch and send it upstream.
+ */
+static mdf_err_t aggregate_flush(void) {
+    mdf_err_t ret = MDF_OK;
+    mwifi_data_type_t data_type = {
+        .compression = true,
+        .custom = MQTT_AGGREGATE,
+    };
+
+    xSemaphoreTake(aggregate_send_lock, portMAX_DELAY);
+
+    xSemaphoreTake(aggregate_lock, portMAX_DELAY);
+    aggregate_batch_t *batch = aggregate_open;
+    aggregate_open = batch == &aggregate_batches[0] ? &aggregate_batches[1] : &aggregate_batches[0];
+    xSemaphoreGive(aggregate_lock);
+
+    if (batch->frames) {
+        MDF_LOGD("Send MQTT_AGGREGATE packet upstream, frames: %d, size: %d", batch->frames, batch->len);
+        ret = aggregate_write_upstream(&data_type, batch->data, batch->len);
+        MDF_ERROR_GOTO(ret != MDF_OK, EXIT, "<%s> aggregate_write_upstream", mdf_err_to_name(ret));
+    }
+
+EXIT:
+    batch->len    = 0;
+    batch->frames = 0;
+    xSemaphoreGive(aggregate_send_lock);
+    return ret;
+}
+
+/**
+ * @brief Append a frame to the open batch, flushing it first when it is full.
+ */
+static mdf_err_t aggregate_add(const uint8_t *src_addr, uint32_t type, const void *frame, size_t size) {
+    aggregate_entry_t entry = {
+        .type = type,
+        .size = size,
+    };
+    memcpy(entry.src_addr, src_addr, MWIFI_ADDR_LEN);
+    MDF_ERROR_CHECK(sizeof(entry) + size > MWIFI_PAYLOAD_LEN, MDF_ERR_INVALID_SIZE, "Frame too large to aggregate");
+
+    for (;;) {
+        xSemaphoreTake(aggregate_lock, portMAX_DELAY);
+        aggregate_batch_t *batch = aggregate_open;
+        if (batch->len + sizeof(entry) + size <= MWIFI_PAYLOAD_LEN) {
+            if (!batch->frames)
+                batch->opened = xTaskGetTickCount();
+            memcpy(batch->data + batch->len, &entry, sizeof(entry));
+            memcpy(batch->data + batch->len + sizeof(entry), frame, size);
+            batch->len += sizeof(entry) + size;
+            batch->frames++;
+            xSemaphoreGive(aggregate_lock);
+            return MDF_OK;
+        }
+        xSemaphoreGive(aggregate_lock);
+        aggregate_flush();
+    }
+}
+
+/**
+ * @brief Walk the frames packed in an MQTT_AGGREGATE packet.
+ */
+static mdf_err_t aggregate_foreach(const char *data, size_t size, aggregate_frame_cb_t cb) {
+    aggregate_entry_t entry;
+    mwifi_data_type_t data_type = {0};
+
+    for (size_t pos = 0; pos < size; pos += sizeof(entry) + entry.size) {
+        MDF_ERROR_CHECK(pos + sizeof(entry) > size, MDF_ERR_INVALID_SIZE, "Truncated aggregate entry");
+        memcpy(&entry, data + pos, sizeof(entry));
+        MDF_ERROR_CHECK(pos + sizeof(entry) + entry.size > size, MDF_ERR_INVALID_SIZE, "Truncated aggregate frame");
+
+        data_type.custom = entry.type;
+        cb(entry.src_addr, &data_type, data + pos + sizeof(entry), entry.size);
+    }
+
+    return MDF_OK;
+}
+
+/**
+ * @brief Send a telemetry frame of this node towards the root.
+ *
+ * A leaf in power save sends its frames in batches of CONFIG_POWERSAVE_BATCH,
+ * command acknowledgments right away. A batch that does not fill up, as the
+ * deadband holds the readings back, is flushed by aggregate_task() after twice
+ * the sampling periods it takes to fill.
+ */
+mdf_err_t aggregate_send(const mwifi_data_type_t *data_type, const void *data, size_t size) {
+    uint8_t self_addr[MWIFI_ADDR_LEN] = {0};
+
+    if (!supervisor_running(SUPERVISOR_AGGREGATE) || esp_mesh_get_layer() == MESH_ROOT_LAYER)
+        return congestion_write(NULL, data_type, data, size);
+
+#ifdef CONFIG_POWERSAVE_ENABLE
+    if (powersave_leaf()) {
+        esp_read_mac(self_addr, ESP_MAC_WIFI_STA);
+        mdf_err_t ret = aggregate_add(self_addr, data_type->custom, data, size);
+        if (ret == MDF_OK && (data_type->custom == COMMAND_ACK || aggregate_open->frames >= CONFIG_POWERSAVE_BATCH))
+            ret = aggregate_flush();
+        return ret;
+    }
+#endif
+
+    if (aggregate_is_aggregator()) {
+        esp_read_mac(self_addr, ESP_MAC_WIFI_STA);
+        return aggregate_add(self_addr, data_type->custom, data, size);
+    }
+
+    return aggregate_write_upstream(data_type, data, size);
+}
+
+/**
+ * @brief Node handler of the frames sent by the children, either single frames or
+ *        batches of their own subtree, which are merged into the open batch.
+ */
+static void aggregate_child_frame(const uint8_t *src_addr, const mwifi_data_type_t *data_type,
+                                  const char *data, size_t size) {
+    aggregate_add(src_addr, data_type->custom, data, size);
+}
+
+static mdf_err_t node_aggregate_handler(packet_t *packet) {
+    if (packet->data_type.custom == MQTT_AGGREGATE)
+        return aggregate_foreach(packet->data, packet->size, aggregate_child_frame);
+    return aggregate_add(packet->src_addr, packet->data_type.custom, packet->data, packet->size);
+}
+
+#if defined(CONFIG_AGGREGATE_ENABLE) || defined(CONFIG_POWERSAVE_ENABLE)
+static void aggregate_task(void *arg) {
+    const TickType_t max_delay = pdMS_TO_TICKS(CONFIG_AGGREGATE_MAX_DELAY_MS);
+    const TickType_t interval  = max_delay / 4 ? max_delay / 4 : 1;
+
+    MDF_LOGI("Aggregate task is running");
+
+    for (;;) {
+        vTaskDelay(interval);
+
+        // the batches of a leaf in power save are sent when full, or late enough
+        // not to wake the radio up for every frame
+        TickType_t delay = max_delay;
+#ifdef CONFIG_POWERSAVE_ENABLE
+        if (powersave_leaf())
+            delay = 2 * CONFIG_POWERSAVE_BATCH * pdMS_TO_TICKS(sampling_period_ms());
+#endif
+
+        xSemaphoreTake(aggregate_lock, portMAX_DELAY);
+        // a batch may wait one interval past the check, which the deadline takes in
+        bool expired = aggregate_open->frames && xTaskGetTickCount() - aggregate_open->opened + interval >= delay;
+        xSemaphoreGive(aggregate_lock);
+
+        if (expired)
+            aggregate_flush();
+    }
+}
+#endif
+
+void aggregate_start(void) {
+#if defined(CONFIG_AGGREGATE_ENABLE) || defined(CONFIG_POWERSAVE_ENABLE)
+    if (supervisor_running(SUPERVISOR_AGGREGATE))
+        return;
+
+    aggregate_lock      = xSemaphoreCreateMutex();
+    aggregate_send_lock = xSemaphoreCreateMutex();
+#ifdef CONFIG_AGGREGATE_ENABLE
+    packet_register(PACKET_TABLE_NODE, MQTT_SEND, "MQTT_SEND", node_aggregate_handler);
+    packet_register(PACKET_TABLE_NODE, MQTT_AGGREGATE, "MQTT_AGGREGATE", node_aggregate_handler);
+    packet_register(PACKET_TABLE_NODE, COMMAND_ACK, "COMMAND_ACK", node_aggregate_handler);
+    packet_register(PACKET_TABLE_NODE, HEALTH, "HEALTH", node_aggregate_handler);
+#endif
+    supervisor_start(SUPERVISOR_AGGREGATE, aggregate_task);
+#endif
+}
@@ -0,0 +1,111 @@
+/*
+ * ESP32 Mesh Network
+ * Copyright 2021, FCRLab at University of Messina (Messina, Italy)
+ *
+ * @maintainer: Lorenzo Carnevale <lcarnevale@unime.it>
+ */
+
+#include "esp_timer.h"
+#include "mwifi.h"
+
+/**
+ * @brief Congestion control of the node senders.
+ *
+ * Every upstream write is timed. A write failing or blocking longer than
+ * CONFIG_CONGESTION_LATENCY_MS, as well as a CMD_CONGESTION signal of the root,
+ * doubles the backoff scale, at most once per CONGESTION_HOLDOFF_MS. Every
+ * write going through quickly takes CONFIG_CONGESTION_RECOVERY_STEP off it. The
+ * sampler stretches its period and its deadband by the scale, so that the mesh
+ * sheds load under pressure and recovers it once clear (AIMD). A maximum scale
+ * of 1 turns the backoff off.
+ */
+#define CONGESTION_SCALE_UNIT 1000  /* scale of an uncongested node, in thousandths */
+#define CONGESTION_HOLDOFF_MS 1000  /* congestion events closer than this back off once */
+
+typedef struct {
+    uint32_t scale;         /* multiplier of period and deadband, in thousandths */
+    int64_t backoff_us;     /* time of the last backoff */
+    int64_t latency_us;     /* moving average of the write latency */
+    uint32_t writes;
+    uint32_t failures;
+    uint32_t slow;          /* writes above the latency threshold */
+    uint32_t backoffs;
+    uint32_t signals;       /* congestion signals received from the root */
+} congestion_t;
+
+static congestion_t congestion = {
+    .scale = CONGESTION_SCALE_UNIT,
+};
+static portMUX_TYPE congestion_lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+static void congestion_backoff(int64_t now_us) {
+    if (congestion.backoff_us && now_us - congestion.backoff_us < CONGESTION_HOLDOFF_MS * 1000)
+        return;
+
+    congestion.backoff_us = now_us;
+    congestion.backoffs++;
+    congestion.scale = congestion.scale * 2 > CONFIG_CONGESTION_MAX_SCALE * CONGESTION_SCALE_UNIT ?
+                       CONFIG_CONGESTION_MAX_SCALE * CONGESTION_SCALE_UNIT : congestion.scale * 2;
+}
+
+static void congestion_account(int64_t start_us, mdf_err_t ret) {
+    int64_t now_us = esp_timer_get_time();
+    int64_t latency_us = now_us - start_us;
+
+    portENTER_CRITICAL(&congestion_lock);
+    congestion.writes++;
+    congestion.latency_us += (latency_us - congestion.latency_us) / 8;
+
+    if (ret != MDF_OK || latency_us > (int64_t)CONFIG_CONGESTION_LATENCY_MS * 1000) {
+        if (ret != MDF_OK)
+            congestion.failures++;
+        else
+            congestion.slow++;
+        congestion_backoff(now_us);
+    } else if (congestion.scale > CONGESTION_SCALE_UNIT) {
+        congestion.scale = congestion.scale - CONGESTION_SCALE_UNIT < CONFIG_CONGESTION_RECOVERY_STEP ?
+                           CONGESTION_SCALE_UNIT : congestion.scale - CONFIG_CONGESTION_RECOVERY_STEP;
+    }
+    portEXIT_CRITICAL(&congestion_lock);
+}
+
+/**
+ * @brief Write a packet upstream, accounting its latency and outcome.
+ */
+static mdf_err_t congestion_write(const uint8_t *dest_addr, const mwifi_data_type_t *data_type,
+                                  const void *data, size_t size) {
+    int64_t start_us = esp_timer_get_time();
+    mdf_err_t ret = mwifi_write(dest_addr, data_type, data, size, true);
+    congestion_account(start_us, ret);
+    return ret;
+}
+
+/**
+ * @brief Congestion signal of the root, whose ingress is falling behind.
+ */
+void congestion_signal(void) {
+    portENTER_CRITICAL(&congestion_lock);
+    congestion.signals++;
+    congestion_backoff(esp_timer_get_time());
+    portEXIT_CRITICAL(&congestion_lock);
+}
+
+/**
+ * @brief Stretch a sampling parameter by the current backoff scale.
+ */
+static uint32_t congestion_stretch(uint32_t value) {
+    return (uint64_t)value * congestion.scale / CONGESTION_SCALE_UNIT;
+}
+
+void congestion_log_stats(void) {
+    congestion_t stats;
+
+    portENTER_CRITICAL(&congestion_lock);
+    stats = congestion;
+    portEXIT_CRITICAL(&congestion_lock);
+
+    MDF_LOGI("Congestion scale: %d.%03d, latency: %d us, writes: %d, failures: %d, slow: %d, backoffs: %d, signals: %d",
+             stats.scale / CONGESTION_SCALE_UNIT, stats.scale % CONGESTION_SCALE_UNIT, (int)stats.latency_us,
+             stats.writes, stats.failures, stats.slow, stats.backoffs, stats.signals);
+}
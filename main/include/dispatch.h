@@ -0,0 +1,99 @@
+/*
+ * ESP32 Mesh Network
+ * Copyright 2021, FCRLab at University of Messina (Messina, Italy)
+ *
+ * @maintainer: Lorenzo Carnevale <lcarnevale@unime.it>
+ */
+
+#include "esp_timer.h"
+#include "mwifi.h"
+
+
+/**
+ * @brief A packet received from the mesh.
+ *
+ * A handler may keep the data buffer past its return by setting data to NULL,
+ * the caller then releases nothing and allocates a new buffer.
+ */
+typedef struct {
+    uint8_t src_addr[MWIFI_ADDR_LEN];
+    mwifi_data_type_t data_type;
+    size_t size;
+    char *data;
+} packet_t;
+
+typedef mdf_err_t (*packet_handler_t)(packet_t *packet);
+
+typedef enum {
+    PACKET_TABLE_ROOT = 0,  /* packets read by the root from the nodes */
+    PACKET_TABLE_NODE,      /* packets read by any node from the root */
+    PACKET_TABLE_MAX,
+} packet_table_t;
+
+typedef struct {
+    const char *name;
+    packet_handler_t handler;
+    uint32_t rx;
+    uint32_t errors;
+    int64_t busy_us;
+    int64_t max_us;
+} packet_route_t;
+
+static packet_route_t packet_routes[PACKET_TABLE_MAX][PACKET_TYPE_MAX] = {0};
+static uint32_t packet_unknown[PACKET_TABLE_MAX] = {0};
+
+
+/**
+ * @brief Register the handler of a packet type, replacing the previous one.
+ */
+mdf_err_t packet_register(packet_table_t table, uint32_t type, const char *name, packet_handler_t handler) {
+    MDF_PARAM_CHECK(table < PACKET_TABLE_MAX);
+    MDF_PARAM_CHECK(type < PACKET_TYPE_MAX);
+
+    packet_routes[table][type].name    = name;
+    packet_routes[table][type].handler = handler;
+    return MDF_OK;
+}
+
+/**
+ * @brief Run the handler registered for the type of the packet, accounting
+ *        the packet and the time spent in the handler.
+ */
+mdf_err_t packet_dispatch(packet_table_t table, packet_t *packet) {
+    uint32_t type = packet->data_type.custom;
+    packet_route_t *route = type < PACKET_TYPE_MAX ? &packet_routes[table][type] : NULL;
+
+    if (!route || !route->handler) {
+        packet_unknown[table]++;
+        MDF_LOGW("Receive UNKNOWN packet type %d from addr: " MACSTR ", size: %d",
+                 type, MAC2STR(packet->src_addr), packet->size);
+        return MDF_ERR_NOT_SUPPORTED;
+    }
+
+    int64_t start_us = esp_timer_get_time();
+    mdf_err_t ret = route->handler(packet);
+    int64_t elapsed_us = esp_timer_get_time() - start_us;
+
+    route->rx++;
+    route->busy_us += elapsed_us;
+    if (elapsed_us > route->max_us)
+        route->max_us = elapsed_us;
+    if (ret != MDF_OK)
+        route->errors++;
+
+    return ret;
+}
+
+void packet_log_stats(packet_table_t table) {
+    for (int type = 0; type < PACKET_TYPE_MAX; type++) {
+        packet_route_t *route = &packet_routes[table][type];
+        if (!route->rx)
+            continue;
+        MDF_LOGI("Packet %s (%d), rx: %d, errors: %d, handler avg: %dus, max: %dus",
+                 route->name, type, route->rx, route->errors,
+                 (int)(route->busy_us / route->rx), (int)route->max_us);
+    }
+
+    if (packet_unknown[table])
+        MDF_LOGW("Packets of unknown type: %d", packet_unknown[table]);
+}
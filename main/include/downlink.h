@@ -0,0 +1,733 @@
+/*
+ * ESP32 Mesh Network
+ * Copyright 2021, FCRLab at University of Messina (Messina, Italy)
+ *
+ * @maintainer: Lorenzo Carnevale <lcarnevale@unime.it>
+ */
+
+#include "freertos/semphr.h"
+
+#include "esp_timer.h"
+#include "mwifi.h"
+#include "mdf_info_store.h"
+
+/**
+ * @brief Downlink commands.
+ *
+ * The root receives commands as JSON on the MQTT command topic, e.g.
+ *
+ *     {"command": "set_period", "value": 5000, "targets": ["30:ae:a4:80:12:34"]}
+ *
+ * and sends them to the nodes as a binary downlink_command_t. Without targets
+ * the command goes to every node. Commands can also be addressed to a named
+ * group, which is a mesh group the root fans the command out to with a single
+ * transmission:
+ *
+ *     {"command": "join_group", "group": "greenhouse", "targets": [...]}
+ *     {"command": "set_deadband", "value": 5, "group": "greenhouse"}
+ *
+ * Every node answers with a command_ack_t, which travels upstream like the
+ * readings, so it is batched by the intermediate nodes when aggregation is
+ * enabled. The root counts the acknowledgments of each command and publishes
+ * one summary when all of them arrived or after CONFIG_DOWNLINK_ACK_TIMEOUT_MS.
+ *
+ * The commands are queued to a single sender, both those of the MQTT topic and
+ * those of the root itself, e.g. the transmit slot of every node it sees for
+ * the first time. The throttle hints
+ * of the root ingress are gathered by the sender into one multicast every
+ * DOWNLINK_HINT_PERIOD_MS, so that a flood of nodes does not flood the downlink.
+ *
+ * The mesh group address is derived from the group name, so a root which does
+ * not know the members of a group, e.g. after a restart or a failover, still
+ * reaches it. It only waits for the timeout to publish the summary then.
+ */
+#define DOWNLINK_MIN_PERIOD_MS 100
+#define DOWNLINK_GROUP_NAME_LEN 16
+#define DOWNLINK_NODE_GROUPS 8          /* groups a node can be member of */
+#define DOWNLINK_NODE_GROUPS_KEY "groups"
+#define DOWNLINK_TRACKERS 4             /* commands awaiting acknowledgments */
+#define DOWNLINK_FAILED_ADDRS 16        /* failing nodes listed in a summary */
+#define DOWNLINK_SEND_QUEUE_LEN 16      /* commands of the root waiting for the sender */
+#define DOWNLINK_HINT_PERIOD_MS 1000    /* between two throttle multicasts */
+#define DOWNLINK_HINT_ADDRS 16          /* nodes throttled by one multicast */
+
+static const struct {
+    const char *name;
+    uint8_t command;
+} downlink_commands[] = {
+    {"set_period",       CMD_SET_PERIOD},
+    {"set_resolution",   CMD_SET_RESOLUTION},
+    {"set_deadband",     CMD_SET_DEADBAND},
+    {"request_snapshot", CMD_REQUEST_SNAPSHOT},
+    {"restart",          CMD_RESTART},
+    {"join_group",       CMD_JOIN_GROUP},
+    {"leave_group",      CMD_LEAVE_GROUP},
+    {"set_slot",         CMD_SET_SLOT},
+};
+
+typedef struct {
+    downlink_command_t command;
+    uint32_t group_hash;            /* of the group addressed, 0 when unused */
+    int group;                      /* index in downlink_groups, -1 when the members are unknown */
+    size_t addrs_num;               /* 0 sends the command to every node */
+    uint8_t addrs[][MWIFI_ADDR_LEN];
+} downlink_request_t;
+
+/**
+ * @brief A named group of nodes, as known by the root.
+ */
+typedef struct {
+    char name[DOWNLINK_GROUP_NAME_LEN];
+    uint32_t hash;
+    size_t members_num;
+    uint8_t (*members)[MWIFI_ADDR_LEN];
+} downlink_group_t;
+
+/**
+ * @brief A command queued to the sender: one of the root itself, or a request of
+ *        the MQTT topic, which the sender releases.
+ */
+typedef struct {
+    uint8_t addr[MWIFI_ADDR_LEN];
+    bool broadcast;
+    uint8_t command;
+    int32_t value;
+    downlink_request_t *request;
+} downlink_root_command_t;
+
+typedef struct {
+    uint16_t id;
+    uint8_t command;
+    bool used;
+    uint16_t expected;
+    uint16_t acked;
+    uint16_t failed;
+    uint8_t failed_addrs[DOWNLINK_FAILED_ADDRS][MWIFI_ADDR_LEN];
+    esp_timer_handle_t timer;
+} downlink_tracker_t;
+
+static uint16_t downlink_next_id = 0;
+static downlink_group_t downlink_groups[CONFIG_DOWNLINK_MAX_GROUPS] = {0};
+static downlink_tracker_t downlink_trackers[DOWNLINK_TRACKERS] = {0};
+static portMUX_TYPE downlink_lock = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t downlink_mutex = NULL;     /* groups and starting trackers, across downlink tasks */
+static QueueHandle_t downlink_send_queue = NULL;
+static uint32_t downlink_send_dropped = 0;
+static uint32_t node_groups[DOWNLINK_NODE_GROUPS] = {0};  /* hashes of the groups joined by this node */
+
+
+/**
+ * @brief Mesh group address of a group. The multicast bit keeps it apart from
+ *        the addresses of the nodes.
+ */
+static void downlink_group_addr(uint32_t hash, mesh_addr_t *addr) {
+    addr->addr[0] = 0x01;
+    addr->addr[1] = 0x00;
+    addr->addr[2] = 0x5e;
+    addr->addr[3] = (hash >> 16) & 0xff;
+    addr->addr[4] = (hash >> 8) & 0xff;
+    addr->addr[5] = hash & 0xff;
+}
+
+/**
+ * @brief Next id of an MQTT command, never 0: the nodes acknowledge only the
+ *        commands with an id.
+ */
+static uint16_t downlink_command_id(void) {
+    downlink_next_id++;
+    if (!downlink_next_id)
+        downlink_next_id = 1;
+    return downlink_next_id;
+}
+
+/**
+ * @brief Hash of a group name, as long as the root keeps it, never 0.
+ */
+static uint32_t downlink_group_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; name[i] && i < DOWNLINK_GROUP_NAME_LEN - 1; i++)
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    hash &= 0xffffff;
+    return hash ? hash : 1;     /* 0 stands for no group */
+}
+
+
+static bool downlink_valid_resolution(int32_t value) {
+    return (value >= INA219_RES_9BIT_1S && value <= INA219_RES_12BIT_1S) ||
+           (value >= INA219_RES_12BIT_2S && value <= INA219_RES_12BIT_128S);
+}
+
+/**
+ * @brief Join or leave a mesh group, keeping the membership in NVS.
+ */
+static mdf_err_t downlink_node_group(uint32_t hash, bool join) {
+    mesh_addr_t group_addr = {0};
+    downlink_group_addr(hash, &group_addr);
+
+    int slot = -1;
+    for (int i = 0; i < DOWNLINK_NODE_GROUPS; i++) {
+        if (node_groups[i] == hash) {
+            slot = i;
+            break;
+        }
+        if (join && !node_groups[i] && slot < 0)
+            slot = i;
+    }
+
+    if (slot < 0)
+        return join ? MDF_ERR_NO_MEM : MDF_OK;
+
+    mdf_err_t ret = join ? esp_mesh_set_group_id(&group_addr, 1) : esp_mesh_delete_group_id(&group_addr, 1);
+    MDF_ERROR_CHECK(ret != MDF_OK, ret, "<%s> update mesh group", mdf_err_to_name(ret));
+    node_groups[slot] = join ? hash : 0;
+    return mdf_info_save(DOWNLINK_NODE_GROUPS_KEY, node_groups, sizeof(node_groups));
+}
+
+/**
+ * @brief Join again the groups kept in NVS, once the mesh is up.
+ */
+void downlink_restore_groups(void) {
+    mesh_addr_t group_addr = {0};
+
+    if (mdf_info_load(DOWNLINK_NODE_GROUPS_KEY, node_groups, sizeof(node_groups)) != MDF_OK)
+        return;
+
+    for (int i = 0; i < DOWNLINK_NODE_GROUPS; i++) {
+        if (!node_groups[i])
+            continue;
+        downlink_group_addr(node_groups[i], &group_addr);
+        esp_mesh_set_group_id(&group_addr, 1);
+    }
+}
+
+/**
+ * @brief Apply a command on this node.
+ */
+static mdf_err_t downlink_apply(const downlink_command_t *command) {
+    MDF_LOGI("Apply command %d (id %d), value: %d", command->command, command->id, command->value);
+
+    switch (command->command) {
+        case CMD_SET_PERIOD:
+            MDF_ERROR_CHECK(command->value < DOWNLINK_MIN_PERIOD_MS, MDF_ERR_INVALID_ARG,
+                            "Sampling period too short: %d", command->value);
+            sampling_config.period_ms = command->value;
+            sampling_throttle_ms = 0;
+            sampling_wakeup();
+            break;
+        case CMD_SET_RESOLUTION:
+            MDF_ERROR_CHECK(!downlink_valid_resolution(command->value), MDF_ERR_INVALID_ARG,
+                            "Invalid INA219 resolution: %d", command->value);
+            sampling_config.resolution = command->value;
+            sampling_reconfigure = true;
+            break;
+        case CMD_SET_DEADBAND:
+            MDF_ERROR_CHECK(command->value < 0, MDF_ERR_INVALID_ARG, "Invalid deadband: %d", command->value);
+            sampling_config.deadband = command->value;
+            break;
+        case CMD_REQUEST_SNAPSHOT:
+            sampling_snapshot = true;
+            sampling_wakeup();
+            return MDF_OK;
+        case CMD_RESTART:
+            MDF_LOGW("The device will restart after 3 seconds");
+            vTaskDelay(pdMS_TO_TICKS(3000));
+            esp_restart();
+            return MDF_OK;
+        case CMD_JOIN_GROUP:
+        case CMD_LEAVE_GROUP:
+            return downlink_node_group(command->value & 0xffffff, command->command == CMD_JOIN_GROUP);
+        case CMD_THROTTLE:
+            // a hint of the root ingress, kept apart from the configuration so that it is never saved
+            sampling_throttle_us = esp_timer_get_time();
+            if (command->value != sampling_throttle_ms) {
+                MDF_LOGW("Throttled by the root, sampling period: %d ms", command->value);
+                sampling_throttle_ms = command->value;
+                sampling_wakeup();
+            }
+            return MDF_OK;
+        case CMD_SET_SLOT:
+            MDF_ERROR_CHECK(command->value < -1 || command->value >= SAMPLING_SLOTS, MDF_ERR_INVALID_ARG,
+                            "Invalid transmit slot: %d", command->value);
+            // the root sends it again after every failover, NVS is only written when it moved
+            if (command->value == sampling_slot)
+                return MDF_OK;
+            sampling_slot = command->value;
+            sampling_wakeup();
+            return mdf_info_save(SAMPLING_SLOT_KEY, &sampling_slot, sizeof(sampling_slot));
+        case CMD_CONGESTION:
+            congestion_signal();
+            congestion_log_stats();
+            return MDF_OK;
+        default:
+            MDF_LOGW("Unknown command: %d", command->command);
+            return MDF_ERR_NOT_SUPPORTED;
+    }
+
+    return mdf_info_save(SAMPLING_CONFIG_KEY, &sampling_config, sizeof(sampling_config_t));
+}
+
+/**
+ * @brief Send the acknowledgment of a command towards the root.
+ */
+static mdf_err_t downlink_ack(uint16_t id, mdf_err_t result) {
+    char frame[sizeof(frame_header_t) + sizeof(command_ack_t)];
+    command_ack_t *ack = (command_ack_t *)(frame + sizeof(frame_header_t));
+    mwifi_data_type_t data_type = {
+        .custom = COMMAND_ACK,
+    };
+
+    frame_header_init((frame_header_t *)frame);
+    ack->version = COMMAND_VERSION;
+    ack->status  = result == MDF_OK ? 0 : (result & 0xff) ? (result & 0xff) : 0xff;
+    ack->id      = id;
+    return aggregate_send(&data_type, frame, sizeof(frame));
+}
+
+/**
+ * @brief Node handler of DOWNLINK_COMMAND packets.
+ */
+static mdf_err_t node_downlink_handler(packet_t *packet) {
+    const downlink_command_t *command = (const downlink_command_t *)packet->data;
+    MDF_ERROR_CHECK(packet->size < sizeof(downlink_command_t), MDF_ERR_INVALID_SIZE,
+                    "Truncated command, size: %d", packet->size);
+    MDF_ERROR_CHECK(command->version != COMMAND_VERSION, MDF_ERR_NOT_SUPPORTED,
+                    "Unsupported command version: %d", command->version);
+
+    // a restart never returns, so it is acknowledged upfront
+    if (command->command == CMD_RESTART)
+        downlink_ack(command->id, MDF_OK);
+
+    mdf_err_t ret = downlink_apply(command);
+    // commands of the root itself have no id and are not acknowledged
+    if (command->id)
+        downlink_ack(command->id, ret);
+    return ret;
+}
+
+/**
+ * @brief Publish the acknowledgment summary of a command and free its tracker.
+ */
+static void downlink_tracker_report(void *arg) {
+    downlink_tracker_t *tracker = (downlink_tracker_t *)arg;
+    downlink_tracker_t report;
+    char mac[18] = {0};
+
+    esp_timer_stop(tracker->timer);
+    portENTER_CRITICAL(&downlink_lock);
+    report = *tracker;
+    tracker->used = false;
+    portEXIT_CRITICAL(&downlink_lock);
+
+    if (!report.used)
+        return;
+
+    cJSON *json_root   = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json_root, "id", report.id);
+    cJSON_AddNumberToObject(json_root, "command", report.command);
+    cJSON_AddNumberToObject(json_root, "expected", report.expected);
+    cJSON_AddNumberToObject(json_root, "acked", report.acked);
+    cJSON *json_failed = cJSON_AddArrayToObject(json_root, "failed");
+    for (int i = 0; i < report.failed && i < DOWNLINK_FAILED_ADDRS; i++) {
+        snprintf(mac, sizeof(mac), MACSTR, MAC2STR(report.failed_addrs[i]));
+        cJSON_AddItemToArray(json_failed, cJSON_CreateString(mac));
+    }
+
+    char *payload = cJSON_PrintUnformatted(json_root);
+    cJSON_Delete(json_root);
+    MDF_ERROR_CHECK(!payload, , "cJSON_PrintUnformatted, command summary");
+    MDF_LOGI("Command %d (id %d) acknowledged by %d/%d nodes, failed: %d",
+             report.command, report.id, report.acked, report.expected, report.failed);
+
+    // the payload buffer is moved to the TX stage, which releases it
+    pipeline_forward(MQTT_TOPIC_COMMAND_ACK, payload, strlen(payload));
+}
+
+/**
+ * @brief Start counting the acknowledgments of a command.
+ */
+static void downlink_tracker_start(const downlink_command_t *command, uint16_t expected) {
+    downlink_tracker_t *tracker = &downlink_trackers[command->id % DOWNLINK_TRACKERS];
+
+    xSemaphoreTake(downlink_mutex, portMAX_DELAY);
+    // a tracker still in use belongs to an older command, which is reported as is
+    if (tracker->used)
+        downlink_tracker_report(tracker);
+
+    if (!tracker->timer) {
+        esp_timer_create_args_t timer_args = {
+            .callback = downlink_tracker_report,
+            .arg      = tracker,
+            .name     = "downlink_ack",
+        };
+        ESP_ERROR_CHECK(esp_timer_create(&timer_args, &tracker->timer));
+    }
+
+    portENTER_CRITICAL(&downlink_lock);
+    tracker->id       = command->id;
+    tracker->command  = command->command;
+    tracker->expected = expected;
+    tracker->acked    = 0;
+    tracker->failed   = 0;
+    tracker->used     = true;
+    portEXIT_CRITICAL(&downlink_lock);
+
+    esp_timer_start_once(tracker->timer, (uint64_t)CONFIG_DOWNLINK_ACK_TIMEOUT_MS * 1000);
+    xSemaphoreGive(downlink_mutex);
+}
+
+static void downlink_tracker_ack(const uint8_t *src_addr, uint16_t id, uint8_t status) {
+    downlink_tracker_t *tracker = &downlink_trackers[id % DOWNLINK_TRACKERS];
+    bool complete = false;
+
+    portENTER_CRITICAL(&downlink_lock);
+    if (tracker->used && tracker->id == id) {
+        tracker->acked++;
+        if (status) {
+            if (tracker->failed < DOWNLINK_FAILED_ADDRS)
+                memcpy(tracker->failed_addrs[tracker->failed], src_addr, MWIFI_ADDR_LEN);
+            tracker->failed++;
+        }
+        complete = tracker->expected && tracker->acked >= tracker->expected;
+    }
+    portEXIT_CRITICAL(&downlink_lock);
+
+    if (complete)
+        downlink_tracker_report(tracker);
+}
+
+/**
+ * @brief Root handler of COMMAND_ACK packets.
+ */
+static mdf_err_t root_command_ack_handler(packet_t *packet) {
+    const command_ack_t *ack = (const command_ack_t *)packet->data;
+    MDF_ERROR_CHECK(packet->size < sizeof(command_ack_t), MDF_ERR_INVALID_SIZE,
+                    "Truncated acknowledgment, size: %d", packet->size);
+    downlink_tracker_ack(packet->src_addr, ack->id, ack->status);
+    return MDF_OK;
+}
+
+/**
+ * @brief Find a group by name, creating it when asked to. Called with the mutex held.
+ */
+static int downlink_group_find(const char *name, bool create) {
+    int free_slot = -1;
+
+    for (int i = 0; i < CONFIG_DOWNLINK_MAX_GROUPS; i++) {
+        if (!downlink_groups[i].hash && free_slot < 0)
+            free_slot = i;
+        else if (downlink_groups[i].hash && !strncmp(downlink_groups[i].name, name, DOWNLINK_GROUP_NAME_LEN))
+            return i;
+    }
+
+    if (!create || free_slot < 0)
+        return -1;
+
+    strncpy(downlink_groups[free_slot].name, name, DOWNLINK_GROUP_NAME_LEN - 1);
+    downlink_groups[free_slot].hash = downlink_group_hash(downlink_groups[free_slot].name);
+    return free_slot;
+}
+
+/**
+ * @brief Keep track on the root of the nodes joining or leaving a group. Called
+ *        with the mutex held.
+ */
+static void downlink_group_update(downlink_group_t *group, const uint8_t (*addrs)[MWIFI_ADDR_LEN],
+                                  size_t addrs_num, bool join) {
+    for (int i = 0; i < addrs_num; i++) {
+        int found = -1;
+        for (int j = 0; j < group->members_num && found < 0; j++) {
+            if (!memcmp(group->members[j], addrs[i], MWIFI_ADDR_LEN))
+                found = j;
+        }
+
+        if (join && found < 0) {
+            uint8_t (*members)[MWIFI_ADDR_LEN] = MDF_REALLOC(group->members, (group->members_num + 1) * MWIFI_ADDR_LEN);
+            MDF_ERROR_BREAK(!members, "Grow group %s", group->name);
+            group->members = members;
+            memcpy(group->members[group->members_num++], addrs[i], MWIFI_ADDR_LEN);
+        } else if (!join && found >= 0) {
+            memcpy(group->members[found], group->members[--group->members_num], MWIFI_ADDR_LEN);
+        }
+    }
+}
+
+/**
+ * @brief Send a command to the targeted nodes, then apply it on the root too
+ *        when it is among them.
+ */
+static void downlink_request_send(downlink_request_t *request) {
+    mdf_err_t ret = MDF_OK;
+    uint8_t self_addr[MWIFI_ADDR_LEN] = {0};
+    mesh_addr_t dest_addr = {.addr = MWIFI_ADDR_BROADCAST};
+    bool self_targeted = true;
+    uint16_t expected = esp_mesh_get_routing_table_size();
+    mwifi_data_type_t data_type = {
+        .communicate = MWIFI_COMMUNICATE_BROADCAST,
+        .custom = DOWNLINK_COMMAND,
+    };
+    bool membership = request->command.command == CMD_JOIN_GROUP || request->command.command == CMD_LEAVE_GROUP;
+
+    esp_read_mac(self_addr, ESP_MAC_WIFI_STA);
+
+    if (request->addrs_num) {
+        // explicit targets, membership commands always come with them
+        data_type.communicate = MWIFI_COMMUNICATE_MULTICAST;
+        expected = request->addrs_num;
+        self_targeted = false;
+        for (int i = 0; i < request->addrs_num; i++) {
+            if (!memcmp(request->addrs[i], self_addr, MWIFI_ADDR_LEN))
+                self_targeted = true;
+        }
+        if (membership && request->group >= 0) {
+            xSemaphoreTake(downlink_mutex, portMAX_DELAY);
+            downlink_group_update(&downlink_groups[request->group], (const uint8_t (*)[MWIFI_ADDR_LEN])request->addrs,
+                                  request->addrs_num, request->command.command == CMD_JOIN_GROUP);
+            xSemaphoreGive(downlink_mutex);
+        }
+    } else if (request->group_hash) {
+        // one transmission to the mesh group, the stack fans it out
+        downlink_group_addr(request->group_hash, &dest_addr);
+        data_type.communicate = MWIFI_COMMUNICATE_MULTICAST;
+        data_type.group = true;
+        expected = 0;
+        if (request->group >= 0) {
+            xSemaphoreTake(downlink_mutex, portMAX_DELAY);
+            expected = downlink_groups[request->group].members_num;
+            xSemaphoreGive(downlink_mutex);
+        } else {
+            MDF_LOGW("Members of group %06x unknown to this root, summary after the timeout", request->group_hash);
+        }
+        self_targeted = esp_mesh_is_my_group(&dest_addr);
+    }
+
+    if (request->command.id)
+        downlink_tracker_start(&request->command, expected);
+
+    MDF_LOGI("Send command %d (id %d) to %d nodes", request->command.command, request->command.id, expected);
+    ret = mwifi_root_write(request->addrs_num ? (uint8_t *)request->addrs : dest_addr.addr,
+                           request->addrs_num ? request->addrs_num : 1,
+                           &data_type, &request->command, sizeof(downlink_command_t), true);
+    MDF_ERROR_GOTO(ret != MDF_OK, EXIT, "<%s> mwifi_root_write", mdf_err_to_name(ret));
+
+EXIT:
+    // the root does not receive what it sends, it applies and acknowledges on its own
+    if (self_targeted) {
+        if (request->command.command == CMD_RESTART)
+            downlink_tracker_ack(self_addr, request->command.id, 0);
+        downlink_tracker_ack(self_addr, request->command.id, downlink_apply(&request->command) == MDF_OK ? 0 : 0xff);
+    }
+}
+
+/**
+ * @brief Send a command of the root itself to the given nodes, or to every node
+ *        when there are none.
+ */
+static void downlink_send_command(uint8_t command, int32_t value, const uint8_t (*addrs)[MWIFI_ADDR_LEN], size_t addrs_num) {
+    static uint32_t buffer[(sizeof(downlink_request_t) + DOWNLINK_HINT_ADDRS * MWIFI_ADDR_LEN + 3) / 4];
+    downlink_request_t *request = (downlink_request_t *)buffer;
+
+    memset(buffer, 0, sizeof(buffer));
+    request->command.version = COMMAND_VERSION;
+    request->command.command = command;
+    request->command.value   = value;
+    request->group           = -1;
+    request->addrs_num       = addrs_num;
+    if (addrs_num)
+        memcpy(request->addrs, addrs, addrs_num * MWIFI_ADDR_LEN);
+    downlink_request_send(request);
+}
+
+/**
+ * @brief Send the queued commands, one after the other. Throttle
+ *        hints are held back and sent to all the nodes due one in a single
+ *        multicast, at most every DOWNLINK_HINT_PERIOD_MS.
+ */
+static void downlink_send_task(void *arg) {
+    static uint8_t hints[DOWNLINK_HINT_ADDRS][MWIFI_ADDR_LEN];
+    size_t hints_num = 0;
+    int32_t hint_value = 0;
+    TickType_t hints_sent = 0;
+    const TickType_t hint_period = pdMS_TO_TICKS(DOWNLINK_HINT_PERIOD_MS);
+    downlink_root_command_t item;
+
+    MDF_LOGI("Downlink send task is running");
+
+    for (;;) {
+        TickType_t elapsed = xTaskGetTickCount() - hints_sent;
+        TickType_t wait = !hints_num ? portMAX_DELAY : elapsed >= hint_period ? 0 : hint_period - elapsed;
+
+        if (xQueueReceive(downlink_send_queue, &item, wait) == pdTRUE) {
+            if (item.request) {
+                downlink_request_send(item.request);
+                HEAP_FREE(item.request);
+            } else if (item.command != CMD_THROTTLE || item.broadcast) {
+                downlink_send_command(item.command, item.value, item.broadcast ? NULL : &item.addr, !item.broadcast);
+            } else {
+                bool pending = false;
+                for (int i = 0; i < hints_num && !pending; i++)
+                    pending = !memcmp(hints[i], item.addr, MWIFI_ADDR_LEN);
+                if (!pending && hints_num < DOWNLINK_HINT_ADDRS)
+                    memcpy(hints[hints_num++], item.addr, MWIFI_ADDR_LEN);
+                else if (!pending)
+                    downlink_send_dropped++;
+                if (item.value > hint_value)
+                    hint_value = item.value;
+            }
+        }
+
+        if (hints_num && xTaskGetTickCount() - hints_sent >= hint_period) {
+            MDF_LOGW("Throttle %d nodes, sampling period: %d ms", hints_num, hint_value);
+            downlink_send_command(CMD_THROTTLE, hint_value, (const uint8_t (*)[MWIFI_ADDR_LEN])hints, hints_num);
+            hints_num  = 0;
+            hint_value = 0;
+            hints_sent = xTaskGetTickCount();
+        }
+    }
+}
+
+static int downlink_parse_mac(const char *str, uint8_t *addr) {
+    unsigned int mac[MWIFI_ADDR_LEN] = {0};
+    if (sscanf(str, "%x:%x:%x:%x:%x:%x", &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]) != MWIFI_ADDR_LEN)
+        return -1;
+    for (int i = 0; i < MWIFI_ADDR_LEN; i++)
+        addr[i] = mac[i];
+    return 0;
+}
+
+/**
+ * @brief Handler of the MQTT command topic. It runs on the MQTT client task, so
+ *        the command is only parsed here and queued to the sender.
+ */
+void downlink_mqtt_handler(const char *data, int data_len) {
+    downlink_request_t *request = NULL;
+    downlink_root_command_t item = {0};
+    char *json = HOTPATH_MALLOC(HEAP_TAG_DOWNLINK, data_len + 1);
+    MDF_ERROR_CHECK(!json, , "Allocate command buffer");
+    memcpy(json, data, data_len);
+    json[data_len] = '\0';
+
+    cJSON *json_root    = cJSON_Parse(json);
+    cJSON *json_command = cJSON_GetObjectItem(json_root, "command");
+    cJSON *json_value   = cJSON_GetObjectItem(json_root, "value");
+    cJSON *json_targets = cJSON_GetObjectItem(json_root, "targets");
+    cJSON *json_group   = cJSON_GetObjectItem(json_root, "group");
+    cJSON *json_target  = NULL;
+    size_t addrs_num    = 0;
+    MDF_ERROR_GOTO(!cJSON_IsString(json_command), EXIT, "Malformed command: %s", json);
+
+    cJSON_ArrayForEach(json_target, json_targets)
+        addrs_num++;
+
+    request = HOTPATH_MALLOC(HEAP_TAG_DOWNLINK, sizeof(downlink_request_t) + addrs_num * MWIFI_ADDR_LEN);
+    MDF_ERROR_GOTO(!request, EXIT, "Allocate command request");
+    memset(request, 0, sizeof(downlink_request_t));
+
+    for (int i = 0; i < sizeof(downlink_commands) / sizeof(downlink_commands[0]); i++) {
+        if (!strcmp(downlink_commands[i].name, json_command->valuestring))
+            request->command.command = downlink_commands[i].command;
+    }
+    MDF_ERROR_GOTO(!request->command.command, EXIT, "Unknown command: %s", json_command->valuestring);
+
+    request->command.version = COMMAND_VERSION;
+    request->command.id      = downlink_command_id();
+    request->command.value   = cJSON_IsNumber(json_value) ? json_value->valueint : 0;
+    request->group           = -1;
+
+    bool membership = request->command.command == CMD_JOIN_GROUP || request->command.command == CMD_LEAVE_GROUP;
+    if (cJSON_IsString(json_group)) {
+        request->group_hash = downlink_group_hash(json_group->valuestring);
+        xSemaphoreTake(downlink_mutex, portMAX_DELAY);
+        request->group = downlink_group_find(json_group->valuestring, request->command.command == CMD_JOIN_GROUP);
+        xSemaphoreGive(downlink_mutex);
+        MDF_ERROR_GOTO(request->command.command == CMD_JOIN_GROUP && request->group < 0, EXIT,
+                       "Too many groups: %s", json_group->valuestring);
+        if (membership)
+            request->command.value = request->group_hash;
+    }
+    MDF_ERROR_GOTO(membership && (!request->group_hash || !addrs_num), EXIT, "Group membership needs a group and targets");
+
+    cJSON_ArrayForEach(json_target, json_targets) {
+        MDF_ERROR_GOTO(!cJSON_IsString(json_target) ||
+                       downlink_parse_mac(json_target->valuestring, request->addrs[request->addrs_num]),
+                       EXIT, "Malformed target address");
+        request->addrs_num++;
+    }
+
+    item.request = request;
+    if (xQueueSend(downlink_send_queue, &item, 0) == pdTRUE) {
+        request = NULL;
+    } else {
+        downlink_send_dropped++;
+        MDF_LOGW("Downlink sender lagging behind, command %d dropped, total dropped: %d",
+                 request->command.command, downlink_send_dropped);
+    }
+
+EXIT:
+    HEAP_FREE(request);
+    cJSON_Delete(json_root);
+    HEAP_FREE(json);
+}
+
+/**
+ * @brief Queue a command of the root itself, to a node or to every node when addr
+ *        is NULL, without waiting for acknowledgments. It never blocks: the
+ *        command is dropped when the sender lags behind.
+ */
+void downlink_send(const uint8_t *addr, uint8_t command, int32_t value) {
+    downlink_root_command_t item = {
+        .broadcast = !addr,
+        .command   = command,
+        .value     = value,
+    };
+
+    MDF_ERROR_CHECK(!downlink_send_queue, , "Downlink is not initialised");
+    if (addr)
+        memcpy(item.addr, addr, MWIFI_ADDR_LEN);
+
+    if (xQueueSend(downlink_send_queue, &item, 0) != pdTRUE) {
+        downlink_send_dropped++;
+        MDF_LOGW("Downlink sender lagging behind, command %d dropped, total dropped: %d",
+                 command, downlink_send_dropped);
+    }
+}
+
+/**
+ * @brief Signal the nodes to back off while the root pipeline is filling up.
+ */
+static void downlink_congestion_check(void *arg) {
+    int fill = pipeline_congestion();
+
+    if (fill >= CONFIG_CONGESTION_SIGNAL_THRESHOLD) {
+        MDF_LOGW("Root pipeline %d%% full, signal congestion", fill);
+        downlink_send(NULL, CMD_CONGESTION, fill);
+    }
+}
+
+/**
+ * @brief Create the lock of the downlink state and the queue of the sender, at
+ *        boot: the root RX stage may send commands before downlink_start().
+ */
+void downlink_init(void) {
+    if (!downlink_mutex)
+        downlink_mutex = xSemaphoreCreateMutex();
+    if (!downlink_send_queue)
+        downlink_send_queue = staticmem_queue("downlink_send_queue", DOWNLINK_SEND_QUEUE_LEN,
+                                              sizeof(downlink_root_command_t));
+}
+
+void downlink_start(void) {
+    static esp_timer_handle_t congestion_timer = NULL;
+
+    packet_register(PACKET_TABLE_ROOT, COMMAND_ACK, "COMMAND_ACK", root_command_ack_handler);
+    mqtt_set_command_handler(downlink_mqtt_handler);
+    supervisor_start(SUPERVISOR_DOWNLINK, downlink_send_task);
+
+    if (!congestion_timer && CONFIG_CONGESTION_SIGNAL_THRESHOLD < 100) {
+        esp_timer_create_args_t timer_args = {
+            .callback = downlink_congestion_check,
+            .name     = "congestion",
+        };
+        ESP_ERROR_CHECK(esp_timer_create(&timer_args, &congestion_timer));
+        ESP_ERROR_CHECK(esp_timer_start_periodic(congestion_timer, (uint64_t)CONFIG_CONGESTION_SIGNAL_PERIOD_MS * 1000));
+    }
+}
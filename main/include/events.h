@@ -9,7 +9,6 @@
 #include "mdf_event_loop.h"
 
 #include "logic.h"
-#include "msntp.h"
 
 
 static bool is_connected = false;
@@ -30,23 +29,24 @@ mdf_err_t event_mesh_callback(mdf_event_loop_t event, void *ctx);
  *     1. Do not block or lengthy operations in the callback function.
  *     2. Do not consume a lot of memory in the callback function.
  *        The task memory of the callback function is only 4KB.
+ *     Handlers are therefore run by the work task, see workqueue.h.
  */
 mdf_err_t event_mesh_callback(mdf_event_loop_t event, void *ctx) {
     switch (event) {
         case MDF_EVENT_MWIFI_PARENT_CONNECTED:
-            __event_mesh_parent_connected();
+            work_submit(WORK_PARENT_CONNECTED, __event_mesh_parent_connected);
             break;
         case MDF_EVENT_MWIFI_PARENT_DISCONNECTED:
-            __event_mesh_parent_disconnected();
+            work_submit(WORK_PARENT_DISCONNECTED, __event_mesh_parent_disconnected);
             break;
         case MDF_EVENT_MWIFI_ROOT_GOT_IP:
-            __event_mesh_root_got_ip();
+            work_submit(WORK_ROOT_GOT_IP, __event_mesh_root_got_ip);
             break;
         case MDF_EVENT_MWIFI_ROOT_LOST_IP:
-            __event_mesh_root_lost_ip();
+            work_submit(WORK_ROOT_LOST_IP, __event_mesh_root_lost_ip);
             break;
         case MDF_EVENT_MUPGRADE_STARTED: 
-            __event_mesh_mupgrade_started();
+            work_submit(WORK_MUPGRADE_STARTED, __event_mesh_mupgrade_started);
             break;
         // case MDF_EVENT_MUPGRADE_STATUS:
         //     MDF_LOGI("Upgrade progress: %d%%", (int)ctx);
@@ -58,9 +58,15 @@ mdf_err_t event_mesh_callback(mdf_event_loop_t event, void *ctx) {
 }
 
 mdf_err_t __event_mesh_parent_connected(void) {
+    fastjoin_joined();
+    powersave_update();
     run_node_reader_task();
-    if ( node_is_root() )
+    if ( node_is_root() ) {
+        failover_takeover();
         run_root_reader_task();
+    } else {
+        failover_handoff();
+    }
     // run_node_executer_tasks();
     return MDF_OK;
 }
@@ -74,8 +80,10 @@ mdf_err_t __event_mesh_parent_disconnected(void) {
 mdf_err_t __event_mesh_root_got_ip(void) {
     MDF_LOGI("Got IP address");
     if ( node_is_root() ) {
-        setup_sntp();
-        sync_sntp();
+        pipeline_mark_got_ip();
+        setup_sntp(meshtime_resync);
+        downlink_start();
+        ota_root_start();
         mqtt_connect();
         run_node_executer_tasks(); // no way, lancia solo se root
         is_connected = true;
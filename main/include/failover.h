@@ -0,0 +1,169 @@
+/*
+ * ESP32 Mesh Network
+ * Copyright 2021, FCRLab at University of Messina (Messina, Italy)
+ *
+ * @maintainer: Lorenzo Carnevale <lcarnevale@unime.it>
+ */
+
+#include "mwifi.h"
+
+/**
+ * @brief Root failover.
+ *
+ * A node taking over as root skips what it already has: the MQTT client is
+ * created ahead of time, and the tasks and timers of a previous root term are
+ * kept. A node losing the root role hands its state over to the new root:
+ * the messages it did not publish yet are forwarded by the TX stage (see
+ * pipeline_handoff()), and the sequence state of the nodes is sent here, so
+ * that the new root does not count false gaps and restarts, together with the
+ * count of transmit slots handed out, so that it goes on spreading them. The time from the
+ * takeover to the first publish is logged by the TX stage.
+ */
+#define FAILOVER_NODES_PER_PACKET ((MWIFI_PAYLOAD_LEN - sizeof(handoff_header_t)) / sizeof(handoff_node_t))
+
+static bool failover_was_root = false;
+
+
+/**
+ * @brief Adopt the sequence state of a node handed over by the former root,
+ *        unless this root already heard from the node.
+ */
+static void failover_adopt_node(const handoff_node_t *node) {
+    portENTER_CRITICAL(&nodestats_lock);
+
+    nodestats_entry_t *entry = nodestats_lookup(node->addr);
+    if (entry && !entry->framed) {
+        entry->framed   = true;
+        entry->boot_id  = node->boot_id;
+        entry->last_seq = node->last_seq;
+        entry->window   = node->window;
+        entry->slotted  = node->slotted;
+    }
+
+    portEXIT_CRITICAL(&nodestats_lock);
+}
+
+/**
+ * @brief Root handler of ROOT_HANDOFF packets.
+ */
+static mdf_err_t root_handoff_handler(packet_t *packet) {
+    const handoff_header_t *header = (const handoff_header_t *)packet->data;
+    MDF_ERROR_CHECK(packet->size < sizeof(handoff_header_t), MDF_ERR_INVALID_SIZE,
+                    "Truncated handoff packet, size: %d", packet->size);
+    MDF_ERROR_CHECK(header->version != HANDOFF_VERSION, MDF_ERR_NOT_SUPPORTED,
+                    "Unsupported handoff version: %d", header->version);
+
+    size_t size = packet->size - sizeof(handoff_header_t);
+
+    switch (header->kind) {
+        case HANDOFF_MESSAGE: {
+            MDF_ERROR_CHECK(header->topic >= MQTT_TOPIC_MAX, MDF_ERR_INVALID_ARG, "Invalid topic: %d", header->topic);
+            char *payload = pipeline_alloc(size + 1);
+            MDF_ERROR_CHECK(!payload, MDF_ERR_NO_MEM, "Allocate handoff message, size: %d", size);
+            memcpy(payload, packet->data + sizeof(handoff_header_t), size);
+            payload[size] = '\0';
+            // the payload buffer is moved to the TX stage, which releases it
+            pipeline_forward(header->topic, payload, size);
+            return MDF_OK;
+        }
+        case HANDOFF_SLOTS: {
+            uint32_t slots = 0;
+            MDF_ERROR_CHECK(size < sizeof(slots), MDF_ERR_INVALID_SIZE, "Truncated handoff slots, size: %d", size);
+            memcpy(&slots, packet->data + sizeof(handoff_header_t), sizeof(slots));
+            portENTER_CRITICAL(&nodestats_lock);
+            if (slots > nodestats_slots)
+                nodestats_slots = slots;
+            portEXIT_CRITICAL(&nodestats_lock);
+            return MDF_OK;
+        }
+        case HANDOFF_NODES: {
+            const handoff_node_t *nodes = (const handoff_node_t *)(packet->data + sizeof(handoff_header_t));
+            MDF_ERROR_CHECK(size < header->count * sizeof(handoff_node_t), MDF_ERR_INVALID_SIZE,
+                            "Truncated handoff nodes, count: %d", header->count);
+            for (int i = 0; i < header->count; i++)
+                failover_adopt_node(&nodes[i]);
+            MDF_LOGI("Adopted the state of %d nodes from the former root", header->count);
+            return MDF_OK;
+        }
+        default:
+            return MDF_ERR_NOT_SUPPORTED;
+    }
+}
+
+/**
+ * @brief This node became root.
+ */
+void failover_takeover(void) {
+    if (!failover_was_root)
+        pipeline_mark_takeover();
+    failover_was_root = true;
+    packet_register(PACKET_TABLE_ROOT, ROOT_HANDOFF, "ROOT_HANDOFF", root_handoff_handler);
+#ifdef CONFIG_FAILOVER_PREWARM
+    mqtt_prepare();
+#endif
+}
+
+/**
+ * @brief This node joined the mesh as a non-root node: if it was root, send the
+ *        sequence state of the nodes to the new root.
+ */
+void failover_handoff(void) {
+    mdf_err_t ret = MDF_OK;
+    char *data = NULL;
+    handoff_header_t *header = NULL;
+    mwifi_data_type_t data_type = {
+        .compression = true,
+        .custom = ROOT_HANDOFF,
+    };
+
+#ifdef CONFIG_FAILOVER_PREWARM
+    mqtt_prepare();
+#endif
+    if (!failover_was_root)
+        return;
+    failover_was_root = false;
+
+    data = HOTPATH_MALLOC(HEAP_TAG_FAILOVER, MWIFI_PAYLOAD_LEN);
+    MDF_ERROR_CHECK(!data, , "Allocate handoff packet");
+    header = (handoff_header_t *)data;
+    header->version = HANDOFF_VERSION;
+    header->kind    = HANDOFF_SLOTS;
+    header->count   = 0;
+
+    portENTER_CRITICAL(&nodestats_lock);
+    memcpy(data + sizeof(handoff_header_t), &nodestats_slots, sizeof(nodestats_slots));
+    portEXIT_CRITICAL(&nodestats_lock);
+    ret = mwifi_write(NULL, &data_type, data, sizeof(handoff_header_t) + sizeof(nodestats_slots), true);
+    MDF_ERROR_GOTO(ret != MDF_OK, EXIT, "<%s> mwifi_write, handoff slots", mdf_err_to_name(ret));
+
+    header->kind = HANDOFF_NODES;
+
+    for (int i = 0; i < CONFIG_NODESTATS_MAX_NODES; i++) {
+        handoff_node_t *node = (handoff_node_t *)(data + sizeof(handoff_header_t)) + header->count;
+
+        portENTER_CRITICAL(&nodestats_lock);
+        bool framed = nodestats[i].used && nodestats[i].framed;
+        if (framed) {
+            memcpy(node->addr, nodestats[i].addr, MWIFI_ADDR_LEN);
+            node->boot_id  = nodestats[i].boot_id;
+            node->last_seq = nodestats[i].last_seq;
+            node->window   = nodestats[i].window;
+            node->slotted  = nodestats[i].slotted;
+        }
+        portEXIT_CRITICAL(&nodestats_lock);
+
+        if (framed)
+            header->count++;
+        if (header->count && (header->count == FAILOVER_NODES_PER_PACKET || header->count == UINT8_MAX ||
+                              i == CONFIG_NODESTATS_MAX_NODES - 1)) {
+            ret = mwifi_write(NULL, &data_type, data,
+                                        sizeof(handoff_header_t) + header->count * sizeof(handoff_node_t), true);
+            MDF_ERROR_BREAK(ret != MDF_OK, "<%s> mwifi_write, handoff", mdf_err_to_name(ret));
+            MDF_LOGI("Handed the state of %d nodes over to the new root", header->count);
+            header->count = 0;
+        }
+    }
+
+EXIT:
+    HEAP_FREE(data);
+}
@@ -0,0 +1,141 @@
+/*
+ * ESP32 Mesh Network
+ * Copyright 2021, FCRLab at University of Messina (Messina, Italy)
+ *
+ * @maintainer: Lorenzo Carnevale <lcarnevale@unime.it>
+ */
+
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "mwifi.h"
+#include "mdf_info_store.h"
+
+/**
+ * @brief Fast rejoin.
+ *
+ * Every node keeps in NVS the channel of the mesh and the BSSID of the router.
+ * At boot the mesh is started on the cached channel and router, which spares
+ * the full scan of every channel. When no parent is found within
+ * CONFIG_FASTJOIN_TIMEOUT_MS the mesh is restarted with a full scan.
+ *
+ * Parent and layer change with every reshuffle of the mesh, so they are only
+ * kept in RAM to log where the node rejoined, and NVS is written when the
+ * channel or the router change.
+ */
+#define FASTJOIN_KEY "fastjoin"
+#define FASTJOIN_VERSION 2
+
+typedef struct {
+    uint8_t version;
+    uint8_t channel;
+    uint8_t router_bssid[6];    /* known by the nodes that were root, zero otherwise */
+} fastjoin_cache_t;
+
+static fastjoin_cache_t fastjoin_cache = {0};
+static uint8_t fastjoin_parent[6] = {0};
+static int fastjoin_layer = 0;
+static mwifi_config_t fastjoin_config = {0};
+static esp_timer_handle_t fastjoin_timer = NULL;
+static bool fastjoin_pending = false;       /* started on the cached parameters, not joined yet */
+static int64_t fastjoin_joined_us = 0;
+static bool fastjoin_sampled = false;
+
+
+/**
+ * @brief Restart the mesh with a full scan. Run by the work task.
+ */
+static mdf_err_t fastjoin_fallback(void) {
+    if (!fastjoin_pending)
+        return MDF_OK;
+    fastjoin_pending = false;
+
+    MDF_LOGW("Fast join on channel %d failed, falling back to a full scan", fastjoin_config.channel);
+    fastjoin_config.channel = 0;
+    memset(fastjoin_config.router_bssid, 0, sizeof(fastjoin_config.router_bssid));
+
+    MDF_ERROR_ASSERT(mwifi_stop());
+    MDF_ERROR_ASSERT(mwifi_set_config(&fastjoin_config));
+    return mwifi_start();
+}
+
+static void fastjoin_timeout(void *arg) {
+    work_submit(WORK_FASTJOIN_FALLBACK, fastjoin_fallback);
+}
+
+/**
+ * @brief Apply the cached parameters to the configuration of the mesh, before
+ *        it is started.
+ */
+void fastjoin_apply(mwifi_config_t *config) {
+    fastjoin_config = *config;
+
+    if (mdf_info_load(FASTJOIN_KEY, &fastjoin_cache, sizeof(fastjoin_cache)) != MDF_OK ||
+        fastjoin_cache.version != FASTJOIN_VERSION || !fastjoin_cache.channel)
+        return;
+
+    config->channel = fastjoin_cache.channel;
+    if (fastjoin_cache.router_bssid[0] | fastjoin_cache.router_bssid[1] | fastjoin_cache.router_bssid[2] |
+        fastjoin_cache.router_bssid[3] | fastjoin_cache.router_bssid[4] | fastjoin_cache.router_bssid[5])
+        memcpy(config->router_bssid, fastjoin_cache.router_bssid, sizeof(config->router_bssid));
+    fastjoin_config = *config;
+    fastjoin_pending = true;
+
+    MDF_LOGI("Fast join on channel %d", fastjoin_cache.channel);
+
+    esp_timer_create_args_t timer_args = {
+        .callback = fastjoin_timeout,
+        .name     = "fastjoin",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &fastjoin_timer));
+    ESP_ERROR_CHECK(esp_timer_start_once(fastjoin_timer, (uint64_t)CONFIG_FASTJOIN_TIMEOUT_MS * 1000));
+}
+
+/**
+ * @brief The node joined the mesh: cache the channel and the router it joined
+ *        with. NVS is only written when they changed.
+ */
+void fastjoin_joined(void) {
+    fastjoin_cache_t cache = {
+        .version = FASTJOIN_VERSION,
+    };
+    wifi_second_chan_t second = 0;
+    wifi_ap_record_t ap_info  = {0};
+    mesh_addr_t parent        = {0};
+
+    if (fastjoin_timer)
+        esp_timer_stop(fastjoin_timer);
+    if (!fastjoin_joined_us) {
+        fastjoin_joined_us = esp_timer_get_time();
+        MDF_LOGI("Joined the mesh %lld ms after boot%s", fastjoin_joined_us / 1000,
+                 fastjoin_pending ? " with the cached parameters" : "");
+    }
+    fastjoin_pending = false;
+
+    esp_wifi_get_channel(&cache.channel, &second);
+    esp_mesh_get_parent_bssid(&parent);
+    if (memcmp(parent.addr, fastjoin_parent, sizeof(fastjoin_parent)) || esp_mesh_get_layer() != fastjoin_layer) {
+        memcpy(fastjoin_parent, parent.addr, sizeof(fastjoin_parent));
+        fastjoin_layer = esp_mesh_get_layer();
+        MDF_LOGI("Joined on channel %d, parent: " MACSTR ", layer: %d",
+                 cache.channel, MAC2STR(fastjoin_parent), fastjoin_layer);
+    }
+    if (esp_mesh_is_root() && esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK)
+        memcpy(cache.router_bssid, ap_info.bssid, sizeof(cache.router_bssid));
+    else
+        memcpy(cache.router_bssid, fastjoin_cache.router_bssid, sizeof(cache.router_bssid));
+
+    if (memcmp(&cache, &fastjoin_cache, sizeof(cache))) {
+        fastjoin_cache = cache;
+        mdf_info_save(FASTJOIN_KEY, &fastjoin_cache, sizeof(fastjoin_cache));
+    }
+}
+
+/**
+ * @brief Report the time from boot to the first reading sent.
+ */
+void fastjoin_mark_sample(void) {
+    if (fastjoin_sampled)
+        return;
+    fastjoin_sampled = true;
+    MDF_LOGI("First sample sent %lld ms after boot", esp_timer_get_time() / 1000);
+}
@@ -0,0 +1,99 @@
+/*
+ * ESP32 Mesh Network
+ * Copyright 2021, FCRLab at University of Messina (Messina, Italy)
+ *
+ * @maintainer: Lorenzo Carnevale <lcarnevale@unime.it>
+ */
+
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "mwifi.h"
+
+/**
+ * @brief Node health telemetry.
+ *
+ * Every node sends a health_frame_t every CONFIG_HEALTH_PERIOD_MS from a task of
+ * its own, since the write blocks while the mesh is congested and must not hold
+ * up the work queue. Collecting it only reads counters the subsystems keep
+ * anyway, and it travels upstream like the readings. The root keeps the last
+ * frame of each node in the node statistics, which publish it along with the
+ * delivery counters. The mesh time and work queue statistics are logged locally
+ * at the same time.
+ */
+
+
+/**
+ * @brief Collect the health of this node and send it towards the root.
+ */
+static mdf_err_t health_send(void) {
+    char frame[sizeof(frame_header_t) + sizeof(health_frame_t)] = {0};
+    health_frame_t *health = (health_frame_t *)(frame + sizeof(frame_header_t));
+    wifi_ap_record_t ap_info = {0};
+    mwifi_data_type_t data_type = {
+        .custom = HEALTH,
+    };
+
+    health->version = HEALTH_VERSION;
+    health->flags   = (esp_mesh_is_root() ? HEALTH_FLAG_ROOT : 0) | (meshtime_synced() ? HEALTH_FLAG_SYNCED : 0) |
+                      (powersave_leaf() ? HEALTH_FLAG_POWERSAVE : 0);
+    health->layer   = esp_mesh_get_layer();
+    if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK)
+        health->rssi = ap_info.rssi;
+    if (!esp_mesh_is_root())
+        aggregate_parent_addr(health->parent);
+    health->subtree       = esp_mesh_get_routing_table_size() - 1;
+    health->uptime_s      = esp_timer_get_time() / 1000000;
+    health->free_heap     = esp_get_free_heap_size();
+    health->min_free_heap = esp_get_minimum_free_heap_size();
+    health->stack_hwm     = supervisor_stack_hwm();
+    health->work_queued   = work_queue ? uxQueueMessagesWaiting(work_queue) : 0;
+    health->aggregate_queued = aggregate_open->frames;
+    health->energy_uj     = powersave_energy_per_sample();
+    heapstats_health(health);
+
+    portENTER_CRITICAL(&congestion_lock);
+    health->writes         = congestion.writes;
+    health->write_failures = congestion.failures;
+    health->backoff_scale  = congestion.scale;
+    portEXIT_CRITICAL(&congestion_lock);
+
+    for (int type = 0; type < PACKET_TYPE_MAX; type++)
+        health->rx_errors += packet_routes[PACKET_TABLE_NODE][type].errors;
+
+    meshtime_log_stats();
+    work_log_stats();
+
+    frame_header_init((frame_header_t *)frame);
+    return aggregate_send(&data_type, frame, sizeof(frame));
+}
+
+static void health_task(void *arg) {
+    MDF_LOGI("Health task is running");
+
+    while (mwifi_is_connected()) {
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_HEALTH_PERIOD_MS));
+        health_send();
+    }
+
+    MDF_LOGW("Health task is exit");
+    supervisor_exit(SUPERVISOR_HEALTH, MDF_OK);
+}
+
+/**
+ * @brief Root handler of HEALTH packets.
+ */
+static mdf_err_t root_health_handler(packet_t *packet) {
+    MDF_ERROR_CHECK(packet->size < sizeof(health_frame_t), MDF_ERR_INVALID_SIZE,
+                    "Truncated health frame, size: %d", packet->size);
+    MDF_ERROR_CHECK(((health_frame_t *)packet->data)->version != HEALTH_VERSION, MDF_ERR_NOT_SUPPORTED,
+                    "Unsupported health frame version: %d", ((health_frame_t *)packet->data)->version);
+
+    nodestats_health(packet->src_addr, (const health_frame_t *)packet->data);
+    return MDF_OK;
+}
+
+void health_start(void) {
+    packet_register(PACKET_TABLE_ROOT, HEALTH, "HEALTH", root_health_handler);
+    supervisor_start(SUPERVISOR_HEALTH, health_task);
+}
@@ -0,0 +1,207 @@
+/*
+ * ESP32 Mesh Network
+ * Copyright 2021, FCRLab at University of Messina (Messina, Italy)
+ *
+ * @maintainer: Lorenzo Carnevale <lcarnevale@unime.it>
+ */
+
+#include "stdlib.h"
+
+#include "esp_timer.h"
+
+/**
+ * @brief Heap accounting per subsystem.
+ *
+ * With CONFIG_HEAPSTATS_ENABLE the allocations of the firmware go through
+ * HEAP_MALLOC() and HEAP_CALLOC(), tagged with the subsystem they belong to,
+ * and the cJSON allocations through the hooks of staticmem_init(), tagged as
+ * HEAP_TAG_JSON. Every live
+ * block is kept in a table of CONFIG_HEAPSTATS_MAX_BLOCKS entries, so that
+ * HEAP_FREE() accounts any pointer, whoever allocated it; blocks that do not
+ * fit in the table are only counted as untracked. The live bytes, their peak
+ * and the allocations of every subsystem are sent in the health frame.
+ *
+ * A subsystem whose live bytes grew at every one of the last
+ * HEAPSTATS_LEAK_REPORTS reports is logged as a suspected leak.
+ *
+ * Without CONFIG_HEAPSTATS_ENABLE the macros are MDF_MALLOC() and MDF_FREE().
+ */
+#define HEAPSTATS_LEAK_REPORTS 5
+
+typedef enum {
+    HEAP_TAG_TASKS = 0,     /* buffers kept by the tasks */
+    HEAP_TAG_PIPELINE,
+    HEAP_TAG_DOWNLINK,
+    HEAP_TAG_FAILOVER,
+    HEAP_TAG_TOPOLOGY,
+    HEAP_TAG_SUPERVISOR,
+    HEAP_TAG_JSON,          /* cJSON trees and printed payloads */
+    HEAP_TAG_OTA,           /* firmware upgrade buffers and bitmaps */
+    HEAP_TAG_MAX,
+} heap_tag_t;
+
+_Static_assert(HEAP_TAG_MAX == HEALTH_HEAP_TAGS, "the health frame carries every heap tag");
+
+static const char *heap_tag_names[HEAP_TAG_MAX] = {
+    [HEAP_TAG_TASKS]      = "tasks",
+    [HEAP_TAG_PIPELINE]   = "pipeline",
+    [HEAP_TAG_DOWNLINK]   = "downlink",
+    [HEAP_TAG_FAILOVER]   = "failover",
+    [HEAP_TAG_TOPOLOGY]   = "topology",
+    [HEAP_TAG_SUPERVISOR] = "supervisor",
+    [HEAP_TAG_JSON]       = "json",
+    [HEAP_TAG_OTA]        = "ota",
+};
+
+#ifdef CONFIG_HEAPSTATS_ENABLE
+
+#define HEAP_MALLOC(tag, size)        heapstats_alloc(tag, MDF_MALLOC(size), size)
+#define HEAP_CALLOC(tag, count, size) heapstats_alloc(tag, MDF_CALLOC(count, size), (count) * (size))
+#define HEAP_FREE(ptr)                do { heapstats_release(ptr); MDF_FREE(ptr); } while (0)
+
+typedef struct {
+    void *ptr;
+    uint32_t size : 24;
+    uint32_t tag : 8;
+} heapstats_block_t;
+
+typedef struct {
+    uint32_t live;
+    uint32_t peak;
+    uint32_t allocs;
+    uint32_t last_allocs;
+    uint32_t last_live;
+    uint8_t growing;        /* reports in a row with more live bytes */
+} heapstats_tag_t;
+
+static heapstats_block_t heapstats_blocks[CONFIG_HEAPSTATS_MAX_BLOCKS] = {0};
+static heapstats_tag_t heapstats_tags[HEAP_TAG_MAX] = {0};
+static uint32_t heapstats_untracked = 0;
+static int64_t heapstats_reported_us = 0;
+static portMUX_TYPE heapstats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+static inline size_t heapstats_slot(const void *ptr) {
+    return ((uintptr_t)ptr >> 3) % CONFIG_HEAPSTATS_MAX_BLOCKS;
+}
+
+/**
+ * @brief Account a new block, open addressing with linear probing.
+ */
+static void *heapstats_alloc(heap_tag_t tag, void *ptr, size_t size) {
+    if (!ptr)
+        return NULL;
+
+    portENTER_CRITICAL(&heapstats_lock);
+    size_t slot = heapstats_slot(ptr);
+    int probes = 0;
+    while (heapstats_blocks[slot].ptr && heapstats_blocks[slot].ptr != ptr && ++probes < CONFIG_HEAPSTATS_MAX_BLOCKS)
+        slot = (slot + 1) % CONFIG_HEAPSTATS_MAX_BLOCKS;
+
+    if (probes < CONFIG_HEAPSTATS_MAX_BLOCKS) {
+        // a block freed behind our back may leave its entry, the new one replaces it
+        if (heapstats_blocks[slot].ptr)
+            heapstats_tags[heapstats_blocks[slot].tag].live -= heapstats_blocks[slot].size;
+        heapstats_blocks[slot].ptr  = ptr;
+        heapstats_blocks[slot].size = size;
+        heapstats_blocks[slot].tag  = tag;
+
+        heapstats_tag_t *stats = &heapstats_tags[tag];
+        stats->live += size;
+        stats->allocs++;
+        if (stats->live > stats->peak)
+            stats->peak = stats->live;
+    } else {
+        heapstats_untracked++;
+    }
+    portEXIT_CRITICAL(&heapstats_lock);
+
+    return ptr;
+}
+
+/**
+ * @brief Account a block about to be freed, then close the gap its entry leaves
+ *        in the probe sequence.
+ */
+static void heapstats_release(const void *ptr) {
+    if (!ptr)
+        return;
+
+    portENTER_CRITICAL(&heapstats_lock);
+    size_t slot = heapstats_slot(ptr);
+    for (int probes = 0; heapstats_blocks[slot].ptr != ptr; probes++) {
+        if (!heapstats_blocks[slot].ptr || probes == CONFIG_HEAPSTATS_MAX_BLOCKS) {
+            portEXIT_CRITICAL(&heapstats_lock);
+            return;
+        }
+        slot = (slot + 1) % CONFIG_HEAPSTATS_MAX_BLOCKS;
+    }
+
+    heapstats_tags[heapstats_blocks[slot].tag].live -= heapstats_blocks[slot].size;
+    heapstats_blocks[slot].ptr = NULL;
+
+    for (size_t next = (slot + 1) % CONFIG_HEAPSTATS_MAX_BLOCKS; heapstats_blocks[next].ptr;
+         next = (next + 1) % CONFIG_HEAPSTATS_MAX_BLOCKS) {
+        size_t home = heapstats_slot(heapstats_blocks[next].ptr);
+        // the entry moves into the gap unless its home lies cyclically in (slot, next]
+        bool stays = slot <= next ? (slot < home && home <= next) : (slot < home || home <= next);
+        if (stays)
+            continue;
+        heapstats_blocks[slot] = heapstats_blocks[next];
+        heapstats_blocks[next].ptr = NULL;
+        slot = next;
+    }
+    portEXIT_CRITICAL(&heapstats_lock);
+}
+
+/**
+ * @brief Fill the heap statistics of the health frame.
+ */
+static void heapstats_health(health_frame_t *health) {
+    portENTER_CRITICAL(&heapstats_lock);
+    for (int tag = 0; tag < HEAP_TAG_MAX; tag++) {
+        health->heap[tag].live   = heapstats_tags[tag].live;
+        health->heap[tag].peak   = heapstats_tags[tag].peak;
+        health->heap[tag].allocs = heapstats_tags[tag].allocs;
+    }
+    portEXIT_CRITICAL(&heapstats_lock);
+}
+
+void heapstats_log_stats(void) {
+    int64_t now_us    = esp_timer_get_time();
+    int64_t period_ms = (now_us - heapstats_reported_us) / 1000;
+    heapstats_reported_us = now_us;
+
+    for (int tag = 0; tag < HEAP_TAG_MAX; tag++) {
+        heapstats_tag_t *stats = &heapstats_tags[tag];
+
+        portENTER_CRITICAL(&heapstats_lock);
+        heapstats_tag_t snapshot = *stats;
+        stats->growing     = stats->live > stats->last_live ? stats->growing + 1 : 0;
+        stats->last_live   = stats->live;
+        stats->last_allocs = stats->allocs;
+        portEXIT_CRITICAL(&heapstats_lock);
+
+        if (!snapshot.allocs)
+            continue;
+        MDF_LOGI("Heap %s, live: %d bytes, peak: %d bytes, allocs: %d, rate: %d/min", heap_tag_names[tag],
+                 snapshot.live, snapshot.peak, snapshot.allocs,
+                 period_ms ? (int)((snapshot.allocs - snapshot.last_allocs) * 60000 / period_ms) : 0);
+        if (stats->growing >= HEAPSTATS_LEAK_REPORTS)
+            MDF_LOGW("Heap %s grew at each of the last %d reports, suspected leak", heap_tag_names[tag], stats->growing);
+    }
+
+    if (heapstats_untracked)
+        MDF_LOGW("Heap blocks not tracked, table full: %d", heapstats_untracked);
+}
+
+#else
+
+#define HEAP_MALLOC(tag, size)        MDF_MALLOC(size)
+#define HEAP_CALLOC(tag, count, size) MDF_CALLOC(count, size)
+#define HEAP_FREE(ptr)                MDF_FREE(ptr)
+
+static inline void heapstats_health(health_frame_t *health) {}
+static inline void heapstats_log_stats(void) {}
+
+#endif
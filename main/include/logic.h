@@ -8,88 +8,169 @@
 #include "esp_log.h"
 #include "mupgrade.h"
 
+static const char *TAG = "MESH";
 
 #include "protocols.h"
 #include "mqtt_manager.h"
+#include "influx_sink.h"
+#include "dispatch.h"
+#include "heapstats.h"
+#include "staticmem.h"
+#include "supervisor.h"
+#include "workqueue.h"
+#include "fastjoin.h"
+#include "congestion.h"
+#include "msntp.h"
+#include "meshtime.h"
+#include "powersave.h"
+#include "aggregate.h"
 #include "powermanager.h"
+#include "pipeline.h"
+#include "nodestats.h"
+#include "downlink.h"
+#include "health.h"
+#include "topology.h"
+#include "failover.h"
+#include "ota.h"
 
 
+/**
+ * @brief Account a frame of a node and hand it over to the encode stage, unless
+ *        the node exceeds its ingress rate.
+ */
+static void root_rx_frame(const uint8_t *src_addr, const mwifi_data_type_t *data_type,
+                          const char *data, size_t size) {
+    nodestats_verdict_t verdict;
+    const frame_header_t *header = frame_header_parse(data, size);
+    bool admitted = nodestats_update(src_addr, header, size, &verdict);
+
+    if (verdict.slot >= 0)
+        downlink_send(src_addr, CMD_SET_SLOT, verdict.slot);
+
+    if (!admitted) {
+#ifdef CONFIG_RATELIMIT_ENABLE
+        if (verdict.throttle) {
+            MDF_LOGW("Throttle [NODE] addr: " MACSTR, MAC2STR(src_addr));
+            downlink_send(src_addr, CMD_THROTTLE,
+                          1000 / CONFIG_RATELIMIT_RATE ? 1000 / CONFIG_RATELIMIT_RATE : DOWNLINK_MIN_PERIOD_MS);
+        }
+#endif
+        return;
+    }
+
+    if (header)
+        pipeline_submit(src_addr, data_type, data + sizeof(frame_header_t), size - sizeof(frame_header_t));
+    else
+        pipeline_submit(src_addr, data_type, data, size);
+}
+
+static void *root_reader_buffer = NULL;
+static void *node_reader_buffer = NULL;
+
+/**
+ * @brief Mesh ingest stage of the root pipeline, see pipeline.h.
+ */
 static void root_reader_task(void *arg) {
     mdf_err_t ret = MDF_OK;
-    char *data    = MDF_MALLOC(MWIFI_PAYLOAD_LEN);
+    char *data    = staticmem_buffer(&root_reader_buffer, "root_reader_task", MWIFI_PAYLOAD_LEN);
     size_t size   = MWIFI_PAYLOAD_LEN;
     mwifi_data_type_t data_type      = {0};
     uint8_t src_addr[MWIFI_ADDR_LEN] = {0};
 
-    char *mqtt_buffer = MDF_MALLOC(MWIFI_PAYLOAD_LEN);
-
     MDF_LOGI("Root reader task is ran");
+    if (!data) {
+        MDF_LOGE("Allocate root reader buffer");
+        supervisor_exit(SUPERVISOR_ROOT_READER, MDF_ERR_NO_MEM);
+    }
 
-    while (mwifi_is_connected()) {
+    while (mwifi_is_connected() && esp_mesh_is_root()) {
         size = MWIFI_PAYLOAD_LEN;
         memset(data, 0, MWIFI_PAYLOAD_LEN);
         ret = mwifi_root_read(src_addr, &data_type, data, &size, portMAX_DELAY);
         MDF_ERROR_CONTINUE(ret != MDF_OK, "<%s> mwifi_root_recv", mdf_err_to_name(ret));
 
+        int64_t start_us = esp_timer_get_time();
+
         if (data_type.upgrade) { // this mesh package contains upgrade data.
             ret = mupgrade_root_handle(src_addr, data, size);
             MDF_ERROR_CONTINUE(ret != MDF_OK, "<%s>, mupgrade_root_handle", mdf_err_to_name(ret));
-        } else if (data_type.custom == MQTT_SEND) {
-            MDF_LOGD("Receive MQTT_SEND packet from [NODE] addr: " MACSTR ", size: %d, data: %s", MAC2STR(src_addr), size, data);
-            snprintf(mqtt_buffer, size, "%.*s", strlen(data), data);
-            mqtt_publish(mqtt_buffer);
+        } else if (data_type.custom == ROOT_HANDOFF) { // the former root state, not rate limited
+            pipeline_submit(src_addr, &data_type, data, size);
+        } else if (data_type.custom == TIME_REQUEST) { // stamped here, as close to the radio as it gets
+            meshtime_receive(src_addr, TIME_REQUEST, data, size);
+        } else if (data_type.custom == OTA_REPORT) { // not queued behind the telemetry
+            ota_receive_report(src_addr, data, size);
+        } else if (data_type.custom == MQTT_AGGREGATE) { // frames batched by an intermediate node
+            aggregate_foreach(data, size, root_rx_frame);
         } else {
-            MDF_LOGW("Receive UNKNOWN packet from [NODE] addr: " MACSTR ", size: %d, data: %s", MAC2STR(src_addr), size, data);
+            root_rx_frame(src_addr, &data_type, data, size);
         }
 
+        pipeline_stage_account(PIPELINE_STAGE_RX, start_us);
     }
 
     MDF_LOGW("Root reader task is ended");
 
-    MDF_FREE(data);
-    vTaskDelete(NULL);
+    staticmem_release(&root_reader_buffer);
+    supervisor_exit(SUPERVISOR_ROOT_READER, MDF_OK);
+}
+
+/**
+ * @brief Node handler of the plain text commands sent by the root.
+ */
+static mdf_err_t node_text_command_handler(packet_t *packet) {
+    MDF_LOGI("Receive [ROOT] addr: " MACSTR ", size: %d, data: %s", MAC2STR(packet->src_addr), packet->size, packet->data);
+
+    /**
+     * @brief Finally, the node receives a restart notification. Restart it yourself..
+     */
+    if (!strcmp(packet->data, "restart")) {
+        MDF_LOGI("Restart the version of the switching device");
+        MDF_LOGW("The device will restart after 3 seconds");
+        vTaskDelay(pdMS_TO_TICKS(3000));
+        esp_restart();
+    }
+
+    return MDF_OK;
 }
 
 /**
  * @brief Handling data between wifi mesh devices.
  */
 static void node_reader_task(void *arg) {
-    mdf_err_t ret = MDF_OK;
-    char *data    = MDF_MALLOC(MWIFI_PAYLOAD_LEN);
-    size_t size   = MWIFI_PAYLOAD_LEN;
-    mwifi_data_type_t data_type      = {0x0};
-    uint8_t src_addr[MWIFI_ADDR_LEN] = {0};
+    mdf_err_t ret   = MDF_OK;
+    packet_t packet = {0};
 
     MDF_LOGI("Node read task is running");
 
+    packet.data = staticmem_buffer(&node_reader_buffer, "node_reader_task", MWIFI_PAYLOAD_LEN);
     while (mwifi_is_connected()) {
-        size = MWIFI_PAYLOAD_LEN;
-        memset(data, 0, MWIFI_PAYLOAD_LEN);
-        ret = mwifi_read(src_addr, &data_type, data, &size, portMAX_DELAY);
+        if (!packet.data) // allocated again whenever a handler keeps the buffer
+            packet.data = HOTPATH_MALLOC(HEAP_TAG_TASKS, MWIFI_PAYLOAD_LEN);
+        MDF_ERROR_BREAK(!packet.data, "Allocate node reader buffer");
+
+        packet.size = MWIFI_PAYLOAD_LEN;
+        memset(packet.data, 0, MWIFI_PAYLOAD_LEN);
+        ret = mwifi_read(packet.src_addr, &packet.data_type, packet.data, &packet.size, portMAX_DELAY);
         MDF_ERROR_CONTINUE(ret != MDF_OK, "<%s> mwifi_root_recv", mdf_err_to_name(ret));
 
-        if (data_type.upgrade) { // This mesh package contains upgrade data.
-            ret = mupgrade_handle(src_addr, data, size);
+        if (packet.data_type.upgrade) { // This mesh package contains upgrade data.
+            ret = mupgrade_handle(packet.src_addr, packet.data, packet.size);
             MDF_ERROR_CONTINUE(ret != MDF_OK, "<%s> mupgrade_handle", mdf_err_to_name(ret));
         } else {
-            MDF_LOGI("Receive [ROOT] addr: " MACSTR ", size: %d, data: %s", MAC2STR(src_addr), size, data);
-
-            /**
-             * @brief Finally, the node receives a restart notification. Restart it yourself..
-             */
-            if (!strcmp(data, "restart")) {
-                MDF_LOGI("Restart the version of the switching device");
-                MDF_LOGW("The device will restart after 3 seconds");
-                vTaskDelay(pdMS_TO_TICKS(3000));
-                esp_restart();
-            }
+            packet_dispatch(PACKET_TABLE_NODE, &packet);
         }
     }
 
     MDF_LOGW("Node read task is exit");
 
-    MDF_FREE(data);
-    vTaskDelete(NULL);
+    // the loop is only left with the mesh connected on failure
+    ret = mwifi_is_connected() ? MDF_ERR_NO_MEM : MDF_OK;
+    if (packet.data == node_reader_buffer)
+        staticmem_release(&node_reader_buffer);
+    else
+        HEAP_FREE(packet.data);
+    supervisor_exit(SUPERVISOR_NODE_READER, ret);
 }
 
 bool node_is_root(void) {
@@ -98,18 +179,28 @@ bool node_is_root(void) {
 
 void run_node_reader_task(void) {
     MDF_LOGD("Running node read task ...");
-    char* pcName = "node_reader_task";
-    xTaskCreate(node_reader_task, pcName, 4*1024, NULL, CONFIG_MDF_TASK_DEFAULT_PRIOTY, NULL);
+    packet_register(PACKET_TABLE_NODE, TEXT_COMMAND, "TEXT_COMMAND", node_text_command_handler);
+    packet_register(PACKET_TABLE_NODE, DOWNLINK_COMMAND, "DOWNLINK_COMMAND", node_downlink_handler);
+    downlink_restore_groups();
+    aggregate_start();
+    meshtime_start();
+    health_start();
+    ota_start();
+    supervisor_start(SUPERVISOR_NODE_READER, node_reader_task);
 }
 
 void run_root_reader_task(void) {
     MDF_LOGD("Running root task ...");
-    char* pcName = "root_reader_task";
-    xTaskCreate(root_reader_task, pcName, 4*1024, NULL, CONFIG_MDF_TASK_DEFAULT_PRIOTY, NULL);
+    pipeline_start();
+    nodestats_start();
+    topology_start();
+    pipeline_start_stage(PIPELINE_STAGE_RX, root_reader_task);
 }
 
 void run_node_executer_tasks(void) {
-    // Running INA219 task
+    // Running INA219 task, once: a node becoming root again keeps the one it has
+    if (supervisor_running(SUPERVISOR_INA219))
+        return;
     powermanager_setup();
     powermanager_start();
 }
\ No newline at end of file
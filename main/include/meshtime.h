@@ -0,0 +1,333 @@
+/*
+ * ESP32 Mesh Network
+ * Copyright 2021, FCRLab at University of Messina (Messina, Italy)
+ *
+ * @maintainer: Lorenzo Carnevale <lcarnevale@unime.it>
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+#include "sys/time.h"
+#include "esp_timer.h"
+#include "mwifi.h"
+
+/**
+ * @brief Mesh time, distributed by the root.
+ *
+ * The root broadcasts a TIME_BEACON every CONFIG_MESHTIME_PERIOD_MS. On a beacon,
+ * or when beacons are missed, a node runs a burst of two-way exchanges with the
+ * root, as in PTP:
+ *
+ *     t1  node clock when the TIME_REQUEST leaves
+ *     t2  root clock when the request is read
+ *     t3  root clock when the TIME_RESPONSE leaves
+ *     t4  node clock when the response is read
+ *
+ *     offset = ((t2 - t1) + (t3 - t4)) / 2
+ *     delay  = (t4 - t1) - (t3 - t2)
+ *
+ * which compensates for the hop delays as long as they are symmetric. The
+ * exchange with the shortest delay of the burst is kept, as it is the least
+ * affected by queueing. The drift of the node clock is estimated from the
+ * offsets of consecutive bursts and used to extrapolate between them. It starts
+ * over when the root clock steps: when the root gets the time from SNTP, when
+ * another node becomes root, or when the offset moved more than the drift bound
+ * allows.
+ */
+#define MESHTIME_VERSION 2              /* flags added in 2, older nodes drop the packets */
+#define MESHTIME_BURST 4                /* exchanges per synchronization */
+#define MESHTIME_TIMEOUT_MS 500         /* wait for a response */
+#define MESHTIME_JITTER_MS 1000         /* spread of the bursts after a beacon */
+#define MESHTIME_MAX_DRIFT_PPB 500000   /* bound of the drift estimate */
+#define MESHTIME_STEP_US 10000          /* offset change beyond the drift bound taken as a step */
+#define MESHTIME_DRIFT_WINDOW_US (4LL * 3600 * 1000000)    /* older references do not give the drift */
+
+#define MESHTIME_FLAG_SYNCED 0x01       /* the root clock is synchronized with SNTP */
+
+typedef struct {
+    uint8_t version;
+    uint8_t seq;
+    uint8_t flags;
+    int64_t t1;
+    int64_t t2;
+    int64_t t3;
+} __attribute__((packed)) meshtime_packet_t;
+
+typedef struct {
+    uint8_t src_addr[MWIFI_ADDR_LEN];
+    uint8_t type;
+    meshtime_packet_t packet;
+    int64_t received_us;    /* t2 on the root, t4 on a node */
+} meshtime_event_t;
+
+typedef struct {
+    bool synced;
+    bool root_synced;       /* the root itself had the time from SNTP */
+    uint8_t root_addr[MWIFI_ADDR_LEN];  /* of the root of the last synchronization */
+    int64_t ref_local_us;   /* node clock at the last synchronization */
+    int64_t ref_offset_us;  /* root clock minus node clock, at ref_local_us */
+    int32_t drift_ppb;      /* of the root clock against the node clock */
+    int64_t delay_us;       /* round trip of the last synchronization */
+    uint32_t syncs;         /* since the last step of the root clock */
+    uint32_t steps;
+    uint32_t timeouts;
+    uint32_t dropped;       /* packets lost because the queue was full */
+} meshtime_t;
+
+static meshtime_t meshtime = {0};
+static portMUX_TYPE meshtime_lock = portMUX_INITIALIZER_UNLOCKED;
+static QueueHandle_t meshtime_queue = NULL;
+
+
+static int64_t meshtime_wall_us(void) {
+    struct timeval tv = {0};
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/**
+ * @brief Current mesh time, in microseconds since the epoch. The system clock
+ *        is returned as is on the root and on nodes not synchronized yet.
+ */
+int64_t meshtime_now_us(void) {
+    meshtime_t state;
+
+    if (esp_mesh_is_root())
+        return meshtime_wall_us();
+
+    portENTER_CRITICAL(&meshtime_lock);
+    state = meshtime;
+    portEXIT_CRITICAL(&meshtime_lock);
+
+    if (!state.synced)
+        return meshtime_wall_us();
+
+    int64_t local_us = esp_timer_get_time();
+    return local_us + state.ref_offset_us + (local_us - state.ref_local_us) * state.drift_ppb / 1000000000;
+}
+
+/**
+ * @brief Whether the mesh time is the wall-clock time, which is the case once
+ *        the root got it from SNTP and this node synchronized with the root.
+ */
+bool meshtime_synced(void) {
+    if (esp_mesh_is_root())
+        return msntp_synced();
+    return meshtime.synced && meshtime.root_synced;
+}
+
+/**
+ * @brief Adopt the offset of a burst, update the drift and step the system clock.
+ */
+static void meshtime_adopt(const uint8_t *root_addr, int64_t local_us, int64_t offset_us, int64_t delay_us,
+                           bool root_synced) {
+    portENTER_CRITICAL(&meshtime_lock);
+    int64_t elapsed_us = local_us - meshtime.ref_local_us;
+    int64_t step_us    = offset_us - meshtime.ref_offset_us;
+    // bounded, so that the drift below does not overflow
+    bool stepped = !meshtime.synced || root_synced != meshtime.root_synced ||
+                   memcmp(root_addr, meshtime.root_addr, MWIFI_ADDR_LEN) ||
+                   elapsed_us <= 0 || elapsed_us > MESHTIME_DRIFT_WINDOW_US ||
+                   llabs(step_us) > elapsed_us * MESHTIME_MAX_DRIFT_PPB / 1000000000 + MESHTIME_STEP_US;
+
+    if (stepped) {
+        meshtime.steps += meshtime.synced;
+        meshtime.syncs     = 0;
+        meshtime.drift_ppb = 0;
+    } else {
+        int64_t drift = step_us * 1000000000 / elapsed_us;
+        drift = meshtime.syncs > 1 ? meshtime.drift_ppb + (drift - meshtime.drift_ppb) / 4 : drift;
+        meshtime.drift_ppb = drift > MESHTIME_MAX_DRIFT_PPB ? MESHTIME_MAX_DRIFT_PPB :
+                             drift < -MESHTIME_MAX_DRIFT_PPB ? -MESHTIME_MAX_DRIFT_PPB : drift;
+    }
+    memcpy(meshtime.root_addr, root_addr, MWIFI_ADDR_LEN);
+    meshtime.synced        = true;
+    meshtime.root_synced   = root_synced;
+    meshtime.ref_local_us  = local_us;
+    meshtime.ref_offset_us = offset_us;
+    meshtime.delay_us      = delay_us;
+    meshtime.syncs++;
+    portEXIT_CRITICAL(&meshtime_lock);
+
+    int64_t now_us = meshtime_now_us();
+    struct timeval tv = {
+        .tv_sec  = now_us / 1000000,
+        .tv_usec = now_us % 1000000,
+    };
+    settimeofday(&tv, NULL);
+
+    MDF_LOGD("Mesh time synchronized, offset: %lld us, delay: %lld us, drift: %d ppb",
+             offset_us, delay_us, meshtime.drift_ppb);
+}
+
+/**
+ * @brief Root side: broadcast a beacon, then answer the requests until the next one.
+ */
+static void meshtime_root_round(void) {
+    meshtime_event_t event;
+    uint8_t broadcast_addr[MWIFI_ADDR_LEN] = MWIFI_ADDR_BROADCAST;
+    mwifi_data_type_t data_type = {
+        .communicate = MWIFI_COMMUNICATE_BROADCAST,
+        .custom = TIME_BEACON,
+    };
+    meshtime_packet_t beacon = {
+        .version = MESHTIME_VERSION,
+        .flags   = msntp_synced() ? MESHTIME_FLAG_SYNCED : 0,
+    };
+    int64_t deadline_us = esp_timer_get_time() + (int64_t)CONFIG_MESHTIME_PERIOD_MS * 1000;
+
+    beacon.t3 = meshtime_wall_us();
+    mwifi_root_write(broadcast_addr, 1, &data_type, &beacon, sizeof(beacon), true);
+
+    data_type.communicate = MWIFI_COMMUNICATE_UNICAST;
+    data_type.custom      = TIME_RESPONSE;
+
+    for (int64_t now_us = esp_timer_get_time(); now_us < deadline_us; now_us = esp_timer_get_time()) {
+        if (xQueueReceive(meshtime_queue, &event, pdMS_TO_TICKS((deadline_us - now_us) / 1000) + 1) != pdTRUE)
+            continue;
+        if (event.type == TIME_BEACON)  // resynchronization asked, start a new round
+            break;
+        if (event.type != TIME_REQUEST)
+            continue;
+
+        event.packet.flags = beacon.flags;
+        event.packet.t2 = event.received_us;
+        event.packet.t3 = meshtime_wall_us();
+        mwifi_root_write(event.src_addr, 1, &data_type, &event.packet, sizeof(meshtime_packet_t), true);
+    }
+}
+
+/**
+ * @brief Node side: run a burst of exchanges and adopt the best one.
+ */
+static void meshtime_node_burst(void) {
+    static uint8_t seq = 0;
+    meshtime_event_t event;
+    meshtime_packet_t request = {
+        .version = MESHTIME_VERSION,
+    };
+    mwifi_data_type_t data_type = {
+        .custom = TIME_REQUEST,
+    };
+    int64_t best_delay_us = INT64_MAX, best_offset_us = 0, best_local_us = 0;
+    uint8_t root_addr[MWIFI_ADDR_LEN] = {0};
+    bool root_synced = false;
+
+    for (int i = 0; i < MESHTIME_BURST; i++) {
+        request.seq = ++seq;
+        request.t1  = esp_timer_get_time();
+        if (mwifi_write(NULL, &data_type, &request, sizeof(request), true) != MDF_OK)
+            continue;
+
+        // stale responses of previous exchanges are skipped
+        event.type = 0;
+        do {
+            if (xQueueReceive(meshtime_queue, &event, pdMS_TO_TICKS(MESHTIME_TIMEOUT_MS)) != pdTRUE) {
+                meshtime.timeouts++;
+                break;
+            }
+        } while (event.type != TIME_RESPONSE || event.packet.seq != request.seq);
+
+        if (event.type != TIME_RESPONSE || event.packet.seq != request.seq)
+            continue;
+
+        int64_t t1 = event.packet.t1, t2 = event.packet.t2, t3 = event.packet.t3, t4 = event.received_us;
+        int64_t delay_us = (t4 - t1) - (t3 - t2);
+        if (delay_us >= 0 && delay_us < best_delay_us) {
+            best_delay_us  = delay_us;
+            best_offset_us = ((t2 - t1) + (t3 - t4)) / 2;
+            best_local_us  = t4;
+            root_synced    = event.packet.flags & MESHTIME_FLAG_SYNCED;
+            memcpy(root_addr, event.src_addr, MWIFI_ADDR_LEN);
+        }
+    }
+
+    if (best_delay_us != INT64_MAX)
+        meshtime_adopt(root_addr, best_local_us, best_offset_us, best_delay_us, root_synced);
+}
+
+static void meshtime_task(void *arg) {
+    meshtime_event_t event;
+
+    MDF_LOGI("Mesh time task is running");
+
+    while (mwifi_is_connected()) {
+        if (esp_mesh_is_root()) {
+            meshtime_root_round();
+            continue;
+        }
+
+        // wait for a beacon, falling back to the own schedule when beacons are missed
+        bool beacon = false;
+        while (!beacon && xQueueReceive(meshtime_queue, &event,
+                                        pdMS_TO_TICKS(CONFIG_MESHTIME_PERIOD_MS * 2)) == pdTRUE)
+            beacon = event.type == TIME_BEACON;
+
+        vTaskDelay(pdMS_TO_TICKS(esp_random() % MESHTIME_JITTER_MS) + 1);
+        meshtime_node_burst();
+    }
+
+    MDF_LOGW("Mesh time task is exit");
+    supervisor_exit(SUPERVISOR_MESHTIME, MDF_OK);
+}
+
+/**
+ * @brief Queue a time packet for the mesh time task, stamped on arrival.
+ */
+static mdf_err_t meshtime_receive(const uint8_t *src_addr, uint8_t type, const char *data, size_t size) {
+    meshtime_event_t event = {
+        .type        = type,
+        .received_us = esp_mesh_is_root() ? meshtime_wall_us() : esp_timer_get_time(),
+    };
+
+    MDF_ERROR_CHECK(size < sizeof(meshtime_packet_t), MDF_ERR_INVALID_SIZE, "Truncated time packet, size: %d", size);
+    MDF_ERROR_CHECK(!meshtime_queue, MDF_ERR_INVALID_STATE, "Mesh time is not running");
+    memcpy(event.src_addr, src_addr, MWIFI_ADDR_LEN);
+    memcpy(&event.packet, data, sizeof(meshtime_packet_t));
+    MDF_ERROR_CHECK(event.packet.version != MESHTIME_VERSION, MDF_ERR_NOT_SUPPORTED,
+                    "Unsupported time packet version: %d", event.packet.version);
+
+    if (xQueueSend(meshtime_queue, &event, 0) != pdTRUE) {
+        meshtime.dropped++;
+        return MDF_FAIL;
+    }
+    return MDF_OK;
+}
+
+/**
+ * @brief Node handler of TIME_BEACON and TIME_RESPONSE packets.
+ */
+static mdf_err_t node_meshtime_handler(packet_t *packet) {
+    return meshtime_receive(packet->src_addr, packet->data_type.custom, packet->data, packet->size);
+}
+
+/**
+ * @brief Send a beacon right away, e.g. once the root got the time from SNTP, so
+ *        that the nodes do not wait for the next period to get it.
+ */
+void meshtime_resync(void) {
+    meshtime_event_t event = {
+        .type = TIME_BEACON,
+    };
+
+    if (meshtime_queue && esp_mesh_is_root())
+        xQueueSend(meshtime_queue, &event, 0);
+}
+
+void meshtime_log_stats(void) {
+    MDF_LOGI("Mesh time synced: %d, syncs: %d, steps: %d, timeouts: %d, dropped: %d, delay: %lld us, drift: %d ppb",
+             meshtime_synced(), meshtime.syncs, meshtime.steps, meshtime.timeouts, meshtime.dropped,
+             meshtime.delay_us, meshtime.drift_ppb);
+}
+
+void meshtime_start(void) {
+    if (!meshtime_queue)
+        meshtime_queue = staticmem_queue("meshtime_queue", CONFIG_MESHTIME_QUEUE_LEN, sizeof(meshtime_event_t));
+
+    packet_register(PACKET_TABLE_NODE, TIME_BEACON, "TIME_BEACON", node_meshtime_handler);
+    packet_register(PACKET_TABLE_NODE, TIME_RESPONSE, "TIME_RESPONSE", node_meshtime_handler);
+
+    supervisor_start(SUPERVISOR_MESHTIME, meshtime_task);
+}
@@ -6,22 +6,45 @@
  */
 
 #include "esp_sntp.h"
+#include "esp_timer.h"
 
 #define SNTP_ENDPOINT "pool.ntp.org"
 
 // static const char *TAG = "SNTP_MANAGER";
 
-void setup_sntp(void) {
+typedef void (*msntp_sync_cb_t)(void);
+
+static volatile bool msntp_is_synced = false;
+static int64_t msntp_started_us = 0;
+static msntp_sync_cb_t msntp_sync_cb = NULL;
+
+
+static void msntp_notification(struct timeval *tv) {
+    bool first = !msntp_is_synced;
+
+    msntp_is_synced = true;
+    if (first)
+        MDF_LOGI("SNTP synchronized in %lld ms", (esp_timer_get_time() - msntp_started_us) / 1000);
+    if (msntp_sync_cb)
+        msntp_sync_cb();
+}
+
+/**
+ * @brief Start the synchronization in the background. It does not block: cb is
+ *        called from the SNTP task at every synchronization.
+ */
+void setup_sntp(msntp_sync_cb_t cb) {
+    msntp_sync_cb = cb;
+    if (sntp_enabled())
+        return;
+
+    msntp_started_us = esp_timer_get_time();
+    sntp_set_time_sync_notification_cb(msntp_notification);
     sntp_setoperatingmode(SNTP_OPMODE_POLL);
     sntp_setservername(0, SNTP_ENDPOINT);
     sntp_init();
 }
 
-void sync_sntp(void) {
-    int retry = 0;
-    const int retry_count = 10;
-    while (sntp_get_sync_status() == SNTP_SYNC_STATUS_RESET && ++retry < retry_count) {
-        // ESP_LOGD(TAG, "Waiting for system time to be set... (%d/%d)", retry, retry_count);
-        vTaskDelay(2000 / portTICK_PERIOD_MS);
-    }
-}
\ No newline at end of file
+bool msntp_synced(void) {
+    return msntp_is_synced;
+}
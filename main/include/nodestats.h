@@ -0,0 +1,347 @@
+/*
+ * ESP32 Mesh Network
+ * Copyright 2021, FCRLab at University of Messina (Messina, Italy)
+ *
+ * @maintainer: Lorenzo Carnevale <lcarnevale@unime.it>
+ */
+
+#include "esp_timer.h"
+#include "mwifi.h"
+
+#define NODESTATS_WINDOW 32  /* sequence numbers tracked behind the last one */
+#define NODESTATS_TOKEN 1000 /* cost of a frame, buckets count thousandths of a frame */
+#define REPORT_QUEUE_LEN 4
+
+
+/**
+ * @brief Delivery state of a node, as seen by the root.
+ */
+typedef struct {
+    uint8_t addr[MWIFI_ADDR_LEN];
+    bool used;
+    bool framed;            /* false for nodes running a firmware without sequence numbers */
+    uint16_t boot_id;
+    uint32_t last_seq;
+    uint32_t window;        /* bit n set when last_seq - (n + 1) was received */
+    uint32_t received;
+    uint32_t lost;          /* sequence gaps, decreased when a late frame fills them */
+    uint32_t duplicates;
+    uint32_t reordered;
+    uint32_t restarts;
+    uint32_t bytes;
+    int64_t last_seen_us;
+    uint32_t last_received; /* received at the previous report, for the rate */
+    uint32_t tokens;        /* ingress token bucket, in thousandths of a frame */
+    int64_t refill_us;
+    uint32_t throttled;     /* frames dropped by the token bucket */
+    int64_t hint_us;        /* last throttle hint sent to the node */
+    bool slotted;           /* a transmit slot was handed out since the node booted */
+    int64_t health_us;      /* arrival of the last health frame, 0 for none */
+    health_frame_t health;
+    bool topo_present;      /* in the topology last published, see topology.h */
+    uint8_t topo_parent[MWIFI_ADDR_LEN];
+    uint8_t topo_layer;
+    int8_t topo_rssi;
+} nodestats_entry_t;
+
+/**
+ * @brief A periodic report of the root. Its timer only queues it: building the
+ *        JSON is too heavy for the timer task, so the report task runs it.
+ */
+typedef void (*report_fn_t)(void);
+
+/**
+ * @brief Actions the RX stage takes on behalf of the table for a frame.
+ */
+typedef struct {
+    bool throttle;          /* the node is due a throttle hint */
+    int32_t slot;           /* transmit slot to hand out to the node, -1 for none */
+} nodestats_verdict_t;
+
+static nodestats_entry_t nodestats[CONFIG_NODESTATS_MAX_NODES] = {0};
+static portMUX_TYPE nodestats_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t nodestats_slots = 0;    /* transmit slots handed out */
+static esp_timer_handle_t nodestats_timer = NULL;
+static QueueHandle_t report_queue = NULL;
+
+
+/**
+ * @brief Find the entry of a node, claiming a free one for unknown nodes.
+ *
+ * Open addressing with linear probing keyed by the MAC address, so that the
+ * lookup is O(1) as long as the table is not close to full.
+ */
+static nodestats_entry_t *nodestats_lookup(const uint8_t *addr) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < MWIFI_ADDR_LEN; i++)
+        hash = (hash ^ addr[i]) * 16777619u;
+
+    for (int probe = 0; probe < CONFIG_NODESTATS_MAX_NODES; probe++) {
+        nodestats_entry_t *entry = &nodestats[(hash + probe) % CONFIG_NODESTATS_MAX_NODES];
+        if (!entry->used) {
+            memcpy(entry->addr, addr, MWIFI_ADDR_LEN);
+            entry->used = true;
+            return entry;
+        }
+        if (!memcmp(entry->addr, addr, MWIFI_ADDR_LEN))
+            return entry;
+    }
+
+    return NULL;
+}
+
+static void nodestats_account_seq(nodestats_entry_t *entry, const frame_header_t *header) {
+    if (!entry->framed || entry->boot_id != header->boot_id) {
+        if (entry->framed)
+            entry->restarts++;
+        entry->slotted  = false;
+        entry->framed   = true;
+        entry->boot_id  = header->boot_id;
+        entry->last_seq = header->seq;
+        entry->window   = 0;
+        return;
+    }
+
+    int32_t diff = (int32_t)(header->seq - entry->last_seq);
+
+    if (diff > 0) {
+        entry->lost  += diff - 1;
+        entry->window = (diff < NODESTATS_WINDOW ? entry->window << diff : 0) |
+                        (diff <= NODESTATS_WINDOW ? 1u << (diff - 1) : 0);
+        entry->last_seq = header->seq;
+    } else if (diff == 0) {
+        entry->duplicates++;
+    } else if (-diff <= NODESTATS_WINDOW) {
+        uint32_t bit = 1u << (-diff - 1);
+        if (entry->window & bit) {
+            entry->duplicates++;
+        } else {
+            entry->window |= bit;
+            entry->reordered++;
+            if (entry->lost)
+                entry->lost--;
+        }
+    } else {
+        // too late to tell a duplicate apart, count it as reordered
+        entry->reordered++;
+    }
+}
+
+/**
+ * @brief Take a frame worth of tokens from the ingress bucket of a node, which
+ *        refills at CONFIG_RATELIMIT_RATE frames per second up to
+ *        CONFIG_RATELIMIT_BURST frames.
+ */
+static bool nodestats_take_token(nodestats_entry_t *entry, int64_t now_us) {
+#ifdef CONFIG_RATELIMIT_ENABLE
+    const uint32_t capacity = CONFIG_RATELIMIT_BURST * NODESTATS_TOKEN;
+
+    if (!entry->refill_us) {
+        entry->tokens = capacity;
+    } else {
+        uint64_t refill = (uint64_t)(now_us - entry->refill_us) * CONFIG_RATELIMIT_RATE * NODESTATS_TOKEN / 1000000;
+        entry->tokens = refill >= capacity - entry->tokens ? capacity : entry->tokens + refill;
+    }
+    entry->refill_us = now_us;
+
+    if (entry->tokens < NODESTATS_TOKEN) {
+        entry->throttled++;
+        return false;
+    }
+    entry->tokens -= NODESTATS_TOKEN;
+#endif
+    return true;
+}
+
+/**
+ * @brief Account a frame received by the root and apply the ingress rate limit.
+ *        It is O(1) and meant to be called from the RX stage for every packet.
+ *
+ * @param header  The frame header, NULL for legacy payloads.
+ * @param verdict Actions due towards the node.
+ *
+ * @return Whether the frame is admitted.
+ */
+bool nodestats_update(const uint8_t *src_addr, const frame_header_t *header, size_t size,
+                      nodestats_verdict_t *verdict) {
+    bool admitted = true;
+    int64_t now_us = esp_timer_get_time();
+
+    verdict->throttle = false;
+    verdict->slot     = -1;
+    portENTER_CRITICAL(&nodestats_lock);
+
+    nodestats_entry_t *entry = nodestats_lookup(src_addr);
+    if (entry) {
+        entry->received++;
+        entry->bytes += size;
+        entry->last_seen_us = now_us;
+        if (header)
+            nodestats_account_seq(entry, header);
+
+        admitted = nodestats_take_token(entry, now_us);
+#ifdef CONFIG_RATELIMIT_ENABLE
+        if (!admitted && (!entry->hint_us || now_us - entry->hint_us >= (int64_t)CONFIG_RATELIMIT_HINT_INTERVAL_MS * 1000)) {
+            entry->hint_us = now_us;
+            verdict->throttle = true;
+        }
+#endif
+#ifdef CONFIG_SLOTS_ROOT_ASSIGNED
+        // golden ratio steps keep the phases handed out so far evenly spread
+        if (header && !entry->slotted) {
+            entry->slotted = true;
+            verdict->slot  = (nodestats_slots++ * 618) % SAMPLING_SLOTS;
+        }
+#endif
+    }
+
+    portEXIT_CRITICAL(&nodestats_lock);
+    return admitted;
+}
+
+/**
+ * @brief Keep the last health frame of a node.
+ */
+void nodestats_health(const uint8_t *src_addr, const health_frame_t *health) {
+    portENTER_CRITICAL(&nodestats_lock);
+
+    nodestats_entry_t *entry = nodestats_lookup(src_addr);
+    if (entry) {
+        entry->health    = *health;
+        entry->health_us = esp_timer_get_time();
+    }
+
+    portEXIT_CRITICAL(&nodestats_lock);
+}
+
+static void nodestats_add_health(cJSON *json_node, const nodestats_entry_t *entry, int64_t now_us) {
+    const health_frame_t *health = &entry->health;
+    char mac[18] = {0};
+
+    cJSON *json_health = cJSON_AddObjectToObject(json_node, "health");
+    cJSON_AddBoolToObject(json_health, "root", health->flags & HEALTH_FLAG_ROOT);
+    cJSON_AddBoolToObject(json_health, "synced", health->flags & HEALTH_FLAG_SYNCED);
+    cJSON_AddBoolToObject(json_health, "powersave", health->flags & HEALTH_FLAG_POWERSAVE);
+    cJSON_AddNumberToObject(json_health, "layer", health->layer);
+    cJSON_AddNumberToObject(json_health, "rssi", health->rssi);
+    snprintf(mac, sizeof(mac), MACSTR, MAC2STR(health->parent));
+    cJSON_AddStringToObject(json_health, "parent", mac);
+    cJSON_AddNumberToObject(json_health, "subtree", health->subtree);
+    cJSON_AddNumberToObject(json_health, "uptime", health->uptime_s);
+    cJSON_AddNumberToObject(json_health, "free_heap", health->free_heap);
+    cJSON_AddNumberToObject(json_health, "min_free_heap", health->min_free_heap);
+    cJSON_AddNumberToObject(json_health, "stack_hwm", health->stack_hwm);
+    cJSON_AddNumberToObject(json_health, "work_queued", health->work_queued);
+    cJSON_AddNumberToObject(json_health, "aggregate_queued", health->aggregate_queued);
+    cJSON_AddNumberToObject(json_health, "writes", health->writes);
+    cJSON_AddNumberToObject(json_health, "write_failures", health->write_failures);
+    cJSON_AddNumberToObject(json_health, "backoff", (double)health->backoff_scale / 1000);
+    cJSON_AddNumberToObject(json_health, "rx_errors", health->rx_errors);
+    if (health->energy_uj)
+        cJSON_AddNumberToObject(json_health, "energy_per_sample_uj", health->energy_uj);
+    for (int tag = 0; tag < HEALTH_HEAP_TAGS; tag++) {
+        if (!health->heap[tag].allocs)
+            continue;
+        cJSON *json_heap = cJSON_GetObjectItem(json_health, "heap");
+        if (!json_heap)
+            json_heap = cJSON_AddObjectToObject(json_health, "heap");
+        cJSON *json_tag = cJSON_AddObjectToObject(json_heap, heap_tag_names[tag]);
+        cJSON_AddNumberToObject(json_tag, "live", health->heap[tag].live);
+        cJSON_AddNumberToObject(json_tag, "peak", health->heap[tag].peak);
+        cJSON_AddNumberToObject(json_tag, "allocs", health->heap[tag].allocs);
+    }
+    cJSON_AddNumberToObject(json_health, "age_ms", (double)((now_us - entry->health_us) / 1000));
+}
+
+/**
+ * @brief Queue a report, from its timer. It is skipped when the report task
+ *        lags behind, the next period publishes the same state anyway.
+ */
+static void report_submit(report_fn_t fn) {
+    if (report_queue && xQueueSend(report_queue, &fn, 0) != pdTRUE)
+        MDF_LOGW("Report queue full, skip a report");
+}
+
+static void report_task(void *arg) {
+    report_fn_t fn = NULL;
+
+    MDF_LOGI("Report task is running");
+
+    for (;;) {
+        if (xQueueReceive(report_queue, &fn, portMAX_DELAY) == pdTRUE)
+            fn();
+    }
+}
+
+/**
+ * @brief Serialize the table and hand it over to the MQTT TX stage.
+ */
+static void nodestats_report(void) {
+    if (!esp_mesh_is_root())
+        return;
+
+    int64_t now_us = esp_timer_get_time();
+    char mac[18] = {0};
+    cJSON *json_root  = cJSON_CreateObject();
+    cJSON *json_nodes = cJSON_AddArrayToObject(json_root, "nodes");
+
+    for (int i = 0; i < CONFIG_NODESTATS_MAX_NODES; i++) {
+        nodestats_entry_t entry;
+        portENTER_CRITICAL(&nodestats_lock);
+        entry = nodestats[i];
+        nodestats[i].last_received = nodestats[i].received;
+        portEXIT_CRITICAL(&nodestats_lock);
+
+        if (!entry.used)
+            continue;
+
+        cJSON *json_node = cJSON_CreateObject();
+        snprintf(mac, sizeof(mac), MACSTR, MAC2STR(entry.addr));
+        cJSON_AddStringToObject(json_node, "mac", mac);
+        if (entry.framed) {
+            cJSON_AddNumberToObject(json_node, "seq", entry.last_seq);
+            cJSON_AddNumberToObject(json_node, "lost", entry.lost);
+            cJSON_AddNumberToObject(json_node, "duplicates", entry.duplicates);
+            cJSON_AddNumberToObject(json_node, "reordered", entry.reordered);
+            cJSON_AddNumberToObject(json_node, "restarts", entry.restarts);
+        }
+        cJSON_AddNumberToObject(json_node, "received", entry.received);
+        cJSON_AddNumberToObject(json_node, "bytes", entry.bytes);
+#ifdef CONFIG_RATELIMIT_ENABLE
+        cJSON_AddNumberToObject(json_node, "throttled", entry.throttled);
+#endif
+        cJSON_AddNumberToObject(json_node, "rate", (double)(entry.received - entry.last_received) * 1000 /
+                                CONFIG_NODESTATS_PERIOD_MS);
+        cJSON_AddNumberToObject(json_node, "last_seen_ms", (double)((now_us - entry.last_seen_us) / 1000));
+        if (entry.health_us)
+            nodestats_add_health(json_node, &entry, now_us);
+        cJSON_AddItemToArray(json_nodes, json_node);
+    }
+
+    char *payload = cJSON_PrintUnformatted(json_root);
+    cJSON_Delete(json_root);
+    MDF_ERROR_CHECK(!payload, , "cJSON_PrintUnformatted, node statistics");
+
+    // the payload buffer is moved to the TX stage, which releases it
+    pipeline_forward(MQTT_TOPIC_NODES, payload, strlen(payload));
+}
+
+static void nodestats_timer_cb(void *arg) {
+    report_submit(nodestats_report);
+}
+
+void nodestats_start(void) {
+    if (!report_queue)
+        report_queue = staticmem_queue("report_queue", REPORT_QUEUE_LEN, sizeof(report_fn_t));
+    supervisor_start(SUPERVISOR_REPORT, report_task);
+
+    if (nodestats_timer)
+        return;
+
+    esp_timer_create_args_t timer_args = {
+        .callback = nodestats_timer_cb,
+        .name     = "nodestats",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &nodestats_timer));
+    ESP_ERROR_CHECK(esp_timer_start_periodic(nodestats_timer, (uint64_t)CONFIG_NODESTATS_PERIOD_MS * 1000));
+}
@@ -0,0 +1,928 @@
+/*
+ * ESP32 Mesh Network
+ * Copyright 2021, FCRLab at University of Messina (Messina, Italy)
+ *
+ * @maintainer: Lorenzo Carnevale <lcarnevale@unime.it>
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+#include "sys/param.h"
+
+#include "esp_http_client.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_timer.h"
+#include "mdf_info_store.h"
+#include "mwifi.h"
+
+/**
+ * @brief Streaming OTA.
+ *
+ * The upgrade through mupgrade downloads the whole image into the root and only
+ * then sends it to the nodes, as mupgrade_firmware_send() needs the complete
+ * image: it takes the download plus the distribution. With
+ * CONFIG_OTA_STREAM_ENABLE the root forwards every chunk to the nodes as soon
+ * as it comes from HTTP instead.
+ *
+ * Two stages run on the root. The HTTP stage reads chunks into a window of
+ * CONFIG_OTA_STREAM_WINDOW buffers and blocks while none is free, i.e. while
+ * the mesh is behind; the mesh stage writes every chunk to the inactive
+ * partition of the root and broadcasts it, blocking while the mesh is busy.
+ * The upgrade then takes about as long as the slower of the two.
+ *
+ * Broadcasts are not acknowledged: once the image is out, the root sends
+ * OTA_END with its SHA-256 and every node answers with the chunks it misses,
+ * which the root sends again from its own flash, for up to
+ * CONFIG_OTA_STREAM_REPAIR_ROUNDS rounds. If at least
+ * CONFIG_OTA_STREAM_COMMIT_PERCENT of the nodes verified the image, OTA_COMMIT
+ * makes them boot it, and the root follows. It is broadcast OTA_COMMIT_ROUNDS
+ * times, each with the time left to the restart, so that the mesh restarts at
+ * once. Every node must run a firmware with this option, older ones drop
+ * OTA_DATA as unknown.
+ *
+ * An endpoint may serve a patch against the running firmware instead of the
+ * whole image, told by its ota_delta_header_t and made on the build host with
+ * tools/ota_delta.py. The patch is streamed like an image, with OTA_FLAG_DELTA,
+ * and kept at the end of the inactive partition; then every node rebuilds the
+ * new firmware at the start of the partition from the running one, refusing a
+ * patch made against another firmware, and checks its SHA-256 against the one
+ * in the patch before answering OTA_END.
+ *
+ * A dropped download is resumed where it stopped with a Range request, see
+ * ota_http_resume(). The progress is saved in NVS every
+ * CONFIG_OTA_STREAM_CHECKPOINT_SECTORS sectors written, so that a root which
+ * restarts in the middle resumes the same session from there. The bytes read
+ * again are logged at the end of the download.
+ */
+#define OTA_SHA256_LEN          32
+#define OTA_SECTOR_SIZE         4096
+#define OTA_RESTART_DELAY_MS    3000
+#define OTA_COMMIT_ROUNDS       3
+#define OTA_COMMIT_INTERVAL_MS  500     /* between the OTA_COMMIT broadcasts, within the restart delay */
+#define OTA_REPORT_JITTER_MS    1000    /* the nodes answer OTA_END within it, not all at once */
+#define OTA_REPORT_QUEUE_LEN    16
+#define OTA_REPORT_SIZE         (sizeof(ota_report_t) + OTA_REPORT_MISSING_MAX * sizeof(uint16_t))
+#define OTA_PACKET_SIZE         (sizeof(ota_header_t) + OTA_CHUNK_SIZE)
+#define OTA_CHUNKS(size)        (((size) + OTA_CHUNK_SIZE - 1) / OTA_CHUNK_SIZE)
+#define OTA_SECTORS_SIZE(size)  (((size) + OTA_SECTOR_SIZE - 1) / OTA_SECTOR_SIZE * OTA_SECTOR_SIZE)
+
+#define OTA_CHECKPOINT_KEY      "ota_checkpoint"
+#define OTA_CHECKPOINT_CHUNKS   (CONFIG_OTA_STREAM_CHECKPOINT_SECTORS * OTA_SECTOR_SIZE / OTA_CHUNK_SIZE)
+
+#define OTA_DELTA_MAGIC         "ESPD"
+#define OTA_DELTA_VERSION       1
+
+/**
+ * @brief Header of a patch, followed by its operations, little endian:
+ *        OTA_DELTA_COPY, source offset and length, copies a range of the running
+ *        firmware; OTA_DELTA_INSERT, length and data, inserts new bytes.
+ */
+typedef struct {
+    char magic[4];
+    uint8_t version;
+    uint8_t reserved[3];
+    uint32_t target_size;
+    uint8_t base_sha256[OTA_SHA256_LEN];    /* of the firmware the patch applies to */
+    uint8_t target_sha256[OTA_SHA256_LEN];  /* of the firmware it rebuilds, as esp_partition_get_sha256() */
+} __attribute__((packed)) ota_delta_header_t;
+
+enum OtaDeltaOp {
+    OTA_DELTA_COPY      = 1,
+    OTA_DELTA_INSERT    = 2,
+};
+
+/**
+ * @brief Image written to the inactive partition, by the root and by the nodes.
+ */
+typedef struct {
+    const esp_partition_t *partition;
+    uint16_t session;       /* 0 when no image is open */
+    bool failed;            /* the image cannot be stored, its packets are ignored */
+    bool verified;
+    volatile bool finishing;    /* OTA_END handled by ota_node_finish_task(), packets are ignored */
+    uint8_t digest[OTA_SHA256_LEN];     /* expected, of the last OTA_END */
+    uint8_t flags;          /* of the OTA_DATA packets */
+    uint32_t base;          /* offset of the image in the partition, patches are kept at its end */
+    uint32_t size;
+    uint32_t chunks;
+    uint32_t received_num;
+    uint8_t *received;      /* bitmap of the chunks written */
+    uint8_t *erased;        /* bitmap of the sectors erased */
+} ota_image_t;
+
+/**
+ * @brief Chunk handed by the HTTP stage to the mesh stage.
+ */
+typedef struct {
+    uint32_t index;
+    size_t size;
+    uint8_t packet[OTA_PACKET_SIZE];    /* header left to the mesh stage */
+} ota_chunk_t;
+
+typedef struct {
+    uint8_t addr[MWIFI_ADDR_LEN];
+    size_t size;
+    uint16_t report[OTA_REPORT_SIZE / sizeof(uint16_t)];   /* aligned for the missing chunks */
+} ota_report_event_t;
+
+/**
+ * @brief Progress of the download, saved in NVS.
+ */
+typedef struct {
+    char url[100];          /* as the endpoints of the MQTT manager */
+    uint32_t size;
+    uint16_t session;
+    uint8_t flags;
+    uint32_t chunks;        /* written to the flash of the root, in order */
+} ota_checkpoint_t;
+
+typedef struct {
+    ota_image_t image;
+    ota_checkpoint_t checkpoint;    /* no url when the download cannot be checkpointed */
+    esp_http_client_handle_t client;
+    size_t http_size;
+    size_t http_offset;     /* next byte of the image the stream gives */
+    size_t skip;            /* bytes the server sends again, having ignored the range */
+    uint32_t stalled;       /* drops in a row without a byte */
+    uint32_t downloaded;    /* bytes read from HTTP */
+    uint32_t redownloaded;  /* of them, bytes read again after resuming */
+    uint32_t resumes;
+    QueueHandle_t free;     /* chunks the HTTP stage can fill */
+    QueueHandle_t full;     /* chunks for the mesh stage, NULL once the image is over */
+    TaskHandle_t http_task;
+    volatile bool failed;
+    int64_t http_stall_us;  /* the HTTP stage waited for a free chunk: the mesh is the bottleneck */
+    int64_t mesh_idle_us;   /* the mesh stage waited for a chunk: HTTP is the bottleneck */
+} ota_stream_t;
+
+static ota_image_t ota_node_image = {0};
+static ota_stream_t ota_stream = {0};
+static QueueHandle_t ota_report_queue = NULL;
+static bool ota_busy = false;
+
+#ifdef CONFIG_OTA_STREAM_ENABLE
+
+static inline bool ota_bit(const uint8_t *bitmap, uint32_t bit) {
+    return bitmap[bit / 8] & (1 << (bit % 8));
+}
+
+static inline void ota_set_bit(uint8_t *bitmap, uint32_t bit) {
+    bitmap[bit / 8] |= 1 << (bit % 8);
+}
+
+static void ota_image_close(ota_image_t *image) {
+    HEAP_FREE(image->received);
+    HEAP_FREE(image->erased);
+    memset(image, 0, sizeof(ota_image_t));
+}
+
+/**
+ * @brief Start writing an image of the given size to the inactive partition.
+ *        The session is kept when it fails, so that it is not opened again at
+ *        every packet.
+ */
+static mdf_err_t ota_image_open(ota_image_t *image, uint16_t session, uint32_t size, uint8_t flags) {
+    ota_image_close(image);
+    image->session = session;
+    image->failed  = true;
+
+    image->partition = esp_ota_get_next_update_partition(NULL);
+    MDF_ERROR_CHECK(!image->partition, MDF_ERR_NOT_SUPPORTED, "No OTA partition to update");
+    MDF_ERROR_CHECK(!size || OTA_SECTORS_SIZE(size) > image->partition->size, MDF_ERR_INVALID_SIZE,
+                    "Image of %d bytes does not fit partition %s", size, image->partition->label);
+
+    image->flags    = flags;
+    image->base     = flags & OTA_FLAG_DELTA ? image->partition->size - OTA_SECTORS_SIZE(size) : 0;
+    image->size     = size;
+    image->chunks   = OTA_CHUNKS(size);
+    image->received = HEAP_CALLOC(HEAP_TAG_OTA, (image->chunks + 7) / 8, 1);
+    image->erased   = HEAP_CALLOC(HEAP_TAG_OTA, (image->partition->size / OTA_SECTOR_SIZE + 7) / 8, 1);
+    MDF_ERROR_CHECK(!image->received || !image->erased, MDF_ERR_NO_MEM, "Allocate OTA bitmaps, chunks: %d", image->chunks);
+
+    image->failed = false;
+    MDF_LOGI("OTA session %04x, %s: %d bytes, partition: %s", session,
+             flags & OTA_FLAG_DELTA ? "patch" : "image", size, image->partition->label);
+    return MDF_OK;
+}
+
+/**
+ * @brief Write a chunk of the image, erasing its sector the first time it is
+ *        touched. Chunks already written are skipped.
+ */
+static mdf_err_t ota_image_write(ota_image_t *image, uint32_t index, const void *data, size_t size) {
+    mdf_err_t ret = MDF_OK;
+
+    MDF_ERROR_CHECK(index >= image->chunks, MDF_ERR_INVALID_ARG, "Invalid OTA chunk: %d", index);
+    if (ota_bit(image->received, index))
+        return MDF_OK;
+
+    uint32_t offset = index * OTA_CHUNK_SIZE;
+    MDF_ERROR_CHECK(size != MIN(OTA_CHUNK_SIZE, image->size - offset), MDF_ERR_INVALID_SIZE,
+                    "Invalid size of OTA chunk %d: %d", index, size);
+    offset += image->base;
+
+    uint32_t sector = offset / OTA_SECTOR_SIZE;
+    if (!ota_bit(image->erased, sector)) {
+        ret = esp_partition_erase_range(image->partition, sector * OTA_SECTOR_SIZE, OTA_SECTOR_SIZE);
+        MDF_ERROR_CHECK(ret != MDF_OK, ret, "<%s> esp_partition_erase_range, sector: %d", mdf_err_to_name(ret), sector);
+        ota_set_bit(image->erased, sector);
+    }
+
+    ret = esp_partition_write(image->partition, offset, data, size);
+    MDF_ERROR_CHECK(ret != MDF_OK, ret, "<%s> esp_partition_write, chunk: %d", mdf_err_to_name(ret), index);
+
+    ota_set_bit(image->received, index);
+    image->received_num++;
+    return MDF_OK;
+}
+
+static mdf_err_t ota_image_read(const ota_image_t *image, uint32_t index, void *data, size_t size) {
+    mdf_err_t ret = esp_partition_read(image->partition, image->base + index * OTA_CHUNK_SIZE, data, size);
+    MDF_ERROR_CHECK(ret != MDF_OK, ret, "<%s> esp_partition_read, chunk: %d", mdf_err_to_name(ret), index);
+    return MDF_OK;
+}
+
+/**
+ * @brief Hash the firmware of a partition, which checks it is a valid application too.
+ */
+static mdf_err_t ota_partition_digest(const esp_partition_t *partition, uint8_t *digest) {
+    mdf_err_t ret = esp_partition_get_sha256(partition, digest);
+    MDF_ERROR_CHECK(ret != MDF_OK, ret, "<%s> esp_partition_get_sha256, partition: %s", mdf_err_to_name(ret), partition->label);
+    return MDF_OK;
+}
+
+/**
+ * @brief Copy a range of a partition to the firmware being rebuilt.
+ */
+static mdf_err_t ota_delta_copy(const ota_image_t *image, const esp_partition_t *from, uint32_t offset,
+                                uint32_t written, uint32_t length, uint8_t *buffer) {
+    mdf_err_t ret = MDF_OK;
+
+    for (uint32_t done = 0, size = 0; done < length; done += size) {
+        size = MIN(OTA_CHUNK_SIZE, length - done);
+        ret = esp_partition_read(from, offset + done, buffer, size);
+        MDF_ERROR_CHECK(ret != MDF_OK, ret, "<%s> esp_partition_read, partition: %s", mdf_err_to_name(ret), from->label);
+        ret = esp_partition_write(image->partition, written + done, buffer, size);
+        MDF_ERROR_CHECK(ret != MDF_OK, ret, "<%s> esp_partition_write", mdf_err_to_name(ret));
+    }
+    return MDF_OK;
+}
+
+/**
+ * @brief Rebuild the new firmware at the start of the partition, from the
+ *        running one and the patch kept at its end.
+ *
+ * @return MDF_ERR_NOT_SUPPORTED for a patch which does not apply to the running
+ *         firmware, which is not worth receiving again
+ */
+static mdf_err_t ota_delta_apply(const ota_image_t *image, uint8_t *digest) {
+    mdf_err_t ret = MDF_OK;
+    ota_delta_header_t header = {0};
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    uint32_t offset  = image->base + sizeof(ota_delta_header_t);
+    uint32_t end     = image->base + image->size;
+    uint32_t written = 0;
+    uint8_t *buffer  = NULL;
+    int64_t start_us = esp_timer_get_time();
+
+    MDF_ERROR_CHECK(image->size < sizeof(ota_delta_header_t), MDF_ERR_NOT_SUPPORTED, "Truncated OTA patch");
+    ret = esp_partition_read(image->partition, image->base, &header, sizeof(ota_delta_header_t));
+    MDF_ERROR_CHECK(ret != MDF_OK, ret, "<%s> Read the OTA patch header", mdf_err_to_name(ret));
+    MDF_ERROR_CHECK(memcmp(header.magic, OTA_DELTA_MAGIC, sizeof(header.magic)) || header.version != OTA_DELTA_VERSION,
+                    MDF_ERR_NOT_SUPPORTED, "Unsupported OTA patch, version: %d", header.version);
+    MDF_ERROR_CHECK(OTA_SECTORS_SIZE(header.target_size) > image->base, MDF_ERR_NOT_SUPPORTED,
+                    "Firmware of %d bytes does not fit before its patch", header.target_size);
+
+    ret = ota_partition_digest(running, digest);
+    MDF_ERROR_CHECK(ret != MDF_OK || memcmp(digest, header.base_sha256, OTA_SHA256_LEN), MDF_ERR_NOT_SUPPORTED,
+                    "OTA patch made against another firmware than the running one");
+
+    buffer = HEAP_MALLOC(HEAP_TAG_OTA, OTA_CHUNK_SIZE);
+    MDF_ERROR_CHECK(!buffer, MDF_ERR_NO_MEM, "Allocate OTA patch buffer");
+    ret = esp_partition_erase_range(image->partition, 0, OTA_SECTORS_SIZE(header.target_size));
+    MDF_ERROR_GOTO(ret != MDF_OK, EXIT, "<%s> esp_partition_erase_range", mdf_err_to_name(ret));
+
+    while (offset < end) {
+        uint8_t op[1 + 2 * sizeof(uint32_t)] = {0};
+        uint32_t source = 0, length = 0;
+
+        ret = esp_partition_read(image->partition, offset, op, MIN(sizeof(op), end - offset));
+        MDF_ERROR_GOTO(ret != MDF_OK, EXIT, "<%s> Read the OTA patch", mdf_err_to_name(ret));
+
+        if (op[0] == OTA_DELTA_COPY) {
+            memcpy(&source, op + 1, sizeof(uint32_t));
+            memcpy(&length, op + 1 + sizeof(uint32_t), sizeof(uint32_t));
+            offset += sizeof(op);
+            ret = offset > end || source + length > running->size || written + length > header.target_size ? MDF_FAIL :
+                  ota_delta_copy(image, running, source, written, length, buffer);
+        } else if (op[0] == OTA_DELTA_INSERT) {
+            memcpy(&length, op + 1, sizeof(uint32_t));
+            offset += 1 + sizeof(uint32_t);
+            ret = offset + length > end || written + length > header.target_size ? MDF_FAIL :
+                  ota_delta_copy(image, image->partition, offset, written, length, buffer);
+            offset += length;
+        } else {
+            ret = MDF_FAIL;
+        }
+        MDF_ERROR_GOTO(ret != MDF_OK, EXIT, "Invalid OTA patch operation %d at %d", op[0], offset - image->base);
+        written += length;
+    }
+
+    ret = written == header.target_size ? ota_partition_digest(image->partition, digest) : MDF_FAIL;
+    if (ret == MDF_OK && memcmp(digest, header.target_sha256, OTA_SHA256_LEN))
+        ret = MDF_FAIL;
+    MDF_ERROR_GOTO(ret != MDF_OK, EXIT, "Patched firmware does not match its hash, written: %d/%d",
+                   written, header.target_size);
+
+    MDF_LOGI("OTA patch of %d bytes applied, firmware: %d bytes, in %lld ms", image->size,
+             header.target_size, (esp_timer_get_time() - start_us) / 1000);
+    ret = MDF_OK;
+
+EXIT:
+    HEAP_FREE(buffer);
+    return ret == MDF_OK ? MDF_OK : MDF_FAIL;
+}
+
+/**
+ * @brief Rebuild the firmware of a patch, then hash the firmware received.
+ */
+static mdf_err_t ota_image_finish(const ota_image_t *image, uint8_t *digest) {
+    if (image->flags & OTA_FLAG_DELTA)
+        return ota_delta_apply(image, digest);
+    return ota_partition_digest(image->partition, digest);
+}
+
+/**
+ * @brief Answer OTA_END with the status of the image and its first missing chunks.
+ */
+static mdf_err_t ota_node_report(const ota_image_t *image, uint8_t status) {
+    uint16_t data[OTA_REPORT_SIZE / sizeof(uint16_t)] = {0};
+    ota_report_t *report = (ota_report_t *)data;
+    uint16_t *missing    = data + sizeof(ota_report_t) / sizeof(uint16_t);
+    mwifi_data_type_t data_type = {.custom = OTA_REPORT};
+
+    report->version  = OTA_VERSION;
+    report->status   = status;
+    report->session  = image->session;
+    report->received = image->received_num;
+
+    for (uint32_t i = 0; !image->failed && i < image->chunks; i++) {
+        if (ota_bit(image->received, i))
+            continue;
+        if (report->missing_num < OTA_REPORT_MISSING_MAX)
+            missing[report->missing_num] = i;
+        report->missing_num++;
+    }
+
+    // spread the answers of the nodes, all triggered by the same broadcast
+    vTaskDelay(pdMS_TO_TICKS(esp_random() % OTA_REPORT_JITTER_MS));
+
+    size_t size = sizeof(ota_report_t) + MIN(report->missing_num, OTA_REPORT_MISSING_MAX) * sizeof(uint16_t);
+    mdf_err_t ret = mwifi_write(NULL, &data_type, data, size, true);
+    MDF_ERROR_CHECK(ret != MDF_OK, ret, "<%s> Send OTA report", mdf_err_to_name(ret));
+    return MDF_OK;
+}
+
+/**
+ * @brief Answer OTA_END on a node: rebuild the firmware of a patch and verify it,
+ *        then report. It takes seconds, so it runs off the node reader, which
+ *        ignores the OTA packets meanwhile.
+ */
+static void ota_node_finish_task(void *arg) {
+    mdf_err_t ret = MDF_OK;
+    uint8_t digest[OTA_SHA256_LEN] = {0};
+    ota_image_t *image = &ota_node_image;
+    uint8_t status = OTA_STATUS_VERIFIED;
+
+    if (image->failed) {
+        status = OTA_STATUS_FAILED;
+    } else if (image->received_num < image->chunks) {
+        status = OTA_STATUS_MISSING;
+    } else {
+        if (!image->verified) {
+            ret = ota_image_finish(image, digest);
+            image->verified = ret == MDF_OK && !memcmp(digest, image->digest, OTA_SHA256_LEN);
+        }
+        if (ret == MDF_ERR_NOT_SUPPORTED) {
+            image->failed = true;
+            status = OTA_STATUS_FAILED;
+        } else if (!image->verified) {
+            MDF_LOGW("OTA image does not match its hash, receive it again");
+            memset(image->received, 0, (image->chunks + 7) / 8);
+            memset(image->erased, 0, (image->partition->size / OTA_SECTOR_SIZE + 7) / 8);
+            image->received_num = 0;
+            status = OTA_STATUS_CORRUPT;
+        }
+    }
+
+    ota_node_report(image, status);
+    image->finishing = false;
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief Node handler of OTA_DATA packets.
+ */
+static mdf_err_t node_ota_handler(packet_t *packet) {
+    mdf_err_t ret = MDF_OK;
+    const ota_header_t *header = (const ota_header_t *)packet->data;
+    const uint8_t *payload     = (const uint8_t *)packet->data + sizeof(ota_header_t);
+    size_t size                = packet->size - sizeof(ota_header_t);
+    ota_image_t *image         = &ota_node_image;
+
+    MDF_ERROR_CHECK(packet->size < sizeof(ota_header_t), MDF_ERR_INVALID_SIZE, "Truncated OTA packet, size: %d", packet->size);
+    MDF_ERROR_CHECK(header->version != OTA_VERSION, MDF_ERR_NOT_SUPPORTED, "Unsupported OTA version: %d", header->version);
+
+    // the root streams from its own copy
+    if (esp_mesh_is_root() || image->finishing)
+        return MDF_OK;
+
+    if (header->session != image->session) {
+        if (header->kind == OTA_COMMIT)
+            return MDF_OK;
+        ota_image_open(image, header->session, header->size, header->flags);
+    }
+
+    switch (header->kind) {
+        case OTA_BEGIN:
+            return MDF_OK;
+
+        case OTA_CHUNK:
+            if (image->failed)
+                return MDF_FAIL;
+            return ota_image_write(image, header->index, payload, size);
+
+        case OTA_END:
+            MDF_ERROR_CHECK(size < OTA_SHA256_LEN, MDF_ERR_INVALID_SIZE, "Truncated OTA end, size: %d", size);
+            memcpy(image->digest, payload, OTA_SHA256_LEN);
+            image->finishing = true;
+            if (xTaskCreate(ota_node_finish_task, "ota_finish_task", 4 * 1024, NULL, CONFIG_MDF_TASK_DEFAULT_PRIOTY,
+                            NULL) != pdPASS) {
+                image->finishing = false;
+                MDF_LOGW("Create the OTA finish task");
+                return MDF_ERR_NO_MEM;
+            }
+            return MDF_OK;
+
+        case OTA_COMMIT:
+            if (!image->verified) {
+                MDF_LOGW("OTA commit of an image not verified, drop it");
+                ota_image_close(image);
+                return MDF_FAIL;
+            }
+
+            ret = esp_ota_set_boot_partition(image->partition);
+            MDF_ERROR_CHECK(ret != MDF_OK, ret, "<%s> esp_ota_set_boot_partition", mdf_err_to_name(ret));
+            MDF_LOGW("The device will restart on the new image after %d ms", header->index);
+            vTaskDelay(pdMS_TO_TICKS(header->index));
+            esp_restart();
+            return MDF_OK;
+
+        default:
+            return MDF_ERR_NOT_SUPPORTED;
+    }
+}
+
+/**
+ * @brief Receive the report of a node, from the root reader. Never blocks.
+ */
+void ota_receive_report(const uint8_t *src_addr, const void *data, size_t size) {
+    ota_report_event_t event = {0};
+
+    if (!ota_report_queue || size < sizeof(ota_report_t) || size > OTA_REPORT_SIZE)
+        return;
+
+    memcpy(event.addr, src_addr, MWIFI_ADDR_LEN);
+    memcpy(event.report, data, size);
+    event.size = size;
+    if (xQueueSend(ota_report_queue, &event, 0) != pdTRUE)
+        MDF_LOGW("OTA report queue full, drop report of " MACSTR, MAC2STR(src_addr));
+}
+
+/**
+ * @brief Broadcast an OTA_DATA packet, whose payload is already in place.
+ */
+static mdf_err_t ota_broadcast(uint8_t *packet, uint8_t kind, uint32_t index, size_t size) {
+    ota_header_t *header = (ota_header_t *)packet;
+    mesh_addr_t dest_addr = {.addr = MWIFI_ADDR_BROADCAST};
+    mwifi_data_type_t data_type = {
+        .communicate = MWIFI_COMMUNICATE_BROADCAST,
+        .custom = OTA_DATA,
+    };
+
+    header->version = OTA_VERSION;
+    header->kind    = kind;
+    header->session = ota_stream.image.session;
+    header->size    = ota_stream.image.size;
+    header->index   = index;
+    header->flags   = ota_stream.image.flags;
+
+    mdf_err_t ret = mwifi_root_write(dest_addr.addr, 1, &data_type, packet, sizeof(ota_header_t) + size, true);
+    MDF_ERROR_CHECK(ret != MDF_OK, ret, "<%s> Broadcast OTA packet, kind: %d, index: %d", mdf_err_to_name(ret), kind, index);
+    return MDF_OK;
+}
+
+/**
+ * @brief Save the progress on a sector boundary, as the sectors past a
+ *        checkpoint are erased again on resume.
+ */
+static void ota_checkpoint_save(uint32_t chunks) {
+    if (!OTA_CHECKPOINT_CHUNKS || !ota_stream.checkpoint.url[0] || chunks % OTA_CHECKPOINT_CHUNKS ||
+        chunks == ota_stream.image.chunks)
+        return;
+
+    ota_stream.checkpoint.chunks = chunks;
+    mdf_err_t ret = mdf_info_save(OTA_CHECKPOINT_KEY, &ota_stream.checkpoint, sizeof(ota_checkpoint_t));
+    MDF_ERROR_CHECK(ret != MDF_OK, , "<%s> Save the OTA checkpoint", mdf_err_to_name(ret));
+}
+
+/**
+ * @brief Take over the chunks written before the root restarted.
+ */
+static void ota_checkpoint_restore(ota_image_t *image, uint32_t chunks) {
+    image->received_num = MIN(chunks, image->chunks);
+    for (uint32_t i = 0; i < image->received_num; i++) {
+        ota_set_bit(image->received, i);
+        ota_set_bit(image->erased, (image->base + i * OTA_CHUNK_SIZE) / OTA_SECTOR_SIZE);
+    }
+}
+
+/**
+ * @brief Mesh stage: write every chunk to the root flash and broadcast it.
+ *        A chunk lost on the way is repaired after OTA_END.
+ */
+static void ota_mesh_task(void *arg) {
+    ota_chunk_t *chunk = NULL;
+
+    for (;;) {
+        int64_t wait_us = esp_timer_get_time();
+        xQueueReceive(ota_stream.full, &chunk, portMAX_DELAY);
+        ota_stream.mesh_idle_us += esp_timer_get_time() - wait_us;
+        if (!chunk)
+            break;
+
+        if (!ota_stream.failed) {
+            mdf_err_t ret = ota_image_write(&ota_stream.image, chunk->index,
+                                            chunk->packet + sizeof(ota_header_t), chunk->size);
+            ota_stream.failed = ret != MDF_OK;
+            if (ret == MDF_OK) {
+                ota_broadcast(chunk->packet, OTA_CHUNK, chunk->index, chunk->size);
+                ota_checkpoint_save(chunk->index + 1);
+            }
+        }
+        xQueueSend(ota_stream.free, &chunk, portMAX_DELAY);
+    }
+
+    xTaskNotifyGive(ota_stream.http_task);
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief Read exactly size bytes of the image, resuming the stream where it
+ *        stopped when it drops.
+ */
+static mdf_err_t ota_http_read(uint8_t *data, size_t size) {
+    for (size_t recv_size = 0; recv_size < size;) {
+        int ret = esp_http_client_read(ota_stream.client, (char *)data + recv_size, size - recv_size);
+
+        if (ret <= 0) {
+            MDF_ERROR_CHECK(++ota_stream.stalled > CONFIG_OTA_RESUME_RETRIES, MDF_FAIL,
+                            "HTTP stream dropped at %d/%d bytes, give up", ota_stream.http_offset, ota_stream.http_size);
+            MDF_LOGW("HTTP stream dropped at %d/%d bytes, resume it", ota_stream.http_offset, ota_stream.http_size);
+            int start = ota_http_resume(ota_stream.client, ota_stream.http_offset, &ota_stream.http_size);
+            MDF_ERROR_CHECK(start < 0, MDF_FAIL, "Resume the HTTP stream");
+            ota_stream.resumes++;
+            ota_stream.skip          = ota_stream.http_offset - start;
+            ota_stream.redownloaded += ota_stream.skip;
+            continue;
+        }
+
+        ota_stream.stalled     = 0;
+        ota_stream.downloaded += ret;
+        if (ota_stream.skip) {  // a server ignoring the range sends what we have again
+            size_t skipped = MIN(ret, ota_stream.skip);
+            memmove(data + recv_size, data + recv_size + skipped, ret - skipped);
+            ota_stream.skip -= skipped;
+            ret             -= skipped;
+        }
+        recv_size              += ret;
+        ota_stream.http_offset += ret;
+    }
+    return MDF_OK;
+}
+
+/**
+ * @brief Mark the chunks a node reported as missing; those past its list go
+ *        as a whole.
+ */
+static void ota_report_merge(const ota_report_event_t *event, uint8_t *missing) {
+    const ota_report_t *report = (const ota_report_t *)event->report;
+    const uint16_t *listed     = event->report + sizeof(ota_report_t) / sizeof(uint16_t);
+    size_t listed_num = MIN((event->size - sizeof(ota_report_t)) / sizeof(uint16_t), report->missing_num);
+    uint32_t tail     = 0;
+
+    for (size_t i = 0; i < listed_num; i++) {
+        if (listed[i] < ota_stream.image.chunks)
+            ota_set_bit(missing, listed[i]);
+        tail = listed[i] + 1;
+    }
+    if (report->missing_num > listed_num) {
+        for (uint32_t i = tail; i < ota_stream.image.chunks; i++)
+            ota_set_bit(missing, i);
+    }
+}
+
+/**
+ * @brief Send OTA_END and the chunks the nodes miss until all of them verified
+ *        the image, for a bounded number of rounds.
+ *
+ * @return the number of nodes which verified the image
+ */
+static int ota_repair(uint8_t *packet, const uint8_t *digest, int *expected) {
+    ota_image_t *image = &ota_stream.image;
+    ota_report_event_t event = {0};
+    size_t bitmap_size = (image->chunks + 7) / 8;
+    uint8_t *missing   = HEAP_MALLOC(HEAP_TAG_OTA, bitmap_size);
+    int verified       = 0;
+
+    MDF_ERROR_CHECK(!missing, 0, "Allocate OTA repair bitmap");
+    xQueueReset(ota_report_queue);
+
+    for (int round = 0; round <= CONFIG_OTA_STREAM_REPAIR_ROUNDS; round++) {
+        int reports = 0, resent = 0;
+
+        *expected = esp_mesh_get_routing_table_size() - 1;
+        verified  = 0;
+        memset(missing, 0, bitmap_size);
+
+        memcpy(packet + sizeof(ota_header_t), digest, OTA_SHA256_LEN);
+        ota_broadcast(packet, OTA_END, 0, OTA_SHA256_LEN);
+
+        int64_t deadline_us = esp_timer_get_time() + (int64_t)CONFIG_OTA_STREAM_REPORT_MS * 1000;
+        for (int64_t wait_us; reports < *expected && (wait_us = deadline_us - esp_timer_get_time()) > 0;) {
+            if (xQueueReceive(ota_report_queue, &event, pdMS_TO_TICKS(wait_us / 1000) + 1) != pdTRUE)
+                break;
+
+            const ota_report_t *report = (const ota_report_t *)event.report;
+            if (report->version != OTA_VERSION || report->session != image->session)
+                continue;
+
+            reports++;
+            if (report->status == OTA_STATUS_VERIFIED)
+                verified++;
+            else if (report->status == OTA_STATUS_FAILED)
+                MDF_LOGW("Node " MACSTR " cannot store the OTA image", MAC2STR(event.addr));
+            else
+                ota_report_merge(&event, missing);
+        }
+
+        for (uint32_t i = 0; i < image->chunks; i++)
+            resent += ota_bit(missing, i);
+
+        MDF_LOGI("OTA round %d, reports: %d/%d, verified: %d, chunks to send again: %d",
+                 round, reports, *expected, verified, resent);
+        if ((!resent && reports >= *expected) || round == CONFIG_OTA_STREAM_REPAIR_ROUNDS)
+            break;
+
+        for (uint32_t i = 0; i < image->chunks; i++) {
+            if (!ota_bit(missing, i))
+                continue;
+            size_t size = MIN(OTA_CHUNK_SIZE, image->size - i * OTA_CHUNK_SIZE);
+            if (ota_image_read(image, i, packet + sizeof(ota_header_t), size) == MDF_OK)
+                ota_broadcast(packet, OTA_CHUNK, i, size);
+        }
+    }
+
+    HEAP_FREE(missing);
+    return verified;
+}
+
+/**
+ * @brief HTTP stage of the streaming upgrade, then the repair and the commit.
+ */
+static void ota_stream_task(void *arg) {
+    char *url            = (char *)arg;
+    mdf_err_t ret        = MDF_OK;
+    ota_chunk_t *chunks  = NULL;
+    ota_chunk_t *chunk   = NULL;
+    ota_chunk_t *ready   = NULL;
+    uint8_t *packet      = NULL;
+    uint8_t digest[OTA_SHA256_LEN] = {0};
+    ota_checkpoint_t *checkpoint = &ota_stream.checkpoint;
+    int expected         = 0;
+    int64_t start_us     = esp_timer_get_time();
+    int64_t download_us  = 0;
+    esp_http_client_config_t config = {
+        .url            = url,
+        .transport_type = HTTP_TRANSPORT_UNKNOWN,
+    };
+
+    memset(&ota_stream, 0, sizeof(ota_stream_t));
+    ota_stream.http_task = xTaskGetCurrentTaskHandle();
+    MDF_LOGI("Streaming OTA from %s", url);
+
+    ota_stream.client = esp_http_client_init(&config);
+    MDF_ERROR_GOTO(!ota_stream.client, EXIT, "Initialise HTTP connection");
+
+    // the download of this image the root was doing before restarting, if any
+    bool resume = mdf_info_load(OTA_CHECKPOINT_KEY, checkpoint, sizeof(ota_checkpoint_t)) == MDF_OK &&
+                  !strncmp(checkpoint->url, url, sizeof(checkpoint->url));
+    ota_stream.http_offset = resume ? checkpoint->chunks * OTA_CHUNK_SIZE : 0;
+
+    int start = ota_http_open(ota_stream.client, ota_stream.http_offset, &ota_stream.http_size);
+    if (start < 0) {
+        ota_stream.http_size = 0;
+        start = ota_http_resume(ota_stream.client, ota_stream.http_offset, &ota_stream.http_size);
+    }
+    MDF_ERROR_GOTO(start < 0, EXIT, "Open HTTP connection, check the address of the server");
+
+    if (resume && ota_stream.http_size != checkpoint->size) {
+        MDF_LOGW("Image changed on the server, download it from the start");
+        resume = false;
+        ota_stream.http_offset = 0;
+        esp_http_client_close(ota_stream.client);
+        start = ota_http_open(ota_stream.client, 0, &ota_stream.http_size);
+        MDF_ERROR_GOTO(start < 0, EXIT, "Open HTTP connection");
+    }
+    ota_stream.skip = ota_stream.http_offset - start;
+    ota_stream.redownloaded = ota_stream.skip;
+
+    chunks            = HEAP_CALLOC(HEAP_TAG_OTA, CONFIG_OTA_STREAM_WINDOW, sizeof(ota_chunk_t));
+    packet            = HEAP_MALLOC(HEAP_TAG_OTA, OTA_PACKET_SIZE);
+    ota_stream.free   = xQueueCreate(CONFIG_OTA_STREAM_WINDOW, sizeof(ota_chunk_t *));
+    ota_stream.full   = xQueueCreate(CONFIG_OTA_STREAM_WINDOW + 1, sizeof(ota_chunk_t *));     // and the end marker
+    MDF_ERROR_GOTO(!chunks || !packet || !ota_stream.free || !ota_stream.full, EXIT, "Allocate the OTA window");
+    for (int i = 0; i < CONFIG_OTA_STREAM_WINDOW; i++) {
+        chunk = &chunks[i];
+        xQueueSend(ota_stream.free, &chunk, 0);
+    }
+
+    if (resume) {
+        // the nodes keep the chunks of the same session
+        ret = ota_image_open(&ota_stream.image, checkpoint->session, checkpoint->size, checkpoint->flags);
+        MDF_ERROR_GOTO(ret != MDF_OK, EXIT, "<%s> Open the OTA image", mdf_err_to_name(ret));
+        ota_checkpoint_restore(&ota_stream.image, checkpoint->chunks);
+        MDF_LOGI("OTA download resumed at %d/%d bytes", ota_stream.http_offset, ota_stream.http_size);
+    } else {
+        // a patch is told by its header, before the image is opened
+        xQueueReceive(ota_stream.free, &ready, 0);
+        ready->index = 0;
+        ready->size  = MIN(OTA_CHUNK_SIZE, ota_stream.http_size);
+        ret = ota_http_read(ready->packet + sizeof(ota_header_t), ready->size);
+        MDF_ERROR_GOTO(ret != MDF_OK, EXIT, "Read the OTA image");
+        bool delta = ready->size >= sizeof(ota_delta_header_t) &&
+                     !memcmp(ready->packet + sizeof(ota_header_t), OTA_DELTA_MAGIC, strlen(OTA_DELTA_MAGIC));
+
+        ret = ota_image_open(&ota_stream.image, esp_random() % UINT16_MAX + 1, ota_stream.http_size,
+                             delta ? OTA_FLAG_DELTA : 0);
+        MDF_ERROR_GOTO(ret != MDF_OK, EXIT, "<%s> Open the OTA image", mdf_err_to_name(ret));
+
+        memset(checkpoint, 0, sizeof(ota_checkpoint_t));
+        mdf_info_erase(OTA_CHECKPOINT_KEY);
+        if (strlen(url) < sizeof(checkpoint->url)) {
+            strcpy(checkpoint->url, url);
+            checkpoint->size    = ota_stream.image.size;
+            checkpoint->session = ota_stream.image.session;
+            checkpoint->flags   = ota_stream.image.flags;
+        }
+    }
+
+    ota_broadcast(packet, OTA_BEGIN, 0, 0);
+    MDF_ERROR_GOTO(xTaskCreate(ota_mesh_task, "ota_mesh_task", 3 * 1024, NULL, CONFIG_MDF_TASK_DEFAULT_PRIOTY,
+                               NULL) != pdPASS, EXIT, "Create the OTA mesh task");
+
+    for (uint32_t index = ota_stream.image.received_num; index < ota_stream.image.chunks && !ota_stream.failed; index++) {
+        if (ready) {    // the first one, already read
+            chunk = ready;
+            ready = NULL;
+        } else {
+            int64_t wait_us = esp_timer_get_time();
+            xQueueReceive(ota_stream.free, &chunk, portMAX_DELAY);
+            ota_stream.http_stall_us += esp_timer_get_time() - wait_us;
+
+            chunk->index = index;
+            chunk->size  = MIN(OTA_CHUNK_SIZE, ota_stream.http_size - index * OTA_CHUNK_SIZE);
+            if (ota_http_read(chunk->packet + sizeof(ota_header_t), chunk->size) != MDF_OK) {
+                ota_stream.failed = true;
+                xQueueSend(ota_stream.free, &chunk, 0);
+                break;
+            }
+        }
+        xQueueSend(ota_stream.full, &chunk, portMAX_DELAY);
+    }
+    download_us = esp_timer_get_time() - start_us;
+
+    chunk = NULL;
+    xQueueSend(ota_stream.full, &chunk, portMAX_DELAY);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    MDF_LOGI("OTA download, read: %d bytes, re-downloaded: %d bytes, resumes: %d",
+             ota_stream.downloaded, ota_stream.redownloaded, ota_stream.resumes);
+    // a checkpoint is kept to resume a download given up, and only for it
+    MDF_ERROR_GOTO(ota_stream.failed, EXIT, "OTA stream failed, chunks written: %d/%d",
+                   ota_stream.image.received_num, ota_stream.image.chunks);
+    mdf_info_erase(OTA_CHECKPOINT_KEY);
+
+    MDF_LOGI("OTA %s streamed, size: %d bytes, download: %lld ms, download and distribution: %lld ms, "
+             "HTTP stalled on the mesh: %lld ms, mesh idle on HTTP: %lld ms",
+             ota_stream.image.flags & OTA_FLAG_DELTA ? "patch" : "image", ota_stream.image.size, download_us / 1000,
+             (esp_timer_get_time() - start_us) / 1000, ota_stream.http_stall_us / 1000, ota_stream.mesh_idle_us / 1000);
+
+    // the copy of the root is the reference the nodes check theirs against
+    ret = ota_image_finish(&ota_stream.image, digest);
+    MDF_ERROR_GOTO(ret != MDF_OK, EXIT, "<%s> Invalid OTA image", mdf_err_to_name(ret));
+
+    int verified = ota_repair(packet, digest, &expected);
+    MDF_LOGI("OTA image verified by %d/%d nodes in %lld ms", verified, expected, (esp_timer_get_time() - start_us) / 1000);
+    MDF_ERROR_GOTO(verified * 100 < expected * CONFIG_OTA_STREAM_COMMIT_PERCENT, EXIT,
+                   "OTA image verified by %d/%d nodes, below %d%%, do not commit it",
+                   verified, expected, CONFIG_OTA_STREAM_COMMIT_PERCENT);
+
+    ret = esp_ota_set_boot_partition(ota_stream.image.partition);
+    MDF_ERROR_GOTO(ret != MDF_OK, EXIT, "<%s> esp_ota_set_boot_partition", mdf_err_to_name(ret));
+
+    // unacknowledged, so sent again; the nodes which got one already wait for the restart
+    MDF_LOGW("The root will restart on the new image after %d ms", OTA_RESTART_DELAY_MS);
+    for (int round = 0; round < OTA_COMMIT_ROUNDS; round++) {
+        ota_broadcast(packet, OTA_COMMIT, OTA_RESTART_DELAY_MS - round * OTA_COMMIT_INTERVAL_MS, 0);
+        vTaskDelay(pdMS_TO_TICKS(OTA_COMMIT_INTERVAL_MS));
+    }
+    vTaskDelay(pdMS_TO_TICKS(OTA_RESTART_DELAY_MS - OTA_COMMIT_ROUNDS * OTA_COMMIT_INTERVAL_MS));
+    esp_restart();
+
+EXIT:
+    ota_image_close(&ota_stream.image);
+    if (ota_stream.free)
+        vQueueDelete(ota_stream.free);
+    if (ota_stream.full)
+        vQueueDelete(ota_stream.full);
+    HEAP_FREE(chunks);
+    HEAP_FREE(packet);
+    HEAP_FREE(url);
+    if (ota_stream.client) {
+        esp_http_client_close(ota_stream.client);
+        esp_http_client_cleanup(ota_stream.client);
+    }
+    ota_busy = false;
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief Stream the image of an OTA endpoint, one at a time. It is the MQTT
+ *        handler of the endpoints, so it does not block.
+ */
+static void ota_stream_start(const char *url) {
+    if (__atomic_exchange_n(&ota_busy, true, __ATOMIC_ACQ_REL)) {
+        MDF_LOGW("OTA already running, ignore %s", url);
+        return;
+    }
+
+    char *arg = HEAP_MALLOC(HEAP_TAG_OTA, strlen(url) + 1);
+    if (arg) {
+        strcpy(arg, url);
+        if (xTaskCreate(ota_stream_task, "ota_stream_task", 5 * 1024, arg, CONFIG_MDF_TASK_DEFAULT_PRIOTY, NULL) == pdPASS)
+            return;
+        HEAP_FREE(arg);
+    }
+
+    MDF_LOGE("Start the OTA stream");
+    ota_busy = false;
+}
+
+/**
+ * @brief Receive the streamed images, on every node.
+ */
+void ota_start(void) {
+    packet_register(PACKET_TABLE_NODE, OTA_DATA, "OTA_DATA", node_ota_handler);
+}
+
+/**
+ * @brief Stream the images of the OTA endpoints instead of using mupgrade, on the root.
+ */
+void ota_root_start(void) {
+    static bool checked = false;
+    ota_checkpoint_t checkpoint = {0};
+
+    if (!ota_report_queue)
+        ota_report_queue = xQueueCreate(OTA_REPORT_QUEUE_LEN, sizeof(ota_report_event_t));
+    mqtt_set_ota_handler(ota_stream_start);
+
+    // a download cut by a restart goes on without waiting for the endpoint again
+    if (!checked && mdf_info_load(OTA_CHECKPOINT_KEY, &checkpoint, sizeof(ota_checkpoint_t)) == MDF_OK) {
+        checkpoint.url[sizeof(checkpoint.url) - 1] = '\0';
+        MDF_LOGI("Resume the OTA download of %s", checkpoint.url);
+        ota_stream_start(checkpoint.url);
+    }
+    checked = true;
+}
+
+#else
+
+static inline void ota_receive_report(const uint8_t *src_addr, const void *data, size_t size) {}
+static inline void ota_start(void) {}
+static inline void ota_root_start(void) {}
+
+#endif
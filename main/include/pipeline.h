@@ -0,0 +1,364 @@
+/*
+ * ESP32 Mesh Network
+ * Copyright 2021, FCRLab at University of Messina (Messina, Italy)
+ *
+ * @maintainer: Lorenzo Carnevale <lcarnevale@unime.it>
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+#include "esp_timer.h"
+#include "mwifi.h"
+
+typedef enum {
+    PIPELINE_STAGE_RX = 0,  /* mesh ingest, reads from mwifi_root_read */
+    PIPELINE_STAGE_ENCODE,  /* decodes mesh packets into MQTT payloads */
+    PIPELINE_STAGE_TX,      /* publishes payloads to the MQTT broker */
+    PIPELINE_STAGE_MAX,
+} pipeline_stage_id_t;
+
+typedef struct {
+    const char *name;
+    int core;
+    supervisor_task_id_t task;      /* stack, priority and pinning are set in supervisor.h */
+    volatile int64_t busy_us;       /* time spent working, blocking excluded */
+    volatile uint32_t processed;
+    volatile uint32_t dropped;      /* items lost because the next queue was full */
+    int64_t last_busy_us;
+    uint32_t last_processed;
+} pipeline_stage_t;
+
+/**
+ * @brief An encoded message handed from the encode stage to the TX stage.
+ */
+typedef struct {
+    mqtt_topic_t topic;
+    size_t size;
+    char *data;
+} pipeline_message_t;
+
+
+static pipeline_stage_t pipeline_stages[PIPELINE_STAGE_MAX] = {
+    [PIPELINE_STAGE_RX] = {
+        .name = "root_reader_task", .core = CONFIG_PIPELINE_RX_CORE, .task = SUPERVISOR_ROOT_READER,
+    },
+    [PIPELINE_STAGE_ENCODE] = {
+        .name = "root_encode_task", .core = CONFIG_PIPELINE_ENCODE_CORE, .task = SUPERVISOR_ROOT_ENCODE,
+    },
+    [PIPELINE_STAGE_TX] = {
+        .name = "mqtt_tx_task", .core = CONFIG_PIPELINE_TX_CORE, .task = SUPERVISOR_MQTT_TX,
+    },
+};
+
+static int64_t pipeline_takeover_us = 0;   /* root takeover not followed by a publish yet */
+static int64_t pipeline_got_ip_us = 0;
+static QueueHandle_t encode_queue = NULL;
+static QueueHandle_t tx_queue     = NULL;
+#ifdef CONFIG_STATIC_ALLOC
+#define PIPELINE_BUFFER_LEN (MWIFI_PAYLOAD_LEN + 1)
+static char *pipeline_pool = NULL;
+static QueueHandle_t pipeline_pool_free = NULL;
+#endif
+static esp_timer_handle_t pipeline_stats_timer = NULL;
+
+
+/**
+ * @brief Buffer of a packet or message moving through the pipeline. In static
+ *        mode they come from a pool claimed from the static budget, the heap
+ *        is only used once the pool is exhausted, or for oversized payloads.
+ */
+static char *pipeline_alloc(size_t size) {
+#ifdef CONFIG_STATIC_ALLOC
+    char *buffer = NULL;
+    if (size <= PIPELINE_BUFFER_LEN && xQueueReceive(pipeline_pool_free, &buffer, 0) == pdTRUE)
+        return buffer;
+#endif
+    return HOTPATH_MALLOC(HEAP_TAG_PIPELINE, size);
+}
+
+/**
+ * @brief Release a buffer of pipeline_alloc(), or a payload allocated elsewhere
+ *        and moved to the pipeline.
+ */
+static void pipeline_free(char *buffer) {
+#ifdef CONFIG_STATIC_ALLOC
+    if (buffer >= pipeline_pool && buffer < pipeline_pool + CONFIG_STATIC_ALLOC_PIPELINE_BUFFERS * PIPELINE_BUFFER_LEN) {
+        xQueueSend(pipeline_pool_free, &buffer, 0);
+        return;
+    }
+#endif
+    HEAP_FREE(buffer);
+}
+
+static inline void pipeline_stage_account(pipeline_stage_id_t id, int64_t start_us) {
+    pipeline_stages[id].busy_us += esp_timer_get_time() - start_us;
+    pipeline_stages[id].processed++;
+}
+
+/**
+ * @brief Hand a packet read from the mesh over to the encode stage.
+ *
+ * Never blocks: when the encode stage lags behind the packet is dropped and
+ * accounted, so that the RX stage keeps draining the mesh.
+ */
+static mdf_err_t pipeline_submit(const uint8_t *src_addr, const mwifi_data_type_t *data_type,
+        const char *data, size_t size) {
+    packet_t packet = {
+        .data_type = *data_type,
+        .size      = size,
+    };
+    memcpy(packet.src_addr, src_addr, MWIFI_ADDR_LEN);
+
+    packet.data = pipeline_alloc(size + 1);
+    MDF_ERROR_CHECK(!packet.data, MDF_ERR_NO_MEM, "Allocate pipeline packet, size: %d", size);
+    memcpy(packet.data, data, size);
+    packet.data[size] = '\0';
+
+    if (xQueueSend(encode_queue, &packet, 0) != pdTRUE) {
+        pipeline_stages[PIPELINE_STAGE_RX].dropped++;
+        pipeline_free(packet.data);
+        return MDF_FAIL;
+    }
+
+    return MDF_OK;
+}
+
+/**
+ * @brief Hand a payload over to the TX stage, which publishes and then releases it.
+ *        It is released right away when the TX stage lags behind.
+ */
+static mdf_err_t pipeline_forward(mqtt_topic_t topic, char *payload, size_t size) {
+    pipeline_message_t message = {
+        .topic = topic,
+        .size  = size,
+        .data = payload,
+    };
+
+    if (xQueueSend(tx_queue, &message, 0) != pdTRUE) {
+        pipeline_stages[PIPELINE_STAGE_ENCODE].dropped++;
+        pipeline_free(message.data);
+        return MDF_FAIL;
+    }
+
+    return MDF_OK;
+}
+
+/**
+ * @brief Stamp a reading taken before its node had the time with the time of
+ *        arrival, which is the best estimate left. Readings stay unstamped, with
+ *        a zero timestamp, as long as the root itself has no time.
+ */
+static void pipeline_restamp(packet_t *packet) {
+    const char *timestamp = strstr(packet->data, "\"timestamp\"");
+    if (!timestamp || !meshtime_synced())
+        return;
+
+    timestamp += strlen("\"timestamp\"");
+    timestamp += strspn(timestamp, " :");
+    if (timestamp[0] != '0' || (timestamp[1] >= '0' && timestamp[1] <= '9'))
+        return;
+
+    // the time of arrival is spliced in place of the zero
+    char stamp[16];
+    int stamp_len = snprintf(stamp, sizeof(stamp), "%lld", meshtime_now_us() / 1000000);
+    size_t head   = timestamp - packet->data;
+    size_t len    = strlen(packet->data);
+    char *data    = pipeline_alloc(len + stamp_len);
+    MDF_ERROR_CHECK(!data, , "Allocate restamped reading, size: %d", len);
+
+    memcpy(data, packet->data, head);
+    memcpy(data + head, stamp, stamp_len);
+    strcpy(data + head + stamp_len, timestamp + 1);
+    pipeline_free(packet->data);
+    packet->data = data;
+    packet->size = len - 1 + stamp_len;
+}
+
+/**
+ * @brief Root handler of MQTT_SEND packets, which carry a reading of a node.
+ */
+static mdf_err_t root_mqtt_send_handler(packet_t *packet) {
+    MDF_LOGD("Receive MQTT_SEND packet from [NODE] addr: " MACSTR ", size: %d, data: %s",
+             MAC2STR(packet->src_addr), packet->size, packet->data);
+    pipeline_restamp(packet);
+    size_t len = strnlen(packet->data, packet->size);
+#ifdef CONFIG_INFLUX_SINK_ENABLE
+    influx_sink_write(packet->data, len);
+#endif
+#if !defined(CONFIG_INFLUX_SINK_ENABLE) || defined(CONFIG_INFLUX_SINK_MQTT_MIRROR)
+    // the payload buffer is moved to the TX stage, which releases it
+    pipeline_forward(MQTT_TOPIC_READING, packet->data, len);
+    packet->data = NULL;
+#endif
+    return MDF_OK;
+}
+
+static void root_encode_task(void *arg) {
+    packet_t packet = {0};
+
+    MDF_LOGI("Root encode task is running");
+
+    for (;;) {
+        if (xQueueReceive(encode_queue, &packet, portMAX_DELAY) != pdTRUE)
+            continue;
+
+        int64_t start_us = esp_timer_get_time();
+        packet_dispatch(PACKET_TABLE_ROOT, &packet);
+        pipeline_free(packet.data);
+        pipeline_stage_account(PIPELINE_STAGE_ENCODE, start_us);
+    }
+}
+
+/**
+ * @brief Hand a message over to the new root, once this node is no longer root.
+ */
+static mdf_err_t pipeline_handoff(const pipeline_message_t *message) {
+    char *data = pipeline_alloc(sizeof(handoff_header_t) + message->size);
+    MDF_ERROR_CHECK(!data, MDF_ERR_NO_MEM, "Allocate handoff message, size: %d", message->size);
+    handoff_header_t *header = (handoff_header_t *)data;
+    mwifi_data_type_t data_type = {
+        .compression = true,
+        .custom = ROOT_HANDOFF,
+    };
+
+    header->version = HANDOFF_VERSION;
+    header->kind    = HANDOFF_MESSAGE;
+    header->topic   = message->topic;
+    header->count   = 1;
+    memcpy(data + sizeof(handoff_header_t), message->data, message->size);
+
+    mdf_err_t ret = mwifi_write(NULL, &data_type, data, sizeof(handoff_header_t) + message->size, true);
+    pipeline_free(data);
+    return ret;
+}
+
+static void mqtt_tx_task(void *arg) {
+    pipeline_message_t message = {0};
+
+    MDF_LOGI("MQTT TX task is running");
+
+    for (;;) {
+        if (xQueueReceive(tx_queue, &message, portMAX_DELAY) != pdTRUE)
+            continue;
+
+        int64_t start_us = esp_timer_get_time();
+        if (!esp_mesh_is_root()) {
+            // what this node buffered as root goes to the new root rather than being lost
+            if (pipeline_handoff(&message) != MDF_OK)
+                pipeline_stages[PIPELINE_STAGE_TX].dropped++;
+        } else if (mqtt_publish_to(message.topic, message.data, message.size) < 0) {
+            pipeline_stages[PIPELINE_STAGE_TX].dropped++;
+        } else if (pipeline_takeover_us) {
+            MDF_LOGI("First publish %lld ms after the root takeover, IP after %lld ms",
+                     (start_us - pipeline_takeover_us) / 1000,
+                     pipeline_got_ip_us ? (pipeline_got_ip_us - pipeline_takeover_us) / 1000 : -1);
+            pipeline_takeover_us = 0;
+        }
+        pipeline_free(message.data);
+        pipeline_stage_account(PIPELINE_STAGE_TX, start_us);
+    }
+}
+
+/**
+ * @brief Fill of the queues of the root pipeline, in percent of the fullest one.
+ */
+static int pipeline_congestion(void) {
+    UBaseType_t waiting = 0;
+
+    if (encode_queue)
+        waiting = uxQueueMessagesWaiting(encode_queue);
+    if (tx_queue && uxQueueMessagesWaiting(tx_queue) > waiting)
+        waiting = uxQueueMessagesWaiting(tx_queue);
+    return waiting * 100 / CONFIG_PIPELINE_QUEUE_LEN;
+}
+
+/**
+ * @brief Periodically log the utilization of every stage, that is the share of
+ *        wall-clock time spent working rather than waiting on its input.
+ */
+static void pipeline_stats_report(void *arg) {
+    const int64_t period_us = (int64_t)CONFIG_PIPELINE_STATS_PERIOD_MS * 1000;
+    QueueHandle_t inbox[PIPELINE_STAGE_MAX] = {NULL, encode_queue, tx_queue};
+
+    for (int id = 0; id < PIPELINE_STAGE_MAX; id++) {
+        pipeline_stage_t *stage = &pipeline_stages[id];
+        int64_t busy_us    = stage->busy_us;
+        uint32_t processed = stage->processed;
+
+        MDF_LOGI("Pipeline stage %s, core: %d, utilization: %d%%, rate: %d/s, queued: %d, dropped: %d",
+                 stage->name, stage->core, (int)((busy_us - stage->last_busy_us) * 100 / period_us),
+                 (int)((processed - stage->last_processed) * 1000 / CONFIG_PIPELINE_STATS_PERIOD_MS),
+                 inbox[id] ? (int)uxQueueMessagesWaiting(inbox[id]) : 0, stage->dropped);
+
+        stage->last_busy_us   = busy_us;
+        stage->last_processed = processed;
+    }
+
+    packet_log_stats(PACKET_TABLE_ROOT);
+    mqtt_log_stats();
+}
+
+/**
+ * @brief Mark this node taking over as root, the time to the first publish is logged.
+ */
+void pipeline_mark_takeover(void) {
+    pipeline_takeover_us = esp_timer_get_time();
+    pipeline_got_ip_us   = 0;
+}
+
+void pipeline_mark_got_ip(void) {
+    pipeline_got_ip_us = esp_timer_get_time();
+    if (!pipeline_takeover_us)
+        pipeline_takeover_us = pipeline_got_ip_us;
+}
+
+static void pipeline_start_stage(pipeline_stage_id_t id, TaskFunction_t task) {
+    pipeline_stage_t *stage = &pipeline_stages[id];
+    if (supervisor_running(stage->task))
+        return;
+
+    MDF_LOGD("Running %s on core %d ...", stage->name, stage->core);
+    supervisor_start(stage->task, task);
+}
+
+/**
+ * @brief Create the queues and the downstream stages of the root pipeline.
+ *
+ * The encode and TX stages outlive mesh reconnections, so they are created
+ * once; the RX stage is (re)started by run_root_reader_task().
+ */
+void pipeline_start(void) {
+    if (!encode_queue)
+        encode_queue = staticmem_queue("encode_queue", CONFIG_PIPELINE_QUEUE_LEN, sizeof(packet_t));
+    if (!tx_queue)
+        tx_queue = staticmem_queue("tx_queue", CONFIG_PIPELINE_QUEUE_LEN, sizeof(pipeline_message_t));
+#ifdef CONFIG_STATIC_ALLOC
+    if (!pipeline_pool_free) {
+        pipeline_pool      = staticmem_alloc("pipeline_pool", CONFIG_STATIC_ALLOC_PIPELINE_BUFFERS * PIPELINE_BUFFER_LEN);
+        pipeline_pool_free = staticmem_queue("pipeline_pool", CONFIG_STATIC_ALLOC_PIPELINE_BUFFERS, sizeof(char *));
+        for (int i = 0; i < CONFIG_STATIC_ALLOC_PIPELINE_BUFFERS; i++) {
+            char *buffer = pipeline_pool + i * PIPELINE_BUFFER_LEN;
+            xQueueSend(pipeline_pool_free, &buffer, 0);
+        }
+    }
+#endif
+
+#ifdef CONFIG_INFLUX_SINK_ENABLE
+    influx_sink_start();
+#endif
+    packet_register(PACKET_TABLE_ROOT, MQTT_SEND, "MQTT_SEND", root_mqtt_send_handler);
+    pipeline_start_stage(PIPELINE_STAGE_ENCODE, root_encode_task);
+    pipeline_start_stage(PIPELINE_STAGE_TX, mqtt_tx_task);
+
+    if (!pipeline_stats_timer) {
+        esp_timer_create_args_t timer_args = {
+            .callback = pipeline_stats_report,
+            .name     = "pipeline_stats",
+        };
+        ESP_ERROR_CHECK(esp_timer_create(&timer_args, &pipeline_stats_timer));
+        ESP_ERROR_CHECK(esp_timer_start_periodic(pipeline_stats_timer,
+                        (uint64_t)CONFIG_PIPELINE_STATS_PERIOD_MS * 1000));
+    }
+}
@@ -5,6 +5,7 @@
 #include "string.h"
 
 #include "mwifi.h"
+#include "mdf_info_store.h"
 
 #include "esp_log.h"
 
@@ -20,25 +21,124 @@
     #define SCL_GPIO 22
 #endif
 
+#define SAMPLING_CONFIG_KEY "sampling_cfg"
+#define SAMPLING_SLOT_KEY "sampling_slot"
+#define SAMPLING_SLOTS 1000     /* transmit phases within a period */
+#define DEADBAND_HEARTBEAT 60   /* readings skipped at most in a row because of the deadband */
+
 bool is_running = true;
 
-static const char *TAG = "MESH";
+/**
+ * @brief Sampling parameters, tunable at runtime through downlink commands and
+ *        kept in NVS across reboots.
+ */
+typedef struct {
+    uint32_t period_ms;
+    uint8_t resolution;     /* ina219_resolution_t, for both bus and shunt voltage */
+    uint32_t deadband;      /* in mV, mA or mW by channel, 0 sends every reading */
+} sampling_config_t;
+
+static sampling_config_t sampling_config = {
+    .period_ms  = 1000,
+    .resolution = INA219_RES_12BIT_1S,
+    .deadband   = 0,
+};
+static int32_t sampling_slot = -1;  /* assigned by the root, -1 derives it from the MAC */
+static uint32_t sampling_throttle_ms = 0;   /* period floor set by the root ingress, never saved */
+static int64_t sampling_throttle_us = 0;    /* when the last hint arrived */
+static volatile bool sampling_reconfigure = false;
+static volatile bool sampling_snapshot = false;
+static void *sampling_buffer = NULL;
+
+/**
+ * @brief Wake up the sampler, e.g. to take a snapshot or apply a new period.
+ */
+static void sampling_wakeup(void) {
+    TaskHandle_t handle = supervisor_handle(SUPERVISOR_INA219);
+    if (handle)
+        xTaskNotifyGive(handle);
+}
+
+/**
+ * @brief Transmit phase of this node within the period, in thousandths.
+ */
+static uint32_t sampling_phase(void) {
+    uint8_t self_addr[MWIFI_ADDR_LEN] = {0};
+    uint32_t hash = 2166136261u;
+
+    if (sampling_slot >= 0)
+        return sampling_slot;
+
+    esp_read_mac(self_addr, ESP_MAC_WIFI_STA);
+    for (int i = 0; i < MWIFI_ADDR_LEN; i++)
+        hash = (hash ^ self_addr[i]) * 16777619u;
+    return hash % SAMPLING_SLOTS;
+}
+
+/**
+ * @brief Sleep until the slot of this node in the next period, unless woken up
+ *        early by a downlink command.
+ *
+ * Periods are aligned on the mesh time, so that the nodes send at their own
+ * phase rather than in bursts right after the root got its IP.
+ */
+static void sampling_sleep(uint32_t period_ms) {
+    int64_t now_ms  = meshtime_now_us() / 1000;
+    int64_t phase   = (int64_t)period_ms * sampling_phase() / SAMPLING_SLOTS;
+    int64_t next_ms = ((now_ms - phase) / period_ms + 1) * period_ms + phase;
+
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(next_ms - now_ms));
+}
+
+#define SAMPLING_THROTTLE_PERIODS 4    /* throttled periods without a hint before the floor is dropped */
+
+/**
+ * @brief Sampling period, raised to the throttle of the root and stretched while
+ *        the mesh is congested. The root re-sends the hint while the node is over
+ *        rate, so a floor with no hint for SAMPLING_THROTTLE_PERIODS expires.
+ */
+static uint32_t sampling_period_ms(void) {
+    uint32_t period_ms = sampling_config.period_ms;
+    uint32_t throttle_ms = sampling_throttle_ms;
+    if (throttle_ms && esp_timer_get_time() - sampling_throttle_us > (int64_t)throttle_ms * 1000 * SAMPLING_THROTTLE_PERIODS) {
+        MDF_LOGI("Throttle hint expired, sampling period: %d ms", sampling_config.period_ms);
+        sampling_throttle_ms = throttle_ms = 0;
+    }
+    if (throttle_ms > period_ms)
+        period_ms = throttle_ms;
+    return congestion_stretch(period_ms);
+}
+
+/**
+ * @brief Whether no channel moved past the deadband since the last reading sent.
+ *        The channels come in V, mV, mA and mW: the bus voltage is brought to mV,
+ *        so that the deadband means the same on every channel.
+ */
+static bool sampling_in_deadband(const float *values, const float *sent, int count) {
+    static const float to_milli[] = {1000, 1, 1, 1};    /* bus V, shunt mV, current mA, power mW */
+    uint32_t deadband = congestion_stretch(sampling_config.deadband);
+
+    for (int i = 0; i < count; i++) {
+        float delta = (values[i] - sent[i]) * to_milli[i];
+        if (delta > deadband || -delta > deadband)
+            return false;
+    }
+    return true;
+}
 
 void ina219_task(void *pvParameters) {
     MDF_LOGI("INA219 task is running");
 
     mdf_err_t ret = MDF_OK;
     uint32_t timestamp;
-    char *data = MDF_MALLOC(MWIFI_PAYLOAD_LEN);
+    char *data = staticmem_buffer(&sampling_buffer, "ina219_task", MWIFI_PAYLOAD_LEN);
     size_t size = MWIFI_PAYLOAD_LEN;
+    char *payload = data + sizeof(frame_header_t);  // the JSON reading follows the frame header
+    size_t frame_size = 0;
     mwifi_data_type_t data_type = {
         .compression = true,
         .custom = MQTT_SEND,
     };
-    cJSON *json_root = NULL;
-    cJSON *json_data = NULL;
-
-    time_t now = 0;
 
     ina219_t dev;
     memset(&dev, 0, sizeof(ina219_t));
@@ -49,24 +149,49 @@ void ina219_task(void *pvParameters) {
 
     ESP_LOGD(TAG, "Configuring INA219");
     ESP_ERROR_CHECK(ina219_configure(&dev, INA219_BUS_RANGE_16V, INA219_GAIN_0_125,
-            INA219_RES_12BIT_1S, INA219_RES_12BIT_1S, INA219_MODE_CONT_SHUNT_BUS));
+            sampling_config.resolution, sampling_config.resolution, INA219_MODE_CONT_SHUNT_BUS));
 
     ESP_LOGD(TAG, "Calibrating INA219");
     ESP_ERROR_CHECK(ina219_calibrate(&dev, 5.0, 0.1)); // 5A max current, 0.1 Ohm shunt resistance
 
     float bus_voltage, shunt_voltage, current, power;
+    float sent[4] = {0};
+    int skipped = DEADBAND_HEARTBEAT;
+    uint32_t period_ms = sampling_config.period_ms;
     char ina219_buffer[1024];
 
     ESP_LOGD(TAG, "Starting the INA219 loop");
     while (mwifi_is_connected()) {
+        if (sampling_reconfigure) {
+            sampling_reconfigure = false;
+            ESP_LOGI(TAG, "Reconfiguring INA219, resolution: %d", sampling_config.resolution);
+            ESP_ERROR_CHECK(ina219_configure(&dev, INA219_BUS_RANGE_16V, INA219_GAIN_0_125,
+                    sampling_config.resolution, sampling_config.resolution, INA219_MODE_CONT_SHUNT_BUS));
+        }
+
         ESP_ERROR_CHECK(ina219_get_bus_voltage(&dev, &bus_voltage));
         ESP_ERROR_CHECK(ina219_get_shunt_voltage(&dev, &shunt_voltage));
         ESP_ERROR_CHECK(ina219_get_current(&dev, &current));
         ESP_ERROR_CHECK(ina219_get_power(&dev, &power));
+        powersave_account(power);
+        powersave_update();
+
+        // readings that did not move past the deadband are not sent, a heartbeat one aside
+        float values[4] = {bus_voltage, shunt_voltage, current, power};
+        if (!sampling_snapshot && sampling_config.deadband && skipped < DEADBAND_HEARTBEAT &&
+            sampling_in_deadband(values, sent, 4)) {
+            skipped++;
+            sampling_sleep(sampling_period_ms());
+            continue;
+        }
+        sampling_snapshot = false;
+        skipped = 0;
+        memcpy(sent, values, sizeof(sent));
 
         // parse data to json
-        timestamp = time(&now);
-        snprintf(data, size, "{\
+        // readings taken before this node has the time are stamped by the root
+        timestamp = meshtime_synced() ? meshtime_now_us() / 1000000 : 0;
+        snprintf(payload, size - sizeof(frame_header_t), "{\
             \"measurement\": \"power_manager\",\
             \"tags\": {\
                 \"region\": \"sicily\",\
@@ -80,20 +205,25 @@ void ina219_task(void *pvParameters) {
             },\
             \"timestamp\": %d\
         }", bus_voltage, shunt_voltage, current, power, timestamp);
-        json_root = cJSON_Parse(data);
-        MDF_ERROR_CONTINUE(!json_root, "cJSON_Parse, data format error");
-        json_data = cJSON_GetObjectItem(json_root, "data");
-        char *send_data = cJSON_PrintUnformatted(json_data);
-        MDF_LOGD("Send MQTT_SEND packet to [ROOT] size: %d, data: %s", size, data);
+        frame_header_init((frame_header_t *)data);
+        frame_size = sizeof(frame_header_t) + strlen(payload);
+        MDF_LOGD("Send MQTT_SEND packet to [ROOT] size: %d, data: %s", frame_size, payload);
 
         // send data to root
-        ret = mwifi_write(NULL, &data_type, data, size, true);
-        MDF_ERROR_GOTO(ret != MDF_OK, FREE_MEM, "<%s> mwifi_root_write", mdf_err_to_name(ret));
-        
-FREE_MEM:
-        MDF_FREE(send_data);
-        
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        ret = aggregate_send(&data_type, data, frame_size);
+        if (ret == MDF_OK) {
+            fastjoin_mark_sample();
+            powersave_delivered();
+        } else {
+            MDF_LOGW("<%s> mwifi_root_write", mdf_err_to_name(ret));
+        }
+
+        // sleep until the next slot, unless woken up early by a downlink command
+        if (sampling_period_ms() != period_ms) {
+            period_ms = sampling_period_ms();
+            congestion_log_stats();
+        }
+        sampling_sleep(period_ms);
 
 
         // snprintf(ina219_buffer, sizeof(ina219_buffer), "{, \"shunt_voltage\": %.04f, \"current\": %.04f, \"power\": %.04f}", bus_voltage, shunt_voltage, current, power); // VBUS (V), VSHUNT (mV), IBUS (mA), PBUS (mW) 
@@ -103,15 +233,25 @@ FREE_MEM:
     }
 
     MDF_LOGW("YL-69 task is exit");
-    MDF_FREE(data);
-    vTaskDelete(NULL);
+    staticmem_release(&sampling_buffer);
+    supervisor_exit(SUPERVISOR_INA219, MDF_OK);
 }
 
 void powermanager_setup() {
-    ESP_ERROR_CHECK(i2cdev_init());
+    static bool i2c_ready = false;
+
+    if (!i2c_ready)
+        ESP_ERROR_CHECK(i2cdev_init());
+    i2c_ready = true;
+
+    if (mdf_info_load(SAMPLING_CONFIG_KEY, &sampling_config, sizeof(sampling_config_t)) == MDF_OK)
+        ESP_LOGI(TAG, "Sampling config restored, period: %dms, resolution: %d, deadband: %d",
+                 sampling_config.period_ms, sampling_config.resolution, sampling_config.deadband);
+
+    mdf_info_load(SAMPLING_SLOT_KEY, &sampling_slot, sizeof(sampling_slot));
+    ESP_LOGI(TAG, "Transmit phase: %d/%d", sampling_phase(), SAMPLING_SLOTS);
 }
 
 void powermanager_start() {
-    char* pc_ina219_name = "ina219_task";
-    xTaskCreate(ina219_task, pc_ina219_name, configMINIMAL_STACK_SIZE * 8, NULL, 5, NULL);
+    supervisor_start(SUPERVISOR_INA219, ina219_task);
 }
\ No newline at end of file
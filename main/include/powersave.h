@@ -0,0 +1,112 @@
+/*
+ * ESP32 Mesh Network
+ * Copyright 2021, FCRLab at University of Messina (Messina, Italy)
+ *
+ * @maintainer: Lorenzo Carnevale <lcarnevale@unime.it>
+ */
+
+#include "esp_timer.h"
+#include "mwifi.h"
+
+/**
+ * @brief Duty-cycled power save.
+ *
+ * With ESP-MESH power save a node keeps its radio on only for a share of every
+ * beacon interval. Leaf nodes ask for CONFIG_POWERSAVE_LEAF_DUTY percent, nodes
+ * with children for CONFIG_POWERSAVE_DUTY percent as they forward for their
+ * subtree, the root never sleeps. The duty cycle follows the role of the node,
+ * which is checked at every reading.
+ *
+ * A leaf packs its frames into batches of CONFIG_POWERSAVE_BATCH, sent at its
+ * transmit slot (see aggregate_send()), so the radio wakes up once per batch
+ * rather than once per reading.
+ *
+ * The sampler integrates the power read by the INA219 of the node, which gives
+ * the energy spent per delivered reading, sent in the health frame.
+ */
+typedef struct {
+    int64_t last_us;        /* time of the last power reading, 0 before the first one */
+    double energy_uj;       /* integrated since boot */
+    uint32_t delivered;     /* readings handed to the mesh */
+} powersave_energy_t;
+
+static powersave_energy_t powersave_energy = {0};
+static portMUX_TYPE powersave_lock = portMUX_INITIALIZER_UNLOCKED;
+static int powersave_role = -1;     /* 1 leaf, 0 forwarding node or root, -1 unknown */
+
+
+/**
+ * @brief Enable the mesh power save, before the mesh is started.
+ */
+void powersave_enable(void) {
+#ifdef CONFIG_POWERSAVE_ENABLE
+    MDF_ERROR_ASSERT(esp_mesh_enable_ps());
+    MDF_LOGI("Mesh power save enabled, duty: %d%%, leaf duty: %d%%",
+             CONFIG_POWERSAVE_DUTY, CONFIG_POWERSAVE_LEAF_DUTY);
+#endif
+}
+
+/**
+ * @brief Whether this node is a leaf running in power save.
+ */
+static bool powersave_leaf(void) {
+#ifdef CONFIG_POWERSAVE_ENABLE
+    return powersave_role == 1;
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief Set the duty cycle matching the current role of the node.
+ */
+void powersave_update(void) {
+#ifdef CONFIG_POWERSAVE_ENABLE
+    if (!mwifi_is_connected())
+        return;
+
+    int role = !esp_mesh_is_root() && esp_mesh_get_routing_table_size() <= 1;
+    if (role == powersave_role)
+        return;
+
+    int duty = role ? CONFIG_POWERSAVE_LEAF_DUTY : CONFIG_POWERSAVE_DUTY;
+    mdf_err_t ret = esp_mesh_set_active_duty_cycle(duty, MESH_PS_DEVICE_DUTY_DEMAND);
+    MDF_ERROR_CHECK(ret != MDF_OK, , "<%s> esp_mesh_set_active_duty_cycle", mdf_err_to_name(ret));
+
+    powersave_role = role;
+    MDF_LOGI("Duty cycle: %d%% as %s", duty, role ? "leaf" : "forwarding node");
+#endif
+}
+
+/**
+ * @brief Integrate a power reading, in W, since the previous one.
+ */
+void powersave_account(float power) {
+    int64_t now_us = esp_timer_get_time();
+
+    portENTER_CRITICAL(&powersave_lock);
+    if (powersave_energy.last_us && power > 0)
+        powersave_energy.energy_uj += (double)power * (now_us - powersave_energy.last_us);
+    powersave_energy.last_us = now_us;
+    portEXIT_CRITICAL(&powersave_lock);
+}
+
+void powersave_delivered(void) {
+    portENTER_CRITICAL(&powersave_lock);
+    powersave_energy.delivered++;
+    portEXIT_CRITICAL(&powersave_lock);
+}
+
+/**
+ * @brief Energy spent per delivered reading, in uJ, 0 before the first one.
+ */
+uint32_t powersave_energy_per_sample(void) {
+    uint32_t energy = 0;
+
+    portENTER_CRITICAL(&powersave_lock);
+    if (powersave_energy.delivered)
+        energy = powersave_energy.energy_uj / powersave_energy.delivered;
+    portEXIT_CRITICAL(&powersave_lock);
+
+    return energy;
+}
@@ -1,3 +1,200 @@
+/**
+ * @brief Packet types, carried in data_type.custom. They index the dispatch
+ *        tables, so keep them below PACKET_TYPE_MAX.
+ */
 enum Packet {
-    MQTT_SEND       = 10
-};
\ No newline at end of file
+    TEXT_COMMAND    = 0,    /* plain text commands sent by the root, e.g. "restart" */
+    MQTT_SEND       = 10,
+    MQTT_AGGREGATE  = 11,   /* MQTT_SEND frames of a subtree, batched by an intermediate node */
+    DOWNLINK_COMMAND = 12,  /* downlink_command_t sent by the root */
+    COMMAND_ACK     = 13,   /* command_ack_t sent back by the nodes */
+    TIME_BEACON     = 14,   /* mesh time, see meshtime.h */
+    TIME_REQUEST    = 15,
+    TIME_RESPONSE   = 16,
+    HEALTH          = 17,   /* health_frame_t sent periodically by the nodes */
+    ROOT_HANDOFF    = 18,   /* state handed over by a former root, see failover.h */
+    OTA_DATA        = 19,   /* firmware streamed by the root, see ota.h */
+    OTA_REPORT      = 20    /* ota_report_t sent back by the nodes */
+};
+
+#define PACKET_TYPE_MAX 32
+
+/**
+ * @brief Commands the root can send to the nodes, see downlink.h.
+ */
+enum Command {
+    CMD_SET_PERIOD      = 1,    /* sampling period, in ms */
+    CMD_SET_RESOLUTION  = 2,    /* INA219 ADC resolution and averaging, an ina219_resolution_t */
+    CMD_SET_DEADBAND    = 3,    /* change below which readings are not sent, in thousandths of unit */
+    CMD_REQUEST_SNAPSHOT = 4,   /* send a reading right away */
+    CMD_RESTART         = 5,
+    CMD_JOIN_GROUP      = 6,    /* join the mesh group whose id is derived from the value */
+    CMD_LEAVE_GROUP     = 7,
+    CMD_THROTTLE        = 8,    /* sampling period floor asked by the root ingress, in ms */
+    CMD_CONGESTION      = 9,    /* the root ingress is congested, the value is its queue fill in % */
+    CMD_SET_SLOT        = 10,   /* transmit phase within the period, in thousandths, -1 derives it from the MAC */
+};
+
+#define COMMAND_VERSION 1
+
+typedef struct {
+    uint8_t version;
+    uint8_t command;
+    uint16_t id;        /* chosen by the root */
+    int32_t value;
+} __attribute__((packed)) downlink_command_t;
+
+typedef struct {
+    uint8_t version;
+    uint8_t status;     /* 0 when the command was applied */
+    uint16_t id;
+} __attribute__((packed)) command_ack_t;
+
+#define HEALTH_VERSION 4
+#define HEALTH_FLAG_ROOT    0x01
+#define HEALTH_FLAG_SYNCED  0x02    /* the node has the wall-clock time */
+#define HEALTH_FLAG_POWERSAVE 0x04  /* the node is a leaf duty-cycling its radio */
+#define HEALTH_HEAP_TAGS 8          /* heap_tag_t, see heapstats.h */
+
+typedef struct {
+    uint32_t live;          /* bytes */
+    uint32_t peak;
+    uint32_t allocs;
+} __attribute__((packed)) health_heap_t;
+
+/**
+ * @brief Runtime state of a node, see health.h.
+ */
+typedef struct {
+    uint8_t version;
+    uint8_t flags;
+    uint8_t layer;
+    int8_t rssi;            /* of the link to the parent, in dBm */
+    uint8_t parent[6];      /* station MAC address of the parent */
+    uint16_t subtree;       /* nodes of the subtree, this one excluded */
+    uint32_t uptime_s;
+    uint32_t free_heap;
+    uint32_t min_free_heap;
+    uint16_t stack_hwm;     /* lowest stack headroom of the tasks of the node, in bytes */
+    uint8_t work_queued;
+    uint8_t aggregate_queued;
+    uint32_t writes;        /* upstream writes */
+    uint16_t write_failures;
+    uint16_t backoff_scale; /* congestion backoff, in thousandths */
+    uint16_t rx_errors;     /* packets the node failed to handle */
+    uint32_t energy_uj;     /* spent per delivered reading, 0 if unknown */
+    health_heap_t heap[HEALTH_HEAP_TAGS];   /* zero without heap accounting */
+} __attribute__((packed)) health_frame_t;
+
+#define HANDOFF_VERSION 1
+
+enum Handoff {
+    HANDOFF_MESSAGE = 1,    /* an MQTT message not published yet, the header is followed by its payload */
+    HANDOFF_NODES   = 2,    /* the header is followed by count handoff_node_t */
+    HANDOFF_SLOTS   = 3,    /* the header is followed by the uint32_t transmit slots handed out */
+};
+
+typedef struct {
+    uint8_t version;
+    uint8_t kind;
+    uint8_t topic;      /* mqtt_topic_t of a HANDOFF_MESSAGE */
+    uint8_t count;
+} __attribute__((packed)) handoff_header_t;
+
+/**
+ * @brief Sequence state of a node, so that the new root does not count gaps
+ *        or restarts when it takes over.
+ */
+typedef struct {
+    uint8_t addr[6];
+    uint16_t boot_id;
+    uint32_t last_seq;
+    uint32_t window;
+    uint8_t slotted;
+} __attribute__((packed)) handoff_node_t;
+
+#define OTA_VERSION     2
+#define OTA_CHUNK_SIZE  1024
+#define OTA_FLAG_DELTA  0x01    /* the image is a patch against the running firmware */
+#define OTA_REPORT_MISSING_MAX 64
+
+/**
+ * @brief Kinds of OTA_DATA packets, see ota.h.
+ */
+enum OtaKind {
+    OTA_BEGIN   = 1,    /* a new image follows */
+    OTA_CHUNK   = 2,    /* OTA_CHUNK_SIZE bytes of the image, the last chunk may be shorter */
+    OTA_END     = 3,    /* the whole image was sent, carries its SHA-256; the nodes answer with a report */
+    OTA_COMMIT  = 4,    /* boot the new image */
+};
+
+typedef struct {
+    uint8_t version;
+    uint8_t kind;
+    uint16_t session;   /* chosen by the root for every upgrade */
+    uint32_t size;      /* of the image, so that a node which missed OTA_BEGIN still joins */
+    uint32_t index;     /* OTA_CHUNK: chunk number, OTA_COMMIT: delay before restarting, in ms */
+    uint8_t flags;
+} __attribute__((packed)) ota_header_t;
+
+enum OtaStatus {
+    OTA_STATUS_MISSING  = 0,    /* chunks are missing, the first ones are listed */
+    OTA_STATUS_VERIFIED = 1,    /* the image is complete and its hash matches */
+    OTA_STATUS_CORRUPT  = 2,    /* the hash does not match, the image is received again */
+    OTA_STATUS_FAILED   = 3,    /* the node cannot store the image, or run another firmware than the patch base */
+};
+
+/**
+ * @brief Answer of a node to OTA_END, followed by the first missing chunks,
+ *        up to OTA_REPORT_MISSING_MAX of them.
+ */
+typedef struct {
+    uint8_t version;
+    uint8_t status;
+    uint16_t session;
+    uint16_t received;      /* chunks */
+    uint16_t missing_num;   /* all the missing chunks, listed or not */
+} __attribute__((packed)) ota_report_t;
+
+#define FRAME_MAGIC     0xA5
+#define FRAME_VERSION   1
+
+/**
+ * @brief Header prepended by the nodes to every frame sent to the root.
+ *
+ * The magic byte tells framed payloads apart from the bare JSON sent by older
+ * firmwares. The boot id changes at every boot, so that the root can tell a
+ * restarted sequence from a reordered one.
+ */
+typedef struct {
+    uint8_t magic;
+    uint8_t version;
+    uint16_t boot_id;
+    uint32_t seq;       /* per-node, shared by every frame type */
+} __attribute__((packed)) frame_header_t;
+
+static uint16_t frame_boot_id = 0;
+static uint32_t frame_seq = 0;
+
+/**
+ * @brief Stamp the next sequence number of this node on a frame header.
+ */
+static void frame_header_init(frame_header_t *header) {
+    if (!frame_boot_id)
+        frame_boot_id = (esp_random() & 0xfffe) + 1;
+
+    header->magic   = FRAME_MAGIC;
+    header->version = FRAME_VERSION;
+    header->boot_id = frame_boot_id;
+    header->seq     = __atomic_fetch_add(&frame_seq, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Return the header of a received frame, or NULL for legacy payloads.
+ */
+static const frame_header_t *frame_header_parse(const void *data, size_t size) {
+    const frame_header_t *header = (const frame_header_t *)data;
+    if (size < sizeof(frame_header_t) || header->magic != FRAME_MAGIC || header->version != FRAME_VERSION)
+        return NULL;
+    return header;
+}
@@ -0,0 +1,159 @@
+/*
+ * ESP32 Mesh Network
+ * Copyright 2021, FCRLab at University of Messina (Messina, Italy)
+ *
+ * @maintainer: Lorenzo Carnevale <lcarnevale@unime.it>
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+#include "stdlib.h"
+
+/**
+ * @brief Static allocation mode.
+ *
+ * With CONFIG_STATIC_ALLOC the stacks of the long-lived tasks, the queues and
+ * the buffers the tasks keep for their whole life are carved out of an arena of
+ * CONFIG_STATIC_ALLOC_BUDGET bytes instead of the heap. Every one of them is
+ * claimed once and kept across restarts of its task, so that the heap does not
+ * fragment under them. Running out of the budget is fatal and tells by how much
+ * it is short, most of it is claimed at boot. Without CONFIG_STATIC_ALLOC the
+ * same calls fall back to the heap.
+ *
+ * Allocations left on the hot paths, i.e. done per packet or per reading, go
+ * through HOTPATH_MALLOC() or staticmem_hotpath(), which count them once the
+ * boot is over; with CONFIG_STATIC_ALLOC_ASSERT any of them is fatal. The cJSON
+ * allocations are only tagged, through hooks: the JSON built or parsed on the
+ * mesh goes with the periodic reports and the MQTT commands, not per reading.
+ */
+#define HOTPATH_MALLOC(tag, size) (staticmem_hotpath(__func__), HEAP_MALLOC(tag, size))
+
+typedef struct {
+    size_t used;
+    bool booted;
+    uint32_t hotpath_allocs;    /* heap allocations on the hot paths after boot */
+    const char *hotpath_last;   /* function of the last one */
+} staticmem_stats_t;
+
+#ifdef CONFIG_STATIC_ALLOC
+static uint8_t staticmem_arena[CONFIG_STATIC_ALLOC_BUDGET] __attribute__((aligned(8)));
+#endif
+static staticmem_stats_t staticmem = {0};
+static portMUX_TYPE staticmem_lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+/**
+ * @brief Claim a block of the budget, for good.
+ */
+static void *staticmem_alloc(const char *name, size_t size) {
+#ifdef CONFIG_STATIC_ALLOC
+    size = (size + 7) & ~7;
+
+    portENTER_CRITICAL(&staticmem_lock);
+    size_t offset = staticmem.used;
+    bool fits = offset + size <= CONFIG_STATIC_ALLOC_BUDGET;
+    if (fits)
+        staticmem.used += size;
+    portEXIT_CRITICAL(&staticmem_lock);
+
+    if (!fits) {
+        MDF_LOGE("Static budget exceeded by %d bytes claiming %s, raise CONFIG_STATIC_ALLOC_BUDGET",
+                 offset + size - CONFIG_STATIC_ALLOC_BUDGET, name);
+        abort();
+    }
+
+    MDF_LOGD("Static %s: %d bytes, used: %d/%d", name, size, staticmem.used, CONFIG_STATIC_ALLOC_BUDGET);
+    return staticmem_arena + offset;
+#else
+    return HEAP_MALLOC(HEAP_TAG_TASKS, size);
+#endif
+}
+
+/**
+ * @brief Buffer kept by a task: claimed from the budget the first time, from the
+ *        heap at every start without CONFIG_STATIC_ALLOC.
+ */
+static void *staticmem_buffer(void **slot, const char *name, size_t size) {
+#ifdef CONFIG_STATIC_ALLOC
+    if (!*slot)
+        *slot = staticmem_alloc(name, size);
+#else
+    *slot = HEAP_MALLOC(HEAP_TAG_TASKS, size);
+#endif
+    return *slot;
+}
+
+/**
+ * @brief Give back a buffer of staticmem_buffer(), which stays claimed in static mode.
+ */
+static void staticmem_release(void **slot) {
+#ifndef CONFIG_STATIC_ALLOC
+    HEAP_FREE(*slot);
+#endif
+}
+
+static QueueHandle_t staticmem_queue(const char *name, UBaseType_t length, UBaseType_t item_size) {
+#ifdef CONFIG_STATIC_ALLOC
+    StaticQueue_t *queue = staticmem_alloc(name, sizeof(StaticQueue_t));
+    uint8_t *storage     = staticmem_alloc(name, length * item_size);
+    return xQueueCreateStatic(length, item_size, storage, queue);
+#else
+    return xQueueCreate(length, item_size);
+#endif
+}
+
+/**
+ * @brief Account a heap allocation on a hot path.
+ */
+static void staticmem_hotpath(const char *where) {
+    if (!staticmem.booted)
+        return;
+
+    portENTER_CRITICAL(&staticmem_lock);
+    staticmem.hotpath_allocs++;
+    staticmem.hotpath_last = where;
+    portEXIT_CRITICAL(&staticmem_lock);
+
+#ifdef CONFIG_STATIC_ALLOC_ASSERT
+    MDF_LOGE("Heap allocation on a hot path after boot in %s", where);
+    abort();
+#endif
+}
+
+static void *staticmem_json_malloc(size_t size) {
+    return HEAP_MALLOC(HEAP_TAG_JSON, size);
+}
+
+static void staticmem_json_free(void *ptr) {
+    HEAP_FREE(ptr);
+}
+
+/**
+ * @brief Route the cJSON allocations through the heap tags, first thing at boot.
+ */
+void staticmem_init(void) {
+    cJSON_Hooks hooks = {
+        .malloc_fn = staticmem_json_malloc,
+        .free_fn   = staticmem_json_free,
+    };
+    cJSON_InitHooks(&hooks);
+}
+
+/**
+ * @brief The boot is over: from now on hot path allocations are accounted.
+ */
+void staticmem_boot_done(void) {
+    staticmem.booted = true;
+#ifdef CONFIG_STATIC_ALLOC
+    MDF_LOGI("Static memory claimed at boot: %d/%d bytes", staticmem.used, CONFIG_STATIC_ALLOC_BUDGET);
+#endif
+}
+
+void staticmem_log_stats(void) {
+#ifdef CONFIG_STATIC_ALLOC
+    MDF_LOGI("Static memory used: %d/%d bytes", staticmem.used, CONFIG_STATIC_ALLOC_BUDGET);
+#endif
+    MDF_LOGI("Hot path heap allocations: %d, last in: %s", staticmem.hotpath_allocs,
+             staticmem.hotpath_last ? staticmem.hotpath_last : "none");
+}
@@ -0,0 +1,348 @@
+/*
+ * ESP32 Mesh Network
+ * Copyright 2021, FCRLab at University of Messina (Messina, Italy)
+ *
+ * @maintainer: Lorenzo Carnevale <lcarnevale@unime.it>
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_timer.h"
+
+/**
+ * @brief Task supervisor.
+ *
+ * Every long-lived task of the firmware has an entry here, which owns its
+ * handle. Starting a task that is running does nothing, so the owners start
+ * their tasks on every mesh event without spawning duplicates. A task exits
+ * through supervisor_exit(): a clean exit, e.g. when the mesh is gone, leaves
+ * it to its owner to start it again, a failure gets it restarted after a
+ * backoff, doubling at every failure in a row.
+ *
+ * The failed tasks are checked every CONFIG_SUPERVISOR_RESTART_MS by a task of
+ * the supervisor, outside of the entries as it must outlive them. Every
+ * CONFIG_SUPERVISOR_PERIOD_MS the stack high-water mark and the share of
+ * CPU time of every task are logged, the latter when FreeRTOS keeps run time
+ * statistics.
+ *
+ * With CONFIG_STATIC_ALLOC the stacks are claimed from the static budget at
+ * boot. The stack of a task that exited is only reused once FreeRTOS is done
+ * deleting the task, which its thread local storage callback tells.
+ */
+
+/**
+ * @brief Pipeline stages are pinned only on dual core targets and when enabled in
+ *        menuconfig, otherwise they are left free to float as before.
+ */
+#if defined(CONFIG_PIPELINE_PIN_STAGES) && portNUM_PROCESSORS > 1
+#define PIPELINE_CORE(core) (core)
+#else
+#define PIPELINE_CORE(core) tskNO_AFFINITY
+#endif
+
+#define SUPERVISOR_BACKOFF_MAX 6    /* restart delay doubles up to 2^6 times */
+#define SUPERVISOR_STACK (3*1024)
+#define SUPERVISOR_TLS_INDEX (configNUM_THREAD_LOCAL_STORAGE_POINTERS - 1)
+
+typedef enum {
+    SUPERVISOR_WORK = 0,
+    SUPERVISOR_NODE_READER,
+    SUPERVISOR_ROOT_READER,
+    SUPERVISOR_ROOT_ENCODE,
+    SUPERVISOR_MQTT_TX,
+    SUPERVISOR_AGGREGATE,
+    SUPERVISOR_MESHTIME,
+    SUPERVISOR_INA219,
+    SUPERVISOR_DOWNLINK,
+    SUPERVISOR_HEALTH,
+    SUPERVISOR_REPORT,
+    SUPERVISOR_TASK_MAX,
+} supervisor_task_id_t;
+
+typedef struct {
+    const char *name;
+    uint32_t stack;
+    UBaseType_t priority;
+    BaseType_t core;
+    bool restart;           /* restarted when it exits with an error */
+    TaskFunction_t fn;
+    TaskHandle_t handle;
+    bool starting;
+    uint8_t failures;       /* in a row */
+    int64_t restart_us;     /* when a failed task is due for restart, 0 for none */
+    uint32_t starts;
+    uint32_t restarts;
+    uint32_t last_runtime;
+#ifdef CONFIG_STATIC_ALLOC
+    StackType_t *stack_buffer;
+    StaticTask_t *tcb;
+    volatile bool zombie;   /* exited, its stack still in use until FreeRTOS deleted it */
+#endif
+} supervisor_task_t;
+
+static supervisor_task_t supervisor_tasks[SUPERVISOR_TASK_MAX] = {
+    [SUPERVISOR_WORK] = {
+        .name = "work_task", .stack = 4*1024, .priority = CONFIG_MDF_TASK_DEFAULT_PRIOTY, .core = tskNO_AFFINITY,
+    },
+    [SUPERVISOR_NODE_READER] = {
+        .name = "node_reader_task", .stack = 4*1024, .priority = CONFIG_MDF_TASK_DEFAULT_PRIOTY,
+        .core = tskNO_AFFINITY, .restart = true,
+    },
+    [SUPERVISOR_ROOT_READER] = {
+        .name = "root_reader_task", .stack = 4*1024, .priority = CONFIG_PIPELINE_RX_PRIORITY,
+        .core = PIPELINE_CORE(CONFIG_PIPELINE_RX_CORE), .restart = true,
+    },
+    [SUPERVISOR_ROOT_ENCODE] = {
+        .name = "root_encode_task", .stack = 4*1024, .priority = CONFIG_PIPELINE_ENCODE_PRIORITY,
+        .core = PIPELINE_CORE(CONFIG_PIPELINE_ENCODE_CORE),
+    },
+    [SUPERVISOR_MQTT_TX] = {
+        .name = "mqtt_tx_task", .stack = 4*1024, .priority = CONFIG_PIPELINE_TX_PRIORITY,
+        .core = PIPELINE_CORE(CONFIG_PIPELINE_TX_CORE),
+    },
+    [SUPERVISOR_AGGREGATE] = {
+        .name = "aggregate_task", .stack = 3*1024, .priority = CONFIG_MDF_TASK_DEFAULT_PRIOTY, .core = tskNO_AFFINITY,
+    },
+    [SUPERVISOR_MESHTIME] = {
+        .name = "meshtime_task", .stack = 3*1024, .priority = CONFIG_MDF_TASK_DEFAULT_PRIOTY, .core = tskNO_AFFINITY,
+    },
+    [SUPERVISOR_INA219] = {
+        .name = "ina219_task", .stack = configMINIMAL_STACK_SIZE * 8, .priority = 5, .core = tskNO_AFFINITY,
+        .restart = true,
+    },
+    [SUPERVISOR_DOWNLINK] = {
+        .name = "downlink_send_task", .stack = 3*1024, .priority = CONFIG_MDF_TASK_DEFAULT_PRIOTY,
+        .core = tskNO_AFFINITY,
+    },
+    [SUPERVISOR_HEALTH] = {
+        .name = "health_task", .stack = 3*1024, .priority = CONFIG_MDF_TASK_DEFAULT_PRIOTY, .core = tskNO_AFFINITY,
+    },
+    [SUPERVISOR_REPORT] = {
+        .name = "report_task", .stack = 4*1024, .priority = CONFIG_MDF_TASK_DEFAULT_PRIOTY, .core = tskNO_AFFINITY,
+        .restart = true,
+    },
+};
+static portMUX_TYPE supervisor_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t supervisor_task_handle = NULL;
+static int64_t supervisor_logged_us = 0;
+
+
+#ifdef CONFIG_STATIC_ALLOC
+static void supervisor_reclaimed(int index, void *arg) {
+    ((supervisor_task_t *)arg)->zombie = false;
+}
+
+static void supervisor_entry(void *arg) {
+    supervisor_task_t *task = (supervisor_task_t *)arg;
+
+    vTaskSetThreadLocalStoragePointerAndDelCallback(NULL, SUPERVISOR_TLS_INDEX, task, supervisor_reclaimed);
+    task->fn(NULL);
+}
+#endif
+
+/**
+ * @brief Start a task unless it is running, or being started by another caller.
+ */
+static mdf_err_t supervisor_start(supervisor_task_id_t id, TaskFunction_t fn) {
+    supervisor_task_t *task = &supervisor_tasks[id];
+
+    portENTER_CRITICAL(&supervisor_lock);
+    bool running = task->handle || task->starting;
+    bool deferred = false;
+#ifdef CONFIG_STATIC_ALLOC
+    // the previous instance still sits on the stack: supervisor_check() starts it later
+    deferred = !running && task->zombie;
+    running |= deferred;
+    task->zombie |= !running;
+#endif
+    task->starting = !running;
+    task->fn = fn;
+    if (!running)
+        task->restart_us = 0;
+    if (deferred)
+        task->restart_us = esp_timer_get_time();
+    portEXIT_CRITICAL(&supervisor_lock);
+
+    if (running)
+        return deferred ? MDF_ERR_INVALID_STATE : MDF_OK;
+
+    TaskHandle_t handle = NULL;
+#ifdef CONFIG_STATIC_ALLOC
+    handle = xTaskCreateStaticPinnedToCore(supervisor_entry, task->name, task->stack, task, task->priority,
+                                           task->stack_buffer, task->tcb, task->core);
+    BaseType_t ret = handle ? pdPASS : pdFAIL;
+#else
+    BaseType_t ret = xTaskCreatePinnedToCore(fn, task->name, task->stack, NULL, task->priority, &handle, task->core);
+#endif
+
+    portENTER_CRITICAL(&supervisor_lock);
+    // the task may already have exited, and cleared its own handle
+    if (ret == pdPASS && task->starting)
+        task->handle = handle;
+#ifdef CONFIG_STATIC_ALLOC
+    task->zombie &= ret == pdPASS;
+#endif
+    task->starting = false;
+    task->starts += ret == pdPASS;
+    portEXIT_CRITICAL(&supervisor_lock);
+
+    MDF_ERROR_CHECK(ret != pdPASS, MDF_ERR_NO_MEM, "Create task %s", task->name);
+    MDF_LOGD("Task %s started", task->name);
+    return MDF_OK;
+}
+
+static TaskHandle_t supervisor_handle(supervisor_task_id_t id) {
+    return supervisor_tasks[id].handle;
+}
+
+static bool supervisor_running(supervisor_task_id_t id) {
+    return supervisor_tasks[id].handle || supervisor_tasks[id].starting;
+}
+
+/**
+ * @brief Called by a task on its way out, it does not return.
+ */
+static void supervisor_exit(supervisor_task_id_t id, mdf_err_t reason) {
+    supervisor_task_t *task = &supervisor_tasks[id];
+
+    portENTER_CRITICAL(&supervisor_lock);
+    task->handle   = NULL;
+    task->starting = false;
+    if (reason == MDF_OK) {
+        task->failures = 0;
+    } else if (task->restart) {
+        int shift = task->failures < SUPERVISOR_BACKOFF_MAX ? task->failures : SUPERVISOR_BACKOFF_MAX;
+        task->restart_us = esp_timer_get_time() + ((int64_t)CONFIG_SUPERVISOR_RESTART_MS * 1000 << shift);
+        task->failures++;
+    }
+    portEXIT_CRITICAL(&supervisor_lock);
+
+    if (reason != MDF_OK)
+        MDF_LOGW("Task %s failed <%s>, failures in a row: %d%s", task->name, mdf_err_to_name(reason),
+                 task->failures, task->restart ? ", restarting" : "");
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief Stack headroom of a task in bytes, -1 when it is not running. Read under
+ *        the lock: a task clears its handle there before deleting itself.
+ */
+static int supervisor_task_hwm(supervisor_task_t *task) {
+    int hwm = -1;
+
+    portENTER_CRITICAL(&supervisor_lock);
+    if (task->handle)
+        hwm = uxTaskGetStackHighWaterMark(task->handle) * sizeof(StackType_t);
+    portEXIT_CRITICAL(&supervisor_lock);
+    return hwm;
+}
+
+/**
+ * @brief Lowest stack headroom of the running tasks, in bytes.
+ */
+static uint16_t supervisor_stack_hwm(void) {
+    int hwm = UINT16_MAX;
+
+    for (int id = 0; id < SUPERVISOR_TASK_MAX; id++) {
+        int task_hwm = supervisor_task_hwm(&supervisor_tasks[id]);
+        if (task_hwm >= 0 && task_hwm < hwm)
+            hwm = task_hwm;
+    }
+    return hwm;
+}
+
+void supervisor_log_stats(void) {
+#if configGENERATE_RUN_TIME_STATS && configUSE_TRACE_FACILITY
+    UBaseType_t count = uxTaskGetNumberOfTasks();
+    uint32_t total_runtime = 0;
+    static uint32_t last_total_runtime = 0;
+    TaskStatus_t *status = HEAP_MALLOC(HEAP_TAG_SUPERVISOR, count * sizeof(TaskStatus_t));
+    MDF_ERROR_CHECK(!status, , "Allocate task status, count: %d", count);
+    count = uxTaskGetSystemState(status, count, &total_runtime);
+    uint32_t period = total_runtime - last_total_runtime;
+    last_total_runtime = total_runtime;
+#endif
+
+    for (int id = 0; id < SUPERVISOR_TASK_MAX; id++) {
+        supervisor_task_t *task = &supervisor_tasks[id];
+        int cpu = -1;
+
+        if (!task->starts)
+            continue;
+#if configGENERATE_RUN_TIME_STATS && configUSE_TRACE_FACILITY
+        TaskHandle_t handle = task->handle;     // only compared, never dereferenced
+        for (int i = 0; i < count && handle; i++) {
+            if (status[i].xHandle != handle)
+                continue;
+            cpu = period ? (uint64_t)(status[i].ulRunTimeCounter - task->last_runtime) * 100 / period : 0;
+            task->last_runtime = status[i].ulRunTimeCounter;
+        }
+#endif
+
+        int hwm = supervisor_task_hwm(task);
+        MDF_LOGI("Task %s, running: %d, starts: %d, restarts: %d, stack hwm: %d bytes, cpu: %d%%",
+                 task->name, hwm >= 0, task->starts, task->restarts, hwm >= 0 ? hwm : 0, cpu);
+    }
+
+#if configGENERATE_RUN_TIME_STATS && configUSE_TRACE_FACILITY
+    HEAP_FREE(status);
+#endif
+    staticmem_log_stats();
+    heapstats_log_stats();
+}
+
+/**
+ * @brief Restart the failed tasks that are due, and log the statistics when it
+ *        is time to.
+ */
+static void supervisor_check(void) {
+    int64_t now_us = esp_timer_get_time();
+
+    for (int id = 0; id < SUPERVISOR_TASK_MAX; id++) {
+        supervisor_task_t *task = &supervisor_tasks[id];
+
+        portENTER_CRITICAL(&supervisor_lock);
+        bool due = task->restart_us && now_us >= task->restart_us && !task->handle && !task->starting;
+        portEXIT_CRITICAL(&supervisor_lock);
+
+        if (due && supervisor_start(id, task->fn) == MDF_OK)
+            task->restarts++;
+    }
+
+    if (now_us - supervisor_logged_us >= (int64_t)CONFIG_SUPERVISOR_PERIOD_MS * 1000) {
+        supervisor_logged_us = now_us;
+        supervisor_log_stats();
+    }
+}
+
+static void supervisor_task(void *arg) {
+    MDF_LOGI("Supervisor task is running");
+
+    for (;;) {
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_SUPERVISOR_RESTART_MS));
+        supervisor_check();
+    }
+}
+
+void supervisor_init(void) {
+    if (supervisor_task_handle)
+        return;
+
+#ifdef CONFIG_STATIC_ALLOC
+    for (int id = 0; id < SUPERVISOR_TASK_MAX; id++) {
+        supervisor_tasks[id].stack_buffer = staticmem_alloc(supervisor_tasks[id].name, supervisor_tasks[id].stack);
+        supervisor_tasks[id].tcb          = staticmem_alloc(supervisor_tasks[id].name, sizeof(StaticTask_t));
+    }
+
+    supervisor_task_handle = xTaskCreateStaticPinnedToCore(supervisor_task, "supervisor_task", SUPERVISOR_STACK, NULL,
+                                                           CONFIG_MDF_TASK_DEFAULT_PRIOTY,
+                                                           staticmem_alloc("supervisor_task", SUPERVISOR_STACK),
+                                                           staticmem_alloc("supervisor_task", sizeof(StaticTask_t)),
+                                                           tskNO_AFFINITY);
+#else
+    xTaskCreatePinnedToCore(supervisor_task, "supervisor_task", SUPERVISOR_STACK, NULL, CONFIG_MDF_TASK_DEFAULT_PRIOTY,
+                            &supervisor_task_handle, tskNO_AFFINITY);
+#endif
+    MDF_ERROR_ASSERT(supervisor_task_handle ? MDF_OK : MDF_ERR_NO_MEM);
+}
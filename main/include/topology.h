@@ -0,0 +1,186 @@
+/*
+ * ESP32 Mesh Network
+ * Copyright 2021, FCRLab at University of Messina (Messina, Italy)
+ *
+ * @maintainer: Lorenzo Carnevale <lcarnevale@unime.it>
+ */
+
+#include "esp_timer.h"
+#include "mwifi.h"
+
+/**
+ * @brief Mesh topology, as seen by the root.
+ *
+ * The tree is built from the routing table of the root, which tells which
+ * nodes are in the mesh, and from the health frames, which tell their parent,
+ * layer, link RSSI and subtree size. Every CONFIG_TOPOLOGY_PERIOD_MS only the
+ * nodes that changed since the last publication are published:
+ *
+ *     {"seq": 8, "full": false, "nodes": [{"mac": ..., "parent": ..., "layer": 2,
+ *      "rssi": -61, "subtree": 3}], "removed": ["30:ae:a4:80:12:34"]}
+ *
+ * Every CONFIG_TOPOLOGY_FULL_EVERY publications the whole tree is published
+ * instead, with "full" set, so that late subscribers can catch up. The state of
+ * the nodes is taken as published only once the TX stage took the message, so
+ * a lost diff is sent again.
+ */
+#define TOPOLOGY_RSSI_STEP 6    /* dBm of RSSI change published as a change */
+
+/**
+ * @brief State of a changed node, as in the message being published.
+ */
+typedef struct {
+    bool changed;
+    bool present;
+    uint8_t addr[MWIFI_ADDR_LEN];
+    uint8_t parent[MWIFI_ADDR_LEN];
+    uint8_t layer;
+    int8_t rssi;
+} topology_pending_t;
+
+static esp_timer_handle_t topology_timer = NULL;
+static uint32_t topology_seq = 0;
+static topology_pending_t topology_pending[CONFIG_NODESTATS_MAX_NODES] = {0};
+
+
+static bool topology_changed(const nodestats_entry_t *entry, bool present) {
+    if (present != entry->topo_present)
+        return true;
+    if (!present || !entry->health_us)
+        return false;
+
+    int rssi_delta = entry->health.rssi - entry->topo_rssi;
+    return memcmp(entry->topo_parent, entry->health.parent, MWIFI_ADDR_LEN) ||
+           entry->topo_layer != entry->health.layer ||
+           rssi_delta >= TOPOLOGY_RSSI_STEP || -rssi_delta >= TOPOLOGY_RSSI_STEP;
+}
+
+static void topology_add_node(cJSON *json_nodes, const nodestats_entry_t *entry) {
+    char mac[18] = {0};
+    cJSON *json_node = cJSON_CreateObject();
+
+    snprintf(mac, sizeof(mac), MACSTR, MAC2STR(entry->addr));
+    cJSON_AddStringToObject(json_node, "mac", mac);
+    if (entry->health_us) {
+        snprintf(mac, sizeof(mac), MACSTR, MAC2STR(entry->health.parent));
+        cJSON_AddStringToObject(json_node, "parent", mac);
+        cJSON_AddNumberToObject(json_node, "layer", entry->health.layer);
+        cJSON_AddNumberToObject(json_node, "rssi", entry->health.rssi);
+        cJSON_AddNumberToObject(json_node, "subtree", entry->health.subtree);
+    }
+    cJSON_AddItemToArray(json_nodes, json_node);
+}
+
+/**
+ * @brief Take the changes of a published message as the state last published,
+ *        for the nodes that kept their entry.
+ */
+static void topology_commit(void) {
+    portENTER_CRITICAL(&nodestats_lock);
+    for (int i = 0; i < CONFIG_NODESTATS_MAX_NODES; i++) {
+        const topology_pending_t *pending = &topology_pending[i];
+        if (!pending->changed || memcmp(nodestats[i].addr, pending->addr, MWIFI_ADDR_LEN))
+            continue;
+        nodestats[i].topo_present = pending->present;
+        memcpy(nodestats[i].topo_parent, pending->parent, MWIFI_ADDR_LEN);
+        nodestats[i].topo_layer = pending->layer;
+        nodestats[i].topo_rssi  = pending->rssi;
+    }
+    portEXIT_CRITICAL(&nodestats_lock);
+}
+
+/**
+ * @brief Compare the tree with the one last published and publish the
+ *        difference. Run by the report task.
+ */
+static void topology_report(void) {
+    if (!esp_mesh_is_root())
+        return;
+
+    int table_size = 0;
+    int routes_num = esp_mesh_get_routing_table_size();
+    mesh_addr_t *routes = HOTPATH_MALLOC(HEAP_TAG_TOPOLOGY, routes_num * sizeof(mesh_addr_t));
+    MDF_ERROR_CHECK(!routes, , "Allocate routing table, size: %d", routes_num);
+    esp_mesh_get_routing_table(routes, routes_num * sizeof(mesh_addr_t), &table_size);
+
+    // nodes in the routing table that never sent anything get an entry too
+    portENTER_CRITICAL(&nodestats_lock);
+    for (int i = 0; i < table_size; i++)
+        nodestats_lookup(routes[i].addr);
+    portEXIT_CRITICAL(&nodestats_lock);
+
+    bool full = !topology_seq || (CONFIG_TOPOLOGY_FULL_EVERY && topology_seq % CONFIG_TOPOLOGY_FULL_EVERY == 0);
+    int changes = 0;
+    char mac[18] = {0};
+    cJSON *json_root    = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json_root, "seq", topology_seq);
+    cJSON_AddBoolToObject(json_root, "full", full);
+    cJSON *json_nodes   = cJSON_AddArrayToObject(json_root, "nodes");
+    cJSON *json_removed = cJSON_AddArrayToObject(json_root, "removed");
+
+    for (int i = 0; i < CONFIG_NODESTATS_MAX_NODES; i++) {
+        nodestats_entry_t entry;
+        bool present = false;
+
+        portENTER_CRITICAL(&nodestats_lock);
+        entry = nodestats[i];
+        portEXIT_CRITICAL(&nodestats_lock);
+
+        if (!entry.used)
+            continue;
+        for (int j = 0; j < table_size && !present; j++)
+            present = !memcmp(routes[j].addr, entry.addr, MWIFI_ADDR_LEN);
+
+        bool changed = topology_changed(&entry, present);
+        topology_pending_t *pending = &topology_pending[i];
+        pending->changed = changed;
+        if (present && (changed || full)) {
+            topology_add_node(json_nodes, &entry);
+        } else if (!present && changed) {
+            snprintf(mac, sizeof(mac), MACSTR, MAC2STR(entry.addr));
+            cJSON_AddItemToArray(json_removed, cJSON_CreateString(mac));
+        }
+
+        if (changed) {
+            changes++;
+            pending->present = present;
+            memcpy(pending->addr, entry.addr, MWIFI_ADDR_LEN);
+            memcpy(pending->parent, entry.health.parent, MWIFI_ADDR_LEN);
+            pending->layer = entry.health.layer;
+            pending->rssi  = entry.health.rssi;
+        }
+    }
+    HEAP_FREE(routes);
+
+    if (!changes && !full) {
+        cJSON_Delete(json_root);
+        return;
+    }
+
+    char *payload = cJSON_PrintUnformatted(json_root);
+    cJSON_Delete(json_root);
+    MDF_ERROR_CHECK(!payload, , "cJSON_PrintUnformatted, topology");
+
+    // the payload buffer is moved to the TX stage, which releases it
+    mdf_err_t ret = pipeline_forward(MQTT_TOPIC_TOPOLOGY, payload, strlen(payload));
+    MDF_ERROR_CHECK(ret != MDF_OK, , "Topology %d dropped, send it again", topology_seq);
+    MDF_LOGD("Topology %s %d, changes: %d", full ? "snapshot" : "diff", topology_seq, changes);
+    topology_commit();
+    topology_seq++;
+}
+
+static void topology_timer_cb(void *arg) {
+    report_submit(topology_report);
+}
+
+void topology_start(void) {
+    if (topology_timer)
+        return;
+
+    esp_timer_create_args_t timer_args = {
+        .callback = topology_timer_cb,
+        .name     = "topology",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &topology_timer));
+    ESP_ERROR_CHECK(esp_timer_start_periodic(topology_timer, (uint64_t)CONFIG_TOPOLOGY_PERIOD_MS * 1000));
+}
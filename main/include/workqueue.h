@@ -0,0 +1,127 @@
+/*
+ * ESP32 Mesh Network
+ * Copyright 2021, FCRLab at University of Messina (Messina, Italy)
+ *
+ * @maintainer: Lorenzo Carnevale <lcarnevale@unime.it>
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+#include "esp_timer.h"
+
+/**
+ * @brief Deferred work.
+ *
+ * The MDF event task must not block, so the event handlers only queue a job
+ * which a dedicated worker runs in order. The time every job waited in the
+ * queue and took to run is accounted per type, so that slow handlers show up.
+ */
+typedef enum {
+    WORK_PARENT_CONNECTED = 0,
+    WORK_PARENT_DISCONNECTED,
+    WORK_ROOT_GOT_IP,
+    WORK_ROOT_LOST_IP,
+    WORK_MUPGRADE_STARTED,
+    WORK_FASTJOIN_FALLBACK,
+    WORK_TYPE_MAX,
+} work_type_t;
+
+typedef mdf_err_t (*work_fn_t)(void);
+
+typedef struct {
+    work_type_t type;
+    work_fn_t fn;
+    int64_t queued_us;
+} work_job_t;
+
+typedef struct {
+    const char *name;
+    uint32_t runs;
+    uint32_t errors;
+    uint32_t dropped;       /* jobs lost because the queue was full */
+    int64_t wait_us;        /* total time in the queue */
+    int64_t wait_max_us;
+    int64_t exec_us;        /* total time running */
+    int64_t exec_max_us;
+} work_stats_t;
+
+static work_stats_t work_stats[WORK_TYPE_MAX] = {
+    [WORK_PARENT_CONNECTED]    = {.name = "parent_connected"},
+    [WORK_PARENT_DISCONNECTED] = {.name = "parent_disconnected"},
+    [WORK_ROOT_GOT_IP]         = {.name = "root_got_ip"},
+    [WORK_ROOT_LOST_IP]        = {.name = "root_lost_ip"},
+    [WORK_MUPGRADE_STARTED]    = {.name = "mupgrade_started"},
+    [WORK_FASTJOIN_FALLBACK]   = {.name = "fastjoin_fallback"},
+};
+static QueueHandle_t work_queue = NULL;
+
+
+static void work_task(void *arg) {
+    work_job_t job;
+
+    MDF_LOGI("Work task is running");
+
+    for (;;) {
+        if (xQueueReceive(work_queue, &job, portMAX_DELAY) != pdTRUE)
+            continue;
+
+        int64_t start_us = esp_timer_get_time();
+        mdf_err_t ret = job.fn();
+        int64_t end_us = esp_timer_get_time();
+
+        work_stats_t *stats = &work_stats[job.type];
+        int64_t wait_us = start_us - job.queued_us, exec_us = end_us - start_us;
+        stats->runs++;
+        stats->errors += ret != MDF_OK;
+        stats->wait_us += wait_us;
+        stats->exec_us += exec_us;
+        if (wait_us > stats->wait_max_us)
+            stats->wait_max_us = wait_us;
+        if (exec_us > stats->exec_max_us)
+            stats->exec_max_us = exec_us;
+
+        if (exec_us > (int64_t)CONFIG_WORKQUEUE_SLOW_MS * 1000)
+            MDF_LOGW("Slow job %s, waited: %lld ms, ran: %lld ms", stats->name, wait_us / 1000, exec_us / 1000);
+    }
+}
+
+/**
+ * @brief Queue a job, never blocking the caller.
+ */
+mdf_err_t work_submit(work_type_t type, work_fn_t fn) {
+    work_job_t job = {
+        .type      = type,
+        .fn        = fn,
+        .queued_us = esp_timer_get_time(),
+    };
+
+    MDF_ERROR_CHECK(!work_queue, MDF_ERR_INVALID_STATE, "Work queue is not running");
+    if (xQueueSend(work_queue, &job, 0) != pdTRUE) {
+        work_stats[type].dropped++;
+        MDF_LOGW("Work queue full, drop job %s", work_stats[type].name);
+        return MDF_FAIL;
+    }
+
+    return MDF_OK;
+}
+
+void work_log_stats(void) {
+    for (int type = 0; type < WORK_TYPE_MAX; type++) {
+        const work_stats_t *stats = &work_stats[type];
+        if (!stats->runs && !stats->dropped)
+            continue;
+
+        MDF_LOGI("Job %s, runs: %d, errors: %d, dropped: %d, wait avg/max: %lld/%lld ms, exec avg/max: %lld/%lld ms",
+                 stats->name, stats->runs, stats->errors, stats->dropped,
+                 stats->runs ? stats->wait_us / stats->runs / 1000 : 0, stats->wait_max_us / 1000,
+                 stats->runs ? stats->exec_us / stats->runs / 1000 : 0, stats->exec_max_us / 1000);
+    }
+}
+
+void work_start(void) {
+    if (!work_queue)
+        work_queue = staticmem_queue("work_queue", CONFIG_WORKQUEUE_LEN, sizeof(work_job_t));
+    supervisor_start(SUPERVISOR_WORK, work_task);
+}
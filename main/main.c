@@ -44,9 +44,11 @@ static mdf_err_t mesh_init() {
         .mesh_id         = CONFIG_MESH_ID,
     };
 
+    fastjoin_apply(&config);
     MDF_ERROR_ASSERT(mdf_event_loop_init(event_mesh_callback));
     MDF_ERROR_ASSERT(mwifi_init(&cfg));
     MDF_ERROR_ASSERT(mwifi_set_config(&config));
+    powersave_enable();
 
     return MDF_OK;
 }
@@ -58,8 +60,13 @@ void setup(void) {
     esp_log_level_set(TAG, ESP_LOG_DEBUG);
     
     char *sta_mac_addr = get_mac_address(ESP_MAC_WIFI_STA);
+    staticmem_init();
+    supervisor_init();
+    work_start();
+    downlink_init();
     MDF_ERROR_ASSERT(wifi_init());
     MDF_ERROR_ASSERT(mesh_init());
+    staticmem_boot_done();
 }
 
 void start(void) {
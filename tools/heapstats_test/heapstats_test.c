@@ -0,0 +1,179 @@
+/*
+ * ESP32 Mesh Network
+ * Copyright 2021, FCRLab at University of Messina (Messina, Italy)
+ *
+ * @maintainer: Lorenzo Carnevale <lcarnevale@unime.it>
+ */
+
+#include "host.h"
+#include "protocols.h"
+#include "heapstats.h"
+
+/**
+ * @brief Host test of the tagged allocation wrappers of heapstats.h.
+ *
+ *     make -C tools/heapstats_test          build and run
+ *     heapstats_test --leak                 leak one block, which must fail
+ *
+ * The wrappers are checked against the blocks the test keeps itself, through
+ * collisions in the block table, random frees and a full table. It exits
+ * non-zero on any mismatch, and on live bytes left once everything was freed.
+ */
+#define TEST_BLOCKS (CONFIG_HEAPSTATS_MAX_BLOCKS * 2)
+#define TEST_ROUNDS 2000
+
+typedef struct {
+    void *ptr;
+    size_t size;
+    heap_tag_t tag;
+} test_block_t;
+
+static test_block_t test_blocks[TEST_BLOCKS] = {0};
+static int test_failures = 0;
+
+#define TEST_CHECK(cond, format, ...) do {                                  \
+        if (!(cond)) {                                                      \
+            printf("FAIL %s:%d " format "\n", __func__, __LINE__, ##__VA_ARGS__); \
+            test_failures++;                                                \
+        }                                                                   \
+    } while (0)
+
+
+static int test_tracked(void) {
+    int tracked = 0;
+    for (int slot = 0; slot < CONFIG_HEAPSTATS_MAX_BLOCKS; slot++)
+        tracked += heapstats_blocks[slot].ptr != NULL;
+    return tracked;
+}
+
+/**
+ * @brief Every block of the table is found from its home slot, and the live bytes
+ *        of every tag add up to the tracked blocks.
+ */
+static void test_consistent(void) {
+    uint32_t live[HEAP_TAG_MAX] = {0};
+
+    for (int slot = 0; slot < CONFIG_HEAPSTATS_MAX_BLOCKS; slot++) {
+        const heapstats_block_t *block = &heapstats_blocks[slot];
+        if (!block->ptr)
+            continue;
+        live[block->tag] += block->size;
+
+        size_t probe = heapstats_slot(block->ptr);
+        while (probe != slot && heapstats_blocks[probe].ptr)
+            probe = (probe + 1) % CONFIG_HEAPSTATS_MAX_BLOCKS;
+        TEST_CHECK(probe == slot, "block %p in slot %d unreachable from slot %d",
+                   block->ptr, slot, (int)heapstats_slot(block->ptr));
+    }
+
+    for (int tag = 0; tag < HEAP_TAG_MAX; tag++) {
+        TEST_CHECK(heapstats_tags[tag].live == live[tag], "tag %s, live: %u, tracked: %u",
+                   heap_tag_names[tag], heapstats_tags[tag].live, live[tag]);
+        TEST_CHECK(heapstats_tags[tag].peak >= heapstats_tags[tag].live, "tag %s, peak below live",
+                   heap_tag_names[tag]);
+    }
+}
+
+static void test_free(test_block_t *block) {
+    HEAP_FREE(block->ptr);
+    TEST_CHECK(!block->ptr, "HEAP_FREE leaves the pointer set");
+}
+
+/**
+ * @brief Every tag, one block each, then freed.
+ */
+static void test_tags(void) {
+    for (int tag = 0; tag < HEAP_TAG_MAX; tag++) {
+        test_block_t *block = &test_blocks[tag];
+        uint32_t allocs = heapstats_tags[tag].allocs;
+
+        block->tag  = tag;
+        block->size = 16 * (tag + 1);
+        block->ptr  = tag % 2 ? HEAP_MALLOC(tag, block->size) : HEAP_CALLOC(tag, 4, block->size / 4);
+        TEST_CHECK(block->ptr, "tag %s, allocation failed", heap_tag_names[tag]);
+        TEST_CHECK(heapstats_tags[tag].live == block->size, "tag %s, live: %u, expected: %zu",
+                   heap_tag_names[tag], heapstats_tags[tag].live, block->size);
+        TEST_CHECK(heapstats_tags[tag].allocs == allocs + 1, "tag %s, allocs not counted", heap_tag_names[tag]);
+    }
+    test_consistent();
+
+    health_frame_t health = {0};
+    heapstats_health(&health);
+    for (int tag = 0; tag < HEAP_TAG_MAX; tag++)
+        TEST_CHECK(health.heap[tag].live == test_blocks[tag].size, "tag %s, health live: %u",
+                   heap_tag_names[tag], health.heap[tag].live);
+
+    for (int tag = 0; tag < HEAP_TAG_MAX; tag++)
+        test_free(&test_blocks[tag]);
+    test_consistent();
+    TEST_CHECK(!test_tracked(), "blocks left in the table: %d", test_tracked());
+}
+
+/**
+ * @brief Random allocations and frees, more than the table holds, so that the
+ *        probe sequences collide and wrap around and some blocks go untracked.
+ */
+static void test_random(void) {
+    srand(1);
+
+    for (int round = 0; round < TEST_ROUNDS; round++) {
+        test_block_t *block = &test_blocks[rand() % TEST_BLOCKS];
+
+        if (block->ptr) {
+            test_free(block);
+        } else {
+            block->tag  = rand() % HEAP_TAG_MAX;
+            block->size = 1 + rand() % 512;
+            block->ptr  = HEAP_MALLOC(block->tag, block->size);
+            TEST_CHECK(block->ptr, "allocation failed, size: %zu", block->size);
+        }
+        test_consistent();
+        if (test_failures)
+            return;
+    }
+
+    TEST_CHECK(heapstats_untracked, "the table never filled up, raise TEST_BLOCKS");
+    for (int i = 0; i < TEST_BLOCKS; i++) {
+        if (test_blocks[i].ptr)
+            test_free(&test_blocks[i]);
+    }
+    test_consistent();
+}
+
+/**
+ * @brief Pointers the table does not know, NULL included, are left alone.
+ */
+static void test_unknown(void) {
+    void *ptr = malloc(32);
+    uint32_t live = heapstats_tags[HEAP_TAG_TASKS].live;
+
+    HEAP_FREE(ptr);
+    ptr = NULL;
+    HEAP_FREE(ptr);
+    TEST_CHECK(heapstats_tags[HEAP_TAG_TASKS].live == live, "unknown pointer accounted");
+    TEST_CHECK(!heapstats_alloc(HEAP_TAG_TASKS, NULL, 32), "failed allocation accounted");
+    test_consistent();
+}
+
+int main(int argc, char **argv) {
+    bool leak = argc > 1 && !strcmp(argv[1], "--leak");
+
+    test_tags();
+    test_random();
+    test_unknown();
+    if (leak)
+        test_blocks[0].ptr = HEAP_MALLOC(HEAP_TAG_PIPELINE, 100);
+
+    heapstats_log_stats();
+
+    uint32_t leaked = 0;
+    for (int tag = 0; tag < HEAP_TAG_MAX; tag++) {
+        if (heapstats_tags[tag].live)
+            printf("LEAK tag %s, live: %u bytes\n", heap_tag_names[tag], heapstats_tags[tag].live);
+        leaked += heapstats_tags[tag].live;
+    }
+
+    printf("%s: %d failures, %u bytes leaked, %u blocks untracked\n", leaked || test_failures ? "FAIL" : "OK",
+           test_failures, leaked, heapstats_untracked);
+    return leaked || test_failures;
+}
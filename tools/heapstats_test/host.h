@@ -0,0 +1,35 @@
+/*
+ * ESP32 Mesh Network
+ * Copyright 2021, FCRLab at University of Messina (Messina, Italy)
+ *
+ * @maintainer: Lorenzo Carnevale <lcarnevale@unime.it>
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief What heapstats.h needs from ESP-IDF and ESP-MDF, on the host. The
+ *        esp_timer.h next to it stands in for the one of ESP-IDF.
+ */
+#define CONFIG_HEAPSTATS_ENABLE 1
+#ifndef CONFIG_HEAPSTATS_MAX_BLOCKS
+#define CONFIG_HEAPSTATS_MAX_BLOCKS 64
+#endif
+
+#define MDF_MALLOC(size)        malloc(size)
+#define MDF_CALLOC(count, size) calloc(count, size)
+#define MDF_FREE(ptr)           do { free((void *)(ptr)); (ptr) = NULL; } while (0)
+
+#define MDF_LOGI(format, ...) printf("I " format "\n", ##__VA_ARGS__)
+#define MDF_LOGW(format, ...) printf("W " format "\n", ##__VA_ARGS__)
+
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(lock) (void)(lock)
+#define portEXIT_CRITICAL(lock)  (void)(lock)
+
+#define esp_random() ((uint32_t)rand())
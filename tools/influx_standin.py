@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+#
+# ESP32 Mesh Network
+# Copyright 2021, FCRLab at University of Messina (Messina, Italy)
+#
+# @maintainer: Lorenzo Carnevale <lcarnevale@unime.it>
+#
+"""Local stand-in of the InfluxDB /write endpoint, to test the sink of the root.
+
+    influx_standin.py                       listen on port 8086
+    influx_standin.py --port 9000 --fail 3  answer 503 to every third write
+    influx_standin.py --fail 2 --status 400 answer 400, which is not retried
+
+Point CONFIG_INFLUX_SINK_URL at http://<host>:<port>/write?db=mesh&precision=s.
+Every batch is decoded as the sink sends it, gzip'd or not, and each line is
+checked against the line protocol. The server keeps the connections alive, so
+the reuse of the HTTP handle shows in the connection number of the log. Ctrl-C
+prints the totals.
+"""
+
+import argparse
+import gzip
+import http.server
+import re
+import sys
+import threading
+
+# measurement[,tag=value...] field=value[,field=value...] [timestamp]
+KEY = r"(?:[^,= \\]|\\.)+"
+FIELD_VALUE = r'(?:"(?:[^"\\]|\\.)*"|[^, "]+)'
+LINE = re.compile(r"^(?:[^, \\]|\\.)+(?:,%s=%s)* %s=%s(?:,%s=%s)*(?: -?\d+)?$"
+                  % (KEY, KEY, KEY, FIELD_VALUE, KEY, FIELD_VALUE))
+
+
+class Totals:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.connections = 0
+        self.writes = 0
+        self.failed = 0
+        self.points = 0
+        self.invalid = 0
+        self.raw_bytes = 0
+        self.sent_bytes = 0
+
+    def __str__(self):
+        return ("connections: %d, writes: %d, failed: %d, points: %d, invalid: %d, bytes: %d/%d"
+                % (self.connections, self.writes, self.failed, self.points, self.invalid,
+                   self.sent_bytes, self.raw_bytes))
+
+
+class WriteHandler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"    # keep-alive, as InfluxDB
+
+    def setup(self):
+        super().setup()
+        with self.server.totals.lock:
+            self.server.totals.connections += 1
+            self.connection_id = self.server.totals.connections
+
+    def do_POST(self):
+        totals = self.server.totals
+        body = self.rfile.read(int(self.headers.get("Content-Length", 0)))
+
+        with totals.lock:
+            totals.writes += 1
+            write = totals.writes
+        if self.server.fail and write % self.server.fail == 0:
+            with totals.lock:
+                totals.failed += 1
+            self.log_message("connection %d, write %d: failed with %d",
+                             self.connection_id, write, self.server.status)
+            return self.answer(self.server.status)
+
+        if not self.path.startswith("/write"):
+            return self.answer(404)
+        sent = len(body)
+        if self.headers.get("Content-Encoding") == "gzip":
+            try:
+                body = gzip.decompress(body)
+            except (OSError, EOFError) as e:
+                self.log_message("connection %d, write %d: bad gzip, %s", self.connection_id, write, e)
+                return self.answer(400)
+
+        lines = body.decode("utf-8", "replace").splitlines()
+        invalid = [line for line in lines if not LINE.match(line)]
+        with totals.lock:
+            totals.points += len(lines) - len(invalid)
+            totals.invalid += len(invalid)
+            totals.raw_bytes += len(body)
+            totals.sent_bytes += sent
+
+        self.log_message("connection %d, write %d: %d points, %d/%d bytes",
+                         self.connection_id, write, len(lines), sent, len(body))
+        if self.server.verbose:
+            for line in lines:
+                print("    " + line)
+        for line in invalid:
+            self.log_message("invalid line: %s", line)
+        self.answer(400 if invalid else 204)
+
+    def answer(self, status):
+        self.send_response(status)
+        self.send_header("Content-Length", "0")
+        self.end_headers()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Local stand-in of the InfluxDB /write endpoint")
+    parser.add_argument("--host", default="0.0.0.0")
+    parser.add_argument("--port", type=int, default=8086)
+    parser.add_argument("--fail", type=int, default=0, metavar="N", help="fail every N-th write")
+    parser.add_argument("--status", type=int, default=503, help="of the failed writes")
+    parser.add_argument("--verbose", action="store_true", help="print every line received")
+    args = parser.parse_args()
+
+    server = http.server.ThreadingHTTPServer((args.host, args.port), WriteHandler)
+    server.totals = Totals()
+    server.fail = args.fail
+    server.status = args.status
+    server.verbose = args.verbose
+
+    print("listening on %s:%d" % (args.host, args.port))
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    server.server_close()
+    print(server.totals)
+    sys.exit(1 if server.totals.invalid else 0)
+
+
+if __name__ == "__main__":
+    main()
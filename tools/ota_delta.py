@@ -0,0 +1,250 @@
+#!/usr/bin/env python3
+#
+# ESP32 Mesh Network
+# Copyright 2021, FCRLab at University of Messina (Messina, Italy)
+#
+# @maintainer: Lorenzo Carnevale <lcarnevale@unime.it>
+#
+"""Patches for the delta OTA of the mesh, see main/include/ota.h.
+
+    ota_delta.py diff  OLD.bin NEW.bin PATCH.bin   make a patch from OLD to NEW
+    ota_delta.py apply OLD.bin PATCH.bin OUT.bin   rebuild NEW as the nodes do
+    ota_delta.py bench OLD.bin NEW.bin             round trip, sizes and timings
+    ota_delta.py bench --synthetic                 same, on generated images
+
+A patch is an ota_delta_header_t followed by COPY operations, which take a
+range of the running firmware, and INSERT operations, which carry new bytes.
+Serve the patch on the OTA endpoint instead of the image: the root tells it by
+its magic and streams it like an image.
+"""
+
+import argparse
+import hashlib
+import random
+import struct
+import sys
+import time
+
+MAGIC = b"ESPD"
+VERSION = 1
+HEADER = struct.Struct("<4sB3xI32s32s")
+OP_COPY = 1
+OP_INSERT = 2
+COPY = struct.Struct("<BII")
+INSERT = struct.Struct("<BI")
+
+SEED = 16           # bytes a match starts from
+STEP = 4            # the old firmware is indexed every STEP bytes
+MIN_MATCH = 24      # shorter matches cost more as COPY than as data
+CANDIDATES = 8      # positions kept per seed
+
+CHUNK_SIZE = 1024           # OTA_CHUNK_SIZE
+SECTOR_SIZE = 4096
+PARTITION_SIZE = 1920 * 1024
+
+IMAGE_MAGIC = 0xE9
+HASH_APPENDED_OFFSET = 23
+
+
+class PatchError(Exception):
+    pass
+
+
+def firmware_digest(image):
+    """SHA-256 as esp_partition_get_sha256() returns it for an app partition:
+    the hash appended by esptool when there is one, else the hash of the image."""
+    if len(image) > 32 and image[0] == IMAGE_MAGIC and image[HASH_APPENDED_OFFSET] == 1:
+        return bytes(image[-32:])
+    return hashlib.sha256(image).digest()
+
+
+def sectors(size):
+    return (size + SECTOR_SIZE - 1) // SECTOR_SIZE * SECTOR_SIZE
+
+
+def index_seeds(old):
+    seeds = {}
+    for offset in range(0, len(old) - SEED + 1, STEP):
+        positions = seeds.setdefault(old[offset:offset + SEED], [])
+        if len(positions) < CANDIDATES:
+            positions.append(offset)
+    return seeds
+
+
+def match_length(old, new, old_offset, new_offset):
+    limit = min(len(old) - old_offset, len(new) - new_offset)
+    length = 0
+    while length < limit and old[old_offset + length] == new[new_offset + length]:
+        length += 1
+    return length
+
+
+def diff(old, new):
+    seeds = index_seeds(old)
+    ops = []
+    pending = bytearray()
+    position = 0
+
+    while position < len(new):
+        best_offset, best_length = 0, 0
+        for offset in seeds.get(new[position:position + SEED], ()):
+            length = match_length(old, new, offset, position)
+            if length > best_length:
+                best_offset, best_length = offset, length
+
+        if best_length < MIN_MATCH:
+            pending.append(new[position])
+            position += 1
+            continue
+
+        # the match may start before the seed, in the bytes not matched yet
+        position += best_length
+        while pending and best_offset and old[best_offset - 1] == pending[-1]:
+            pending.pop()
+            best_offset -= 1
+            best_length += 1
+
+        if pending:
+            ops.append(INSERT.pack(OP_INSERT, len(pending)) + bytes(pending))
+            pending.clear()
+        ops.append(COPY.pack(OP_COPY, best_offset, best_length))
+
+    if pending:
+        ops.append(INSERT.pack(OP_INSERT, len(pending)) + bytes(pending))
+
+    header = HEADER.pack(MAGIC, VERSION, len(new), firmware_digest(old), firmware_digest(new))
+    return header + b"".join(ops)
+
+
+def apply(old, patch):
+    """Rebuild the firmware with the checks of ota_delta_apply()."""
+    if len(patch) < HEADER.size:
+        raise PatchError("truncated patch")
+    magic, version, target_size, base_sha256, target_sha256 = HEADER.unpack_from(patch)
+    if magic != MAGIC or version != VERSION:
+        raise PatchError("unsupported patch, version %d" % version)
+    if firmware_digest(old) != base_sha256:
+        raise PatchError("patch made against another firmware")
+    if sectors(target_size) + sectors(len(patch)) > PARTITION_SIZE:
+        raise PatchError("firmware and patch do not fit the partition together")
+
+    out = bytearray()
+    offset = HEADER.size
+    while offset < len(patch):
+        op = patch[offset]
+        if op == OP_COPY:
+            _, source, length = COPY.unpack_from(patch, offset)
+            offset += COPY.size
+            if source + length > len(old):
+                raise PatchError("copy past the firmware at %d" % offset)
+            out += old[source:source + length]
+        elif op == OP_INSERT:
+            _, length = INSERT.unpack_from(patch, offset)
+            offset += INSERT.size
+            if offset + length > len(patch):
+                raise PatchError("insert past the patch at %d" % offset)
+            out += patch[offset:offset + length]
+            offset += length
+        else:
+            raise PatchError("invalid operation %d at %d" % (op, offset))
+        if len(out) > target_size:
+            raise PatchError("firmware longer than %d bytes" % target_size)
+
+    if len(out) != target_size or firmware_digest(out) != target_sha256:
+        raise PatchError("patched firmware does not match its hash")
+    return bytes(out)
+
+
+def synthetic_images(size, seed):
+    """An old firmware and a new one with the edits a rebuild makes: a few
+    changed functions, code moved by some bytes, a new block and new strings."""
+    rng = random.Random(seed)
+    words = [rng.getrandbits(32).to_bytes(4, "little") for _ in range(512)]
+    old = bytearray(b"".join(rng.choice(words) for _ in range(size // 4)))
+
+    new = bytearray(old)
+    for _ in range(20):
+        at = rng.randrange(len(new))
+        new[at:at + rng.randrange(16, 256)] = rng.randbytes(rng.randrange(16, 256))
+    for _ in range(5):
+        at = rng.randrange(len(new))
+        new[at:at] = rng.randbytes(rng.choice((4, 8, 12)))
+    at = rng.randrange(len(new))
+    new[at:at] = rng.randbytes(8 * 1024)
+    new += b"built %d\x00" % seed
+    return bytes(old), bytes(new)
+
+
+def bench(old, new):
+    start = time.perf_counter()
+    patch = diff(old, new)
+    diff_s = time.perf_counter() - start
+
+    start = time.perf_counter()
+    out = apply(old, patch)
+    apply_s = time.perf_counter() - start
+    if out != new:
+        raise PatchError("round trip does not rebuild the new firmware")
+
+    full_chunks = -(-len(new) // CHUNK_SIZE)
+    patch_chunks = -(-len(patch) // CHUNK_SIZE)
+    print("old firmware:   %8d bytes" % len(old))
+    print("new firmware:   %8d bytes, %d chunks" % (len(new), full_chunks))
+    print("patch:          %8d bytes, %d chunks, %.1f%% of the firmware"
+          % (len(patch), patch_chunks, 100.0 * len(patch) / len(new)))
+    print("diff:           %8.2f s" % diff_s)
+    print("apply:          %8.2f s" % apply_s)
+    print("round trip:     ok")
+
+
+def read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def write(path, data):
+    with open(path, "wb") as f:
+        f.write(data)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Patches for the delta OTA of the mesh")
+    commands = parser.add_subparsers(dest="command", required=True)
+
+    command = commands.add_parser("diff", help="make a patch from OLD to NEW")
+    command.add_argument("old")
+    command.add_argument("new")
+    command.add_argument("patch")
+
+    command = commands.add_parser("apply", help="rebuild NEW from OLD and a patch")
+    command.add_argument("old")
+    command.add_argument("patch")
+    command.add_argument("out")
+
+    command = commands.add_parser("bench", help="round trip with sizes and timings")
+    command.add_argument("old", nargs="?")
+    command.add_argument("new", nargs="?")
+    command.add_argument("--synthetic", action="store_true", help="generate the two firmwares")
+    command.add_argument("--size", type=int, default=1024 * 1024, help="of the generated firmwares")
+    command.add_argument("--seed", type=int, default=1)
+
+    args = parser.parse_args()
+    try:
+        if args.command == "diff":
+            patch = diff(read(args.old), read(args.new))
+            write(args.patch, patch)
+            print("patch: %d bytes" % len(patch))
+        elif args.command == "apply":
+            write(args.out, apply(read(args.old), read(args.patch)))
+        elif args.synthetic:
+            bench(*synthetic_images(args.size, args.seed))
+        elif args.old and args.new:
+            bench(read(args.old), read(args.new))
+        else:
+            parser.error("bench needs OLD and NEW, or --synthetic")
+    except PatchError as e:
+        sys.exit("error: %s" % e)
+
+
+if __name__ == "__main__":
+    main()